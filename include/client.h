@@ -38,7 +38,10 @@ typedef struct rtptun_client
 } rtptun_client_t;
 
 rtptun_client_t *rtptun_client_new(struct ev_loop *loop, const char *local_addr, const char *local_port,
-                                   const char *remote_addr, const char *remote_port, const char *key);
+                                   const char *remote_addr, const char *remote_port, const char *key,
+                                   const udp_options_t *options);
 void rtptun_client_free(rtptun_client_t *client);
 
+void rtptun_client_log_stats(rtptun_client_t *client);
+
 #endif
\ No newline at end of file
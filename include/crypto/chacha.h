@@ -2,6 +2,7 @@
 #define RTPTUN_CRYPTO_CHACHA_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <sodium/crypto_aead_chacha20poly1305.h>
 
@@ -27,9 +28,13 @@ typedef struct chacha_cipher
 chacha_ret_t chacha_gen_key(char **buf, size_t *len);
 
 chacha_ret_t chacha_init(chacha_cipher_t *cipher, const char *b64_key);
+void chacha_set_domain(chacha_cipher_t *cipher, uint8_t domain);
+// ad is authenticated along with the data without being encrypted, NULL if there is none
 chacha_ret_t chacha_encrypt(chacha_cipher_t *cipher, const unsigned char *data, size_t data_len,
+                            const unsigned char *ad, size_t ad_len,
                             unsigned char *ciphertext, unsigned char mac[CHACHA_MAC_LEN], unsigned char nonce[CHACHA_NONCE_LEN]);
 chacha_ret_t chacha_decrypt(chacha_cipher_t *cipher, const unsigned char *ciphertext, size_t ciphertext_len,
+                            const unsigned char *ad, size_t ad_len,
                             const unsigned char mac[CHACHA_MAC_LEN], const unsigned char nonce[CHACHA_NONCE_LEN], unsigned char *data);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,191 @@
+#ifndef RTPTUN_EPOLL_EV_H
+#define RTPTUN_EPOLL_EV_H
+
+// Stands in for <ev.h> in EPOLL=1 builds, implementing the part of the libev API rtptun uses on top
+// of edge-triggered epoll, timerfd, eventfd and signalfd
+
+#include <signal.h>
+#include <stdatomic.h>
+
+// Readiness is only reported when it changes, a watcher that stops reading before the descriptor
+// would block has to feed itself another event
+#define EV_EDGE_TRIGGERED 1
+
+#define EV_READ 0x01
+#define EV_WRITE 0x02
+#define EV__IOFDSET 0x80
+#define EV_TIMER 0x00000100
+#define EV_SIGNAL 0x00000400
+#define EV_IDLE 0x00002000
+#define EV_PREPARE 0x00004000
+#define EV_ASYNC 0x00080000
+
+#define EV_MINPRI -2
+#define EV_MAXPRI 2
+
+#define EVFLAG_AUTO 0
+
+#define EVRUN_NOWAIT 1
+#define EVRUN_ONCE 2
+
+#define EVBREAK_CANCEL 0
+#define EVBREAK_ONE 1
+#define EVBREAK_ALL 2
+
+typedef double ev_tstamp;
+
+struct ev_loop;
+
+#define EV_P struct ev_loop *loop
+#define EV_P_ EV_P,
+#define EV_A loop
+#define EV_A_ EV_A,
+#define EV_DEFAULT ev_default_loop(0)
+
+#define EV_WATCHER(type) \
+    int active;          \
+    int pending;         \
+    int priority;        \
+    void *data;          \
+    void (*cb)(struct ev_loop * loop, struct type * w, int revents);
+
+#define EV_WATCHER_LIST(type) \
+    EV_WATCHER(type)          \
+    struct type *next;
+
+typedef struct ev_watcher
+{
+    EV_WATCHER(ev_watcher)
+} ev_watcher;
+
+typedef struct ev_io
+{
+    EV_WATCHER_LIST(ev_io)
+
+    int fd;
+    int events;
+} ev_io;
+
+typedef struct ev_timer
+{
+    EV_WATCHER(ev_timer)
+
+    // Relative while stopped, absolute on the monotonic clock while running
+    ev_tstamp at;
+    ev_tstamp repeat;
+} ev_timer;
+
+typedef struct ev_prepare
+{
+    EV_WATCHER_LIST(ev_prepare)
+} ev_prepare;
+
+typedef struct ev_idle
+{
+    EV_WATCHER_LIST(ev_idle)
+} ev_idle;
+
+typedef struct ev_async
+{
+    EV_WATCHER_LIST(ev_async)
+
+    atomic_int sent;
+} ev_async;
+
+typedef struct ev_signal
+{
+    EV_WATCHER_LIST(ev_signal)
+
+    int signum;
+} ev_signal;
+
+#define ev_init(w, callback)  \
+    do                        \
+    {                         \
+        (w)->active = 0;      \
+        (w)->pending = 0;     \
+        (w)->priority = 0;    \
+        (w)->cb = (callback); \
+    } while (0)
+
+#define ev_io_set(w, fd_, events_)             \
+    do                                         \
+    {                                          \
+        (w)->fd = (fd_);                       \
+        (w)->events = (events_) | EV__IOFDSET; \
+    } while (0)
+#define ev_timer_set(w, after, repeat_) \
+    do                                  \
+    {                                   \
+        (w)->at = (after);              \
+        (w)->repeat = (repeat_);        \
+    } while (0)
+#define ev_signal_set(w, signum_) \
+    do                            \
+    {                             \
+        (w)->signum = (signum_);  \
+    } while (0)
+
+#define ev_io_init(w, cb, fd, events)   \
+    do                                  \
+    {                                   \
+        ev_init((w), (cb));             \
+        ev_io_set((w), (fd), (events)); \
+    } while (0)
+#define ev_timer_init(w, cb, after, repeat)   \
+    do                                        \
+    {                                         \
+        ev_init((w), (cb));                   \
+        ev_timer_set((w), (after), (repeat)); \
+    } while (0)
+#define ev_signal_init(w, cb, signum) \
+    do                                \
+    {                                 \
+        ev_init((w), (cb));           \
+        ev_signal_set((w), (signum)); \
+    } while (0)
+#define ev_prepare_init(w, cb) ev_init((w), (cb))
+#define ev_idle_init(w, cb) ev_init((w), (cb))
+#define ev_async_init(w, cb)        \
+    do                              \
+    {                               \
+        ev_init((w), (cb));         \
+        atomic_init(&(w)->sent, 0); \
+    } while (0)
+
+#define ev_is_active(w) ((w)->active != 0)
+#define ev_is_pending(w) ((w)->pending != 0)
+#define ev_set_priority(w, pri) ((w)->priority = (pri))
+
+struct ev_loop *ev_default_loop(unsigned int flags);
+struct ev_loop *ev_loop_new(unsigned int flags);
+void ev_loop_destroy(struct ev_loop *loop);
+
+int ev_run(struct ev_loop *loop, int flags);
+void ev_break(struct ev_loop *loop, int how);
+
+ev_tstamp ev_time(void);
+ev_tstamp ev_now(struct ev_loop *loop);
+
+void ev_set_userdata(struct ev_loop *loop, void *data);
+void *ev_userdata(struct ev_loop *loop);
+void ev_set_invoke_pending_cb(struct ev_loop *loop, void (*invoke_pending_cb)(struct ev_loop *loop));
+void ev_invoke_pending(struct ev_loop *loop);
+unsigned int ev_pending_count(struct ev_loop *loop);
+void ev_feed_event(struct ev_loop *loop, void *w, int revents);
+
+void ev_io_start(struct ev_loop *loop, ev_io *w);
+void ev_io_stop(struct ev_loop *loop, ev_io *w);
+void ev_timer_start(struct ev_loop *loop, ev_timer *w);
+void ev_timer_stop(struct ev_loop *loop, ev_timer *w);
+void ev_prepare_start(struct ev_loop *loop, ev_prepare *w);
+void ev_prepare_stop(struct ev_loop *loop, ev_prepare *w);
+void ev_idle_start(struct ev_loop *loop, ev_idle *w);
+void ev_idle_stop(struct ev_loop *loop, ev_idle *w);
+void ev_async_start(struct ev_loop *loop, ev_async *w);
+void ev_async_stop(struct ev_loop *loop, ev_async *w);
+void ev_async_send(struct ev_loop *loop, ev_async *w);
+void ev_signal_start(struct ev_loop *loop, ev_signal *w);
+void ev_signal_stop(struct ev_loop *loop, ev_signal *w);
+
+#endif
\ No newline at end of file
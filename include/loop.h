@@ -0,0 +1,38 @@
+#ifndef RTPTUN_LOOP_H
+#define RTPTUN_LOOP_H
+
+#define RTPTUN_DEFAULT_SPIN_TIME 200
+#define RTPTUN_DEFAULT_BUSY_POLL 50
+
+#include <stdbool.h>
+
+#include <ev.h>
+
+typedef struct rtptun_loop_options
+{
+    // Poll without blocking while traffic is flowing
+    bool low_latency;
+    // Microseconds to keep spinning after the last event before blocking again
+    unsigned int spin_time;
+
+    // Lock all pages into memory
+    bool mlock;
+    // SCHED_FIFO priority for the loop threads (0 keeps the default scheduler)
+    unsigned int realtime_priority;
+} rtptun_loop_options_t;
+
+#define RTPTUN_LOOP_OPTIONS_DEFAULT                \
+    {                                              \
+        .low_latency = false,                      \
+        .spin_time = RTPTUN_DEFAULT_SPIN_TIME,     \
+        .mlock = false,                            \
+        .realtime_priority = 0,                    \
+    }
+
+// Applies process wide settings, threads created afterwards inherit the scheduler
+void rtptun_loop_setup(const rtptun_loop_options_t *options);
+
+void rtptun_loop_run(struct ev_loop *loop, const rtptun_loop_options_t *options);
+void rtptun_loop_break(struct ev_loop *loop);
+
+#endif
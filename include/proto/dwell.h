@@ -0,0 +1,42 @@
+#ifndef RTPTUN_PROTO_DWELL_H
+#define RTPTUN_PROTO_DWELL_H
+
+// Each power of two is split into this many linear sub-buckets, bounding the error to 12.5 %
+#define DWELL_SUB_BITS 3
+#define DWELL_BUCKETS (64 << DWELL_SUB_BITS)
+
+#include <stdint.h>
+
+typedef enum dwell_direction
+{
+    // Sent on a listening socket, back to the peers talking to it
+    DWELL_TO_LISTEN,
+    // Sent on a connected socket
+    DWELL_TO_CONNECT,
+    DWELL_DIRECTIONS,
+} dwell_direction_t;
+
+typedef enum dwell_stage
+{
+    // The datagram has been handed to the socket it leaves on
+    DWELL_STAGE_QUEUED,
+    // The kernel has taken the datagram
+    DWELL_STAGE_SENT,
+    DWELL_STAGES,
+} dwell_stage_t;
+
+typedef struct dwell_hist
+{
+    unsigned long long count;
+    uint64_t max;
+    unsigned long long buckets[DWELL_BUCKETS];
+} dwell_hist_t;
+
+// CLOCK_REALTIME in nanoseconds, the clock kernel receive timestamps are taken from
+uint64_t dwell_now(void);
+
+// Records the time since rx_time count times, histograms are per thread and need no locking
+void dwell_record(dwell_direction_t direction, dwell_stage_t stage, uint64_t rx_time, unsigned int count);
+void dwell_log_stats(const char *listen_name, const char *connect_name);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,16 @@
+#ifndef RTPTUN_PROTO_ICMP_H
+#define RTPTUN_PROTO_ICMP_H
+
+// Bytes of the offending datagram's payload quoted after its IP and UDP headers
+#define ICMP_QUOTE_LEN 64
+
+#include <stddef.h>
+
+#include "proto/udp.h"
+#include "proto/packet.h"
+
+// Tells the sender of a datagram that arrived on socket that only max_payload bytes fit, with a
+// fragmentation needed or packet too big error. Raw sockets need CAP_NET_RAW.
+int icmp_send_too_big(udp_socket_t *socket, const packet_t *packet, size_t max_payload);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef RTPTUN_PROTO_INNER_H
+#define RTPTUN_PROTO_INNER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Parser for the protocol tunneled inside RTP, finding the session a datagram belongs to so that
+// several clients can share one upstream socket
+typedef struct inner_proto
+{
+    const char *name;
+
+    // Session the client picked, found in datagrams from the client
+    bool (*client_session)(const unsigned char *data, size_t data_len, uint64_t *session);
+    // Session of the client a datagram from upstream is meant for
+    bool (*upstream_session)(const unsigned char *data, size_t data_len, uint64_t *session);
+} inner_proto_t;
+
+// Returns NULL for unknown protocol names
+const inner_proto_t *inner_proto_find(const char *name);
+
+#endif
\ No newline at end of file
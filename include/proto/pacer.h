@@ -0,0 +1,34 @@
+#ifndef RTPTUN_PROTO_PACER_H
+#define RTPTUN_PROTO_PACER_H
+
+// Flow rate is estimated over windows of this many nanoseconds
+#define PACER_WINDOW 100000000ULL
+// Pace estimated flows this much faster than they arrive so the pacer never falls behind
+#define PACER_HEADROOM_PERCENT 125
+// Slowest rate in bytes per second an estimated flow is paced at
+#define PACER_MIN_RATE 125000
+// Datagrams are never held back longer than this many nanoseconds, a flow above its rate bursts instead
+#define PACER_HORIZON 50000000ULL
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct pacer
+{
+    // Rate in bytes per second, 0 paces at the estimated rate of the flow
+    uint64_t rate;
+    uint64_t estimate;
+
+    uint64_t window_start;
+    uint64_t window_bytes;
+
+    uint64_t next_departure;
+} pacer_t;
+
+void pacer_init(pacer_t *pacer, uint64_t rate);
+// Returns the departure time for a datagram of the given size, all times are CLOCK_MONOTONIC nanoseconds
+uint64_t pacer_schedule(pacer_t *pacer, size_t len, uint64_t now);
+
+uint64_t pacer_now(void);
+
+#endif
\ No newline at end of file
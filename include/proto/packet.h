@@ -0,0 +1,79 @@
+#ifndef RTPTUN_PROTO_PACKET_H
+#define RTPTUN_PROTO_PACKET_H
+
+// Room reserved in front of and behind every payload so headers and trailers
+// can be added in place
+#define PACKET_HEADROOM 64
+#define PACKET_TAILROOM 64
+
+#define PACKET_MTU_SIZE 2048
+#define PACKET_JUMBO_SIZE 65536
+
+#define PACKET_POOL_RESERVE 256
+#define PACKET_POOL_MAX 4096
+#define PACKET_POOL_MAX_JUMBO 64
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+typedef enum packet_class
+{
+    PACKET_CLASS_MTU,
+    PACKET_CLASS_JUMBO,
+} packet_class_t;
+
+// Link layer addresses of the Ethernet frame an AF_XDP socket received a packet in
+typedef struct packet_link
+{
+    uint32_t local_addr;
+    unsigned char local_mac[6];
+    unsigned char peer_mac[6];
+} packet_link_t;
+
+typedef struct packet
+{
+    struct packet *next;
+    packet_class_t class;
+
+    // Payload, always somewhere inside buf
+    unsigned char *data;
+    size_t data_len;
+
+    // Peer the packet was received from or is sent to
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    // Departure time in CLOCK_MONOTONIC nanoseconds, 0 sends right away
+    uint64_t txtime;
+    // Kernel receive timestamp in CLOCK_REALTIME nanoseconds, 0 if unknown
+    uint64_t rx_time;
+    // ECN codepoint of the IP header the packet arrived in, sent along with it again
+    uint8_t ecn;
+    // Set for packets that arrived over AF_XDP, only to be trusted once the payload is authenticated
+    bool has_link;
+    packet_link_t link;
+
+    size_t size;
+    unsigned char buf[];
+} packet_t;
+
+// Pools are per thread and need no locking, a packet freed on another thread joins that thread's pool
+packet_t *packet_alloc(size_t data_len);
+packet_t *packet_alloc_class(packet_class_t class);
+void packet_free(packet_t *packet);
+
+size_t packet_capacity(packet_class_t class);
+size_t packet_headroom(const packet_t *packet);
+size_t packet_tailroom(const packet_t *packet);
+unsigned char *packet_push(packet_t *packet, size_t len);
+unsigned char *packet_put(packet_t *packet, size_t len);
+
+void packet_pool_reserve(unsigned int count);
+void packet_pool_destroy(void);
+void packet_pool_log_stats(void);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include <sys/types.h>
 
@@ -11,12 +12,41 @@
 #include "ext/uthash.h"
 
 #include "proto/udp.h"
+#include "proto/packet.h"
+#include "proto/pacer.h"
 #include "crypto/chacha.h"
 
 #define RTP_MAX_PAYLOAD_SIZE (UDP_BUFFER_SIZE - sizeof(rtphdr_t) - CHACHA_NONCE_LEN - CHACHA_MAC_LEN)
+#define RTP_TRAILER_SIZE (CHACHA_NONCE_LEN + CHACHA_MAC_LEN)
+#define RTP_OVERHEAD (sizeof(rtphdr_t) + RTP_TRAILER_SIZE)
 
 #define RTP_TIMESTAMP_INCREMENT 3000 // 90kHz / 30FPS video
 #define RTP_PAYLOAD_TYPE 97          // Dynamic
+#define RTP_PROBE_PAYLOAD_TYPE 98    // Path MTU probes and their replies
+#define RTP_AGGREGATE_PAYLOAD_TYPE 99 // Several small datagrams, each behind its length
+#define RTP_FRAGMENT_PAYLOAD_TYPE 100 // Part of a datagram too large for one packet
+#define RTP_MARKER 0x80               // Or'ed into a payload type to set the marker bit
+
+// Path MTU discovery, sizes are those of whole RTP datagrams
+#define RTP_PMTU_BASE 1200         // Assumed to get through anywhere
+#define RTP_PMTU_MAX 65507         // Largest UDP payload over IPv4
+#define RTP_PMTU_RESOLUTION 8      // The search stops once its bounds are this close
+#define RTP_PMTU_PROBE_TIMEOUT 1.0 // Seconds to wait for a probe reply
+#define RTP_PMTU_MAX_PROBES 3      // Probes of a size lost before it counts as too large
+#define RTP_PMTU_INTERVAL 600.0    // Seconds until the path is searched again
+#define RTP_PMTU_RETRY 60.0        // Seconds until a search none of whose probes were answered is retried
+
+// Aggregation of small datagrams
+#define RTP_AGGREGATE_SMALL 512 // Larger datagrams always get an RTP packet of their own
+#define RTP_AGGREGATE_MAX 1200  // Largest aggregate RTP datagram without fragment-size or a smaller path MTU
+#define RTP_AGGREGATE_PREFIX 2  // Big-endian length in front of every datagram
+
+// Fragmentation of large datagrams, the last fragment carries the marker bit
+#define RTP_FRAGMENT_HEADER 1        // Index of the fragment in front of its part of the datagram
+#define RTP_FRAGMENT_MAX 256         // Fragments a datagram may be split into
+#define RTP_FRAGMENT_MIN_SIZE 576    // Smallest fragment size honored, RTP datagrams included
+#define RTP_REASSEMBLY_TIMEOUT 1.0   // Seconds a datagram may take to arrive completely
+#define RTP_REASSEMBLY_INTERVAL 0.25 // Seconds between checks for datagrams that timed out
 
 typedef uint32_t ssrc_t;
 
@@ -43,15 +73,64 @@ typedef struct rtp_dest
     uint32_t timestamp;
     uint8_t pl_type;
 
+    pacer_t pacer;
+
+    // Largest datagram known to get through, 0 until the first search is done
+    size_t mtu;
+    // Datagrams of probe_low bytes got through, ones of probe_high didn't
+    size_t probe_low;
+    size_t probe_high;
+    // Probe waiting for its reply, 0 between searches
+    size_t probe_size;
+    unsigned int probe_count;
+    // A probe of the current search was answered, the peer takes part in it
+    bool probe_confirmed;
+    ev_timer probe_timer;
+    struct rtp_socket *socket;
+
+    // Small datagrams waiting for others to share an RTP packet with, NULL if there are none
+    packet_t *aggregate;
+    unsigned int aggregate_count;
+    ev_timer aggregate_timer;
+
     UT_hash_handle hh;
 } rtp_dest_t;
 
+// Fragments of a datagram are sent back to back, the sequence number of the first one and the
+// SSRC tell datagrams apart
+typedef struct rtp_reassembly_key
+{
+    ssrc_t ssrc;
+    uint16_t seq;
+} rtp_reassembly_key_t;
+
+typedef struct rtp_reassembly
+{
+    rtp_reassembly_key_t key;
+
+    // Fragments received so far ordered by index, each still starting with its header
+    packet_t *fragments;
+    uint64_t received[RTP_FRAGMENT_MAX / 64];
+    unsigned int received_count;
+    unsigned int highest;
+    // Known once the fragment with the marker bit arrived, 0 until then
+    unsigned int count;
+    // Memory held by the entry and its fragments
+    size_t bytes;
+
+    ev_tstamp created;
+
+    UT_hash_handle hh;
+} rtp_reassembly_t;
+
 typedef struct rtp_socket rtp_socket_t;
-typedef void (*rtp_recv_callback_t)(rtp_socket_t *socket, unsigned char *data, ssize_t data_len, ssrc_t ssrc);
+// The callback takes ownership of the packet, which holds the decrypted payload
+typedef void (*rtp_recv_callback_t)(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc);
 typedef void (*rtp_send_callback_t)(rtp_socket_t *socket, ssize_t sent);
 
 typedef struct rtp_socket
 {
+    struct ev_loop *loop;
     udp_socket_t *udp_sock;
     int connected;
 
@@ -66,15 +145,42 @@ typedef struct rtp_socket
     uint16_t seq_num;
 
     struct rtp_dest *rtp_dest_map;
+
+    // Datagrams dropped for exceeding the path MTU
+    unsigned long long too_big;
+    // Small datagrams sent together with others and the RTP packets that carried them
+    unsigned long long aggregated;
+    unsigned long long aggregates;
+
+    // Datagrams being put back together, oldest first
+    rtp_reassembly_t *reassembly_map;
+    ev_timer reassembly_timer;
+    // Buffer memory held by incomplete datagrams and its high-water mark
+    size_t reassembly_bytes;
+    size_t reassembly_peak;
+
+    // Datagrams split up and the fragments sent for them
+    unsigned long long fragmented;
+    unsigned long long fragments;
+    // Datagrams put back together, and ones given up on after a timeout or to stay within the memory limit
+    unsigned long long reassembled;
+    unsigned long long reassembly_timeouts;
+    unsigned long long reassembly_evictions;
 } rtp_socket_t;
 
 rtp_socket_t *rtp_connect(struct ev_loop *loop, const char *address, const char *port, const char *key,
-                          rtp_recv_callback_t recv_callback, rtp_send_callback_t send_callback, void *user_data);
+                          const udp_options_t *options, rtp_recv_callback_t recv_callback, rtp_send_callback_t send_callback, void *user_data);
 rtp_socket_t *rtp_listen(struct ev_loop *loop, const char *address, const char *port, const char *key,
-                         rtp_recv_callback_t recv_callback, rtp_send_callback_t send_callback, void *user_data);
+                         const udp_options_t *options, rtp_recv_callback_t recv_callback, rtp_send_callback_t send_callback, void *user_data);
 void rtp_destroy(rtp_socket_t *socket);
 
 int rtp_send(rtp_socket_t *socket, const unsigned char *data, size_t data_len, ssrc_t ssrc);
+// Encrypts the payload in place and takes ownership of the packet, even when sending fails
+int rtp_send_packet(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc);
+
+// Drops a datagram that arrived on socket if it wouldn't fit the path MTU towards the SSRC and,
+// with icmp_too_big, tells its sender. Returns true when the packet has been dropped.
+bool rtp_drop_oversized(rtp_socket_t *rtp, ssrc_t ssrc, udp_socket_t *socket, packet_t *packet);
 
 int rtp_close_stream(rtp_socket_t *socket, ssrc_t ssrc);
 
@@ -3,26 +3,278 @@
 
 #define UDP_BUFFER_SIZE 65536
 
+#define UDP_DEFAULT_RECV_BATCH 32
+#define UDP_MAX_RECV_BATCH 1024
+#define UDP_DEFAULT_RECV_BUDGET 256
+
+#define UDP_MAX_SEND_BATCH 1024
+#define UDP_SEND_BATCH_BYTES (4 * UDP_BUFFER_SIZE)
+#define UDP_SEND_BATCH_PACKETS 1024
+#define UDP_DEFAULT_SEND_DELAY 500
+#define UDP_DEFAULT_GSO_BATCH 16
+
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_BYTES 65507
+
+#define UDP_SEND_CONTROL_LEN 64
+
+#define UDP_DEFAULT_SEND_QUEUE 64
+#define UDP_MAX_SEND_QUEUE 65536
+
+#define UDP_ZEROCOPY_MAX_PENDING 256
+#define UDP_ZEROCOPY_COPIED_LIMIT 64
+// Seconds a closed socket waits for the kernel to finish with its zerocopy sends, and how often it looks
+#define UDP_ZEROCOPY_CLOSE_TIMEOUT 1.0
+#define UDP_ZEROCOPY_CLOSE_INTERVAL 0.01
+
+#define UDP_MAX_PACING_QUEUE 4096
+// Datagrams due within this many nanoseconds are released with the current timer tick
+#define UDP_PACING_SLACK 250000
+
+#define UDP_MAX_SOCKET_BUFFER (64 * 1024 * 1024)
+#define UDP_AUTOTUNE_INTERVAL 1.0
+#define UDP_AUTOTUNE_DROPS 16
+
+#define UDP_DEFAULT_REASSEMBLY_LIMIT 4096
+
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #include <sys/types.h>
 #include <netinet/in.h>
 
 #include <ev.h>
 
-typedef struct udp_buffer
+#include "proto/packet.h"
+
+typedef enum udp_backend
+{
+    UDP_BACKEND_EV,
+    UDP_BACKEND_URING,
+} udp_backend_t;
+
+typedef enum udp_drop_policy
+{
+    // Drop the datagram being sent
+    UDP_DROP_TAIL,
+    // Drop the oldest queued datagram
+    UDP_DROP_HEAD,
+} udp_drop_policy_t;
+
+typedef enum udp_pacing
+{
+    UDP_PACING_OFF,
+    // Departure times are handed to the kernel with SO_TXTIME, needs the fq qdisc
+    UDP_PACING_TXTIME,
+    // Datagrams are held back in userspace until they're due
+    UDP_PACING_TIMER,
+} udp_pacing_t;
+
+typedef struct udp_options
+{
+    // Maximum number of datagrams read by a single receive call
+    unsigned int recv_batch;
+    // Maximum number of datagrams read per event loop wakeup
+    unsigned int recv_budget;
+
+    // Maximum number of datagrams queued for a single send call (0 disables send batching)
+    unsigned int send_batch;
+    // Maximum time in microseconds a datagram may wait in the send batch
+    unsigned int send_delay;
+
+    // Coalesce equally sized datagrams to the same destination using UDP GSO
+    bool gso;
+    // Accept coalesced datagrams from UDP GRO and split them on receive
+    bool gro;
+    // Receive into 64 KiB buffers instead of MTU sized ones, implied by gro
+    bool jumbo;
+    // Bytes a datagram may exceed its receive buffer by, taken from the packet's tailroom. Lets a protocol
+    // wrapping full MTU sized datagrams in its own headers receive them without jumbo buffers.
+    unsigned int recv_overhead;
+
+    // Maximum number of datagrams held back while the socket isn't writable
+    unsigned int send_queue;
+    // Which datagram to drop once the send queue is full
+    udp_drop_policy_t send_queue_drop;
+
+    // Allow several listening sockets to share the same address and port
+    bool reuseport;
+
+    // Socket buffer sizes in bytes (0 keeps the kernel default)
+    unsigned int recv_buffer;
+    unsigned int send_buffer;
+    // Double the receive buffer whenever the kernel keeps dropping packets
+    bool buffer_autotune;
+
+    // Microseconds to busy poll the device queue on receive (0 disables busy polling)
+    unsigned int busy_poll;
+
+    // Timestamp received datagrams in the kernel and record how long they take to leave again
+    bool timestamps;
+
+    // Read the ECN codepoint of received datagrams and set it on the ones sent on
+    bool ecn;
+
+    // Keep RTP datagrams from being fragmented and probe the path MTU towards every peer
+    bool path_mtu;
+    // Answer datagrams too large for the tunnel with an ICMP error to their sender (needs CAP_NET_RAW)
+    bool icmp_too_big;
+
+    // Microseconds small datagrams wait for others to share an RTP packet with (0 disables aggregation)
+    unsigned int aggregate;
+
+    // Split datagrams whose RTP packets would exceed this many bytes, or the path MTU if that is
+    // smaller (0 disables fragmentation)
+    unsigned int fragment_size;
+    // KiB of buffer memory incomplete datagrams may hold on a socket
+    unsigned int reassembly_limit;
+
+    // Send datagrams of at least this many bytes with MSG_ZEROCOPY (0 disables zerocopy)
+    unsigned int zerocopy;
+
+    // How datagrams stamped with a departure time are paced, SO_TXTIME falls back to the timer
+    udp_pacing_t pacing;
+    // Pacing rate in kbit/s per flow (0 estimates the rate of each flow)
+    unsigned int pacing_rate;
+
+    // I/O backend, io_uring falls back to libev where unavailable
+    udp_backend_t backend;
+
+    // Interface whose queue is redirected to an AF_XDP socket for listeners (NULL disables AF_XDP)
+    const char *xdp_interface;
+    unsigned int xdp_queue;
+} udp_options_t;
+
+#define UDP_OPTIONS_DEFAULT                               \
+    {                                                     \
+        .recv_batch = UDP_DEFAULT_RECV_BATCH,             \
+        .recv_budget = UDP_DEFAULT_RECV_BUDGET,           \
+        .send_batch = 0,                                  \
+        .send_delay = UDP_DEFAULT_SEND_DELAY,             \
+        .gso = false,                                     \
+        .gro = false,                                     \
+        .jumbo = false,                                   \
+        .recv_overhead = 0,                               \
+        .send_queue = UDP_DEFAULT_SEND_QUEUE,             \
+        .send_queue_drop = UDP_DROP_TAIL,                 \
+        .reuseport = false,                               \
+        .recv_buffer = 0,                                 \
+        .send_buffer = 0,                                 \
+        .buffer_autotune = false,                         \
+        .busy_poll = 0,                                   \
+        .timestamps = false,                              \
+        .ecn = false,                                     \
+        .path_mtu = false,                                \
+        .icmp_too_big = false,                            \
+        .aggregate = 0,                                   \
+        .fragment_size = 0,                               \
+        .reassembly_limit = UDP_DEFAULT_REASSEMBLY_LIMIT, \
+        .zerocopy = 0,                                    \
+        .pacing = UDP_PACING_OFF,                         \
+        .pacing_rate = 0,                                 \
+        .backend = UDP_BACKEND_EV,                        \
+        .xdp_interface = NULL,                            \
+        .xdp_queue = 0,                                   \
+    }
+
+typedef struct udp_stats
 {
-    char data[UDP_BUFFER_SIZE];
+    unsigned long long rx_packets;
+    unsigned long long rx_syscalls;
+
+    unsigned long long tx_packets;
+    unsigned long long tx_syscalls;
+    unsigned long long tx_batch_max;
+    unsigned long long tx_gso_packets;
+    unsigned long long rx_gro_packets;
+    unsigned long long rx_truncated;
+    unsigned long long rx_overflows;
+
+    unsigned long long tx_queued;
+    unsigned long long tx_dropped;
+    unsigned long long tx_queue_max;
+
+    unsigned long long tx_zerocopy;
+    unsigned long long tx_zerocopy_copied;
+
+    unsigned long long tx_paced;
+    unsigned long long tx_pacing_queue_max;
+
+    unsigned long long rx_xdp;
+    unsigned long long tx_xdp;
+
+    unsigned long long rx_ecn_ce;
+} udp_stats_t;
+
+typedef struct udp_send_queue
+{
+    packet_t **entries;
+
+    unsigned int head;
+    unsigned int count;
+} udp_send_queue_t;
+
+typedef struct udp_zerocopy
+{
+    // Packets the kernel may still read from, indexed by notification id
+    packet_t **pending;
+    unsigned int head;
+    unsigned int count;
+    uint32_t head_id;
+
+    // Completions in a row the kernel ended up copying anyway
+    unsigned int copied;
+} udp_zerocopy_t;
+
+typedef struct udp_pacing_queue
+{
+    // Min-heap ordered by departure time
+    packet_t **heap;
+    unsigned int count;
+
+    ev_timer timer;
+} udp_pacing_queue_t;
+
+typedef struct udp_send_msg
+{
+    uint16_t segment_size;
+    uint16_t segments;
+    // Bytes of all segments together
+    size_t len;
+    // A shorter trailing segment ends the GSO packet
+    bool closed;
+    // ECN codepoint shared by all segments
+    uint8_t ecn;
+    // Receive timestamp of the first segment
+    uint64_t rx_time;
+
+    unsigned char control[UDP_SEND_CONTROL_LEN];
+} udp_send_msg_t;
+
+typedef struct udp_send_batch
+{
+    unsigned int count;
+    unsigned int head;
+
+    // Queued packets and an iovec for each, a message covers a run of consecutive iovecs
+    packet_t **packets;
+    struct iovec *iovecs;
+    unsigned int packet_count;
+    unsigned int slots;
     size_t data_len;
 
-    struct sockaddr_storage saddr;
-    socklen_t saddr_len;
-} udp_buffer_t;
+    struct sockaddr_storage *addrs;
+    struct mmsghdr *msgs;
+    udp_send_msg_t *meta;
+
+    ev_tstamp first_queued;
+} udp_send_batch_t;
 
 typedef struct udp_socket udp_socket_t;
 typedef void (*udp_send_callback_t)(udp_socket_t *socket, ssize_t sent);
-typedef void (*udp_recv_callback_t)(udp_socket_t *socket, unsigned char *data, ssize_t data_len,
-                                    struct sockaddr_storage *address, socklen_t addr_len);
+// The callback takes ownership of the packet, its source address is in packet->addr
+typedef void (*udp_recv_callback_t)(udp_socket_t *socket, packet_t *packet);
 
 typedef struct udp_socket
 {
@@ -31,27 +283,86 @@ typedef struct udp_socket
     struct sockaddr_storage local_address;
     socklen_t local_address_len;
 
+    // Peer the socket is connected to, empty for listening sockets
     struct sockaddr_storage remote_address;
     socklen_t remote_address_len;
 
     struct ev_loop *loop;
     ev_io ev;
 
-    udp_buffer_t out_buffer;
+    udp_options_t options;
+    udp_stats_t stats;
+
+    udp_send_queue_t send_queue;
+    udp_zerocopy_t zerocopy;
+    udp_pacing_queue_t pacing_queue;
+
+    udp_send_batch_t send_batch;
+    bool flush_pending;
+    struct udp_socket *flush_next;
+
+    // Destroyed, but the descriptor stays open until the kernel confirms the last zerocopy send
+    struct udp_socket *closing_next;
+    ev_tstamp closing_deadline;
+
+    struct uring_handle *uring;
+    struct xsk *xsk;
+
+    // Kernel drop counter as last reported by SO_RXQ_OVFL
+    uint32_t rx_overflow_count;
+    unsigned int recv_buffer_size;
+    unsigned long long autotune_drops;
+    ev_tstamp autotune_start;
 
     udp_send_callback_t send_callback;
     udp_recv_callback_t recv_callback;
     void *user_data;
 } udp_socket_t;
 
-udp_socket_t *udp_connect(struct ev_loop *loop, const char *address, const char *port,
+udp_socket_t *udp_connect(struct ev_loop *loop, const char *address, const char *port, const udp_options_t *options,
                           udp_recv_callback_t recv_callback, udp_send_callback_t send_callback, void *user_data);
-udp_socket_t *udp_listen(struct ev_loop *loop, const char *address, const char *port,
+// Same as udp_connect() for an address that has been resolved already, never blocks
+udp_socket_t *udp_connect_addr(struct ev_loop *loop, const struct sockaddr_storage *address, socklen_t addr_len,
+                               const udp_options_t *options, udp_recv_callback_t recv_callback,
+                               udp_send_callback_t send_callback, void *user_data);
+udp_socket_t *udp_listen(struct ev_loop *loop, const char *address, const char *port, const udp_options_t *options,
                          udp_recv_callback_t recv_callback, udp_send_callback_t send_callback, void *user_data);
 void udp_destroy(udp_socket_t *socket);
 
+// Blocking lookup of a host name or numeric address, uses the first result
+int udp_resolve(const char *address, const char *port, struct sockaddr_storage *saddress, socklen_t *saddress_len);
+
+// Set the don't fragment bit on everything sent, datagrams above the known path MTU fail with EMSGSIZE
+int udp_set_dont_fragment(udp_socket_t *socket);
+// Largest datagram payload the kernel currently lets through towards address, -1 if unknown
+int udp_path_mtu(const struct sockaddr_storage *address, socklen_t addr_len);
+// Picks the member of the socket's SO_REUSEPORT group that receives a datagram by the 32 bit word at
+// key_offset into its payload, modulo count. Members are numbered in the order they were bound.
+int udp_steer_reuseport(udp_socket_t *socket, size_t key_offset, unsigned int count);
+// Hints the kernel to prefer this socket for datagrams processed on cpu
+int udp_set_incoming_cpu(udp_socket_t *socket, int cpu);
+// Stops the kernel from coalescing datagrams for the socket, must be called before receiving on it
+int udp_disable_gro(udp_socket_t *socket);
+
 int udp_send(udp_socket_t *socket, const unsigned char *data, size_t data_len);
 int udp_sendto(udp_socket_t *socket, const unsigned char *data, size_t data_len,
                struct sockaddr_storage *address, socklen_t addr_len);
 
-#endif
\ No newline at end of file
+// Take ownership of the packet, even when sending fails
+int udp_send_packet(udp_socket_t *socket, packet_t *packet);
+int udp_sendto_packet(udp_socket_t *socket, packet_t *packet,
+                      struct sockaddr_storage *address, socklen_t addr_len);
+
+// Called once a received packet's payload was authenticated, lets replies to its sender bypass the kernel
+// when it arrived over AF_XDP
+void udp_confirm_peer(udp_socket_t *socket, const packet_t *packet);
+
+void udp_stats_add(udp_stats_t *total, const udp_stats_t *stats);
+void udp_stats_log(const char *name, const udp_stats_t *stats);
+void udp_backend_log_stats(struct ev_loop *loop);
+
+// Releases what the calling thread's sockets have shared, along with the backend of the loop they ran
+// on, once none of them is used any longer
+void udp_thread_cleanup(struct ev_loop *loop);
+
+#endif
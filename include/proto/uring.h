@@ -0,0 +1,50 @@
+#ifndef RTPTUN_PROTO_URING_H
+#define RTPTUN_PROTO_URING_H
+
+#define URING_ENTRIES 1024
+#define URING_RECV_BUFFERS 64
+#define URING_SEND_CONTROL_LEN 32
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+
+#include "proto/packet.h"
+
+typedef struct uring uring_t;
+typedef struct uring_handle uring_handle_t;
+
+// data_len < 0 reports a receive error (-errno) after which the handle no longer receives
+typedef void (*uring_recv_callback_t)(void *ctx, unsigned char *data, ssize_t data_len, struct msghdr *msg);
+typedef void (*uring_send_callback_t)(void *ctx, ssize_t sent);
+
+typedef struct uring_stats
+{
+    unsigned long long submitted;
+    unsigned long long enter_calls;
+    unsigned long long completions;
+} uring_stats_t;
+
+uring_t *uring_get(struct ev_loop *loop);
+
+uring_handle_t *uring_open(uring_t *ring, int fd, void *ctx,
+                           uring_recv_callback_t recv_callback, uring_send_callback_t send_callback);
+void uring_close(uring_handle_t *handle);
+
+int uring_recv_start(uring_handle_t *handle, socklen_t name_len, size_t control_len);
+// Takes ownership of the packet, which is sent from in place and freed on completion, even when
+// queueing fails. Control messages are copied (control_len <= URING_SEND_CONTROL_LEN)
+int uring_send_packet(uring_handle_t *handle, packet_t *packet,
+                      const struct sockaddr_storage *address, socklen_t addr_len,
+                      const void *control, size_t control_len);
+unsigned int uring_in_flight(uring_handle_t *handle);
+
+bool uring_stats_get(struct ev_loop *loop, uring_stats_t *stats);
+// Tears down the loop's ring once all of its handles are closed, before the loop itself goes
+void uring_loop_cleanup(struct ev_loop *loop);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef RTPTUN_PROTO_XSK_H
+#define RTPTUN_PROTO_XSK_H
+
+#define XSK_FRAME_SIZE 2048
+#define XSK_FRAMES 4096
+#define XSK_RING_SIZE 2048
+#define XSK_RX_BUDGET 256
+#define XSK_MAX_PEERS 65536
+// Peers are forgotten once nothing authentic came from them for this long
+#define XSK_PEER_TIMEOUT 120.0
+#define XSK_PEER_INTERVAL 10.0
+
+#include <stdbool.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+
+#include "proto/packet.h"
+
+typedef struct xsk xsk_t;
+
+// The sender's address is in packet->addr and the frame's link addresses in packet->link, the callback
+// takes ownership of the packet
+typedef void (*xsk_recv_callback_t)(void *ctx, packet_t *packet);
+
+// Redirects IPv4 UDP datagrams for the bound address to an AF_XDP socket on one queue of the interface,
+// everything else keeps going through the kernel's stack
+xsk_t *xsk_open(struct ev_loop *loop, const char *ifname, unsigned int queue,
+                const struct sockaddr_storage *local_address, void *ctx, xsk_recv_callback_t recv_callback);
+void xsk_close(xsk_t *xsk);
+
+// Remembers the link addresses a packet from the receive callback arrived with, so replies to its sender
+// can skip the kernel. Only for packets whose payload was authenticated, anyone can forge a frame.
+void xsk_learn(xsk_t *xsk, const packet_t *packet);
+
+// Takes ownership of the packet on success. Fails without touching it when the peer's link address
+// isn't known yet, the datagram doesn't fit into a frame or the ring is full
+int xsk_sendto(xsk_t *xsk, packet_t *packet, const struct sockaddr_storage *address, socklen_t addr_len);
+
+#endif
\ No newline at end of file
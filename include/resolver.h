@@ -0,0 +1,33 @@
+#ifndef RTPTUN_RESOLVER_H
+#define RTPTUN_RESOLVER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+
+typedef struct rtptun_resolve_job rtptun_resolve_job_t;
+
+typedef struct rtptun_resolver
+{
+    struct ev_loop *loop;
+
+    char *host;
+    char *port;
+
+    // Result of the latest successful lookup, new flows use it as is
+    struct sockaddr_storage address;
+    socklen_t address_len;
+
+    ev_timer refresh_timer;
+    ev_async done_watcher;
+    // Lookup running on a thread of its own, NULL while idle
+    rtptun_resolve_job_t *job;
+} rtptun_resolver_t;
+
+// Resolves the address right away and then again every refresh seconds without blocking the loop,
+// numeric addresses are never looked up again
+rtptun_resolver_t *rtptun_resolver_new(struct ev_loop *loop, const char *host, const char *port, ev_tstamp refresh);
+void rtptun_resolver_free(rtptun_resolver_t *resolver);
+
+#endif
\ No newline at end of file
@@ -2,6 +2,13 @@
 #define RTPTUN_H
 
 #define RTPTUN_TIMEOUT 120
+// Seconds between lookups of the server's destination
+#define RTPTUN_DEST_REFRESH 60
+// Upstream sockets kept ready for new flows
+#define RTPTUN_UPSTREAM_POOL 32
+// Upstream sockets shared by all SSRCs when the inner protocol tells clients apart
+#define RTPTUN_DEFAULT_SHARED_SOCKETS 4
+#define RTPTUN_MAX_SHARED_SOCKETS 256
 
 #define RTPTUN_DEFAULT_SERVER_LISTEN "0.0.0.0"
 #define RTPTUN_DEFAULT_SERVER_PORT "5004"
@@ -10,11 +10,36 @@
 
 #include "proto/rtp.h"
 #include "proto/udp.h"
+#include "proto/inner.h"
+#include "resolver.h"
+#include "rtptun.h"
+
+typedef struct rtptun_server_options
+{
+    // Inner protocol whose sessions tell clients apart on shared upstream sockets (NULL opens one
+    // upstream socket per SSRC)
+    const inner_proto_t *inner_proto;
+    unsigned int shared_sockets;
+
+    // Hand datagrams to worker threads by SSRC rather than by address, so flows survive NAT rebinding
+    bool ssrc_steering;
+    // Pin each worker thread to its own CPU
+    bool cpu_affinity;
+} rtptun_server_options_t;
+
+#define RTPTUN_SERVER_OPTIONS_DEFAULT                    \
+    {                                                    \
+        .inner_proto = NULL,                             \
+        .shared_sockets = RTPTUN_DEFAULT_SHARED_SOCKETS, \
+        .ssrc_steering = true,                           \
+        .cpu_affinity = false,                           \
+    }
 
 typedef struct rtptun_rtp_info
 {
     ssrc_t ssrc;
     rtp_socket_t *local_rtp;
+    // NULL while upstream sockets are shared
     udp_socket_t *remote_udp;
 
     bool active;
@@ -22,21 +47,52 @@ typedef struct rtptun_rtp_info
     UT_hash_handle hh;
 } rtptun_rtp_info_t;
 
+// Inner protocol session of a client, routes datagrams arriving on shared upstream sockets
+typedef struct rtptun_session
+{
+    uint64_t id;
+    ssrc_t ssrc;
+
+    bool active;
+
+    UT_hash_handle hh;
+} rtptun_session_t;
+
 typedef struct rtptun_server
 {
     struct ev_loop *loop;
 
     char *dest_addr;
     char *dest_port;
+    rtptun_resolver_t *dest;
+
+    udp_options_t options;
+    // Totals of upstream sockets that have already been closed
+    udp_stats_t closed_stats;
 
     ev_timer to_timer;
 
+    // Upstream sockets created ahead of time, refilled whenever the loop is idle
+    udp_socket_t *pool[RTPTUN_UPSTREAM_POOL];
+    unsigned int pool_len;
+    ev_idle pool_watcher;
+
+    const inner_proto_t *inner_proto;
+    udp_socket_t **shared;
+    unsigned int shared_count;
+    rtptun_session_t *session_map;
+    // Datagrams from shared upstream sockets no client could be found for
+    unsigned long long unroutable;
+
     rtp_socket_t *local_rtp;
     rtptun_rtp_info_t *info_map;
 } rtptun_server_t;
 
 rtptun_server_t *rtptun_server_new(struct ev_loop *loop, const char *listen_addr, const char *listen_port,
-                                   const char *dest_addr, const char *dest_port, const char *key);
+                                   const char *dest_addr, const char *dest_port, const char *key,
+                                   const udp_options_t *options, const rtptun_server_options_t *server_options);
 void rtptun_server_free(rtptun_server_t *server);
 
+void rtptun_server_log_stats(rtptun_server_t *server);
+
 #endif
\ No newline at end of file
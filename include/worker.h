@@ -0,0 +1,47 @@
+#ifndef RTPTUN_WORKER_H
+#define RTPTUN_WORKER_H
+
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#include <ev.h>
+
+#include "server.h"
+#include "proto/udp.h"
+#include "loop.h"
+
+#define RTPTUN_MAX_WORKERS 256
+
+typedef struct rtptun_worker
+{
+    unsigned int id;
+
+    pthread_t thread;
+    bool running;
+    // CPU the thread is pinned to, -1 if it may run anywhere
+    int cpu;
+
+    struct ev_loop *loop;
+    const rtptun_loop_options_t *loop_options;
+    ev_async stop_watcher;
+    ev_async stats_watcher;
+
+    rtptun_server_t *server;
+} rtptun_worker_t;
+
+typedef struct rtptun_workers
+{
+    unsigned int count;
+    rtptun_worker_t *workers;
+} rtptun_workers_t;
+
+rtptun_workers_t *rtptun_workers_new(unsigned int count, const char *listen_addr, const char *listen_port,
+                                     const char *dest_addr, const char *dest_port, const char *key,
+                                     const udp_options_t *options, const rtptun_server_options_t *server_options,
+                                     const rtptun_loop_options_t *loop_options);
+void rtptun_workers_free(rtptun_workers_t *workers);
+
+void rtptun_workers_log_stats(rtptun_workers_t *workers);
+
+#endif
@@ -13,10 +13,10 @@
 #include "log.h"
 #include "proto/udp.h"
 #include "proto/rtp.h"
+#include "proto/dwell.h"
 
-static void udp_recv_cb(udp_socket_t *socket, unsigned char *data, ssize_t data_len,
-                        struct sockaddr_storage *address, socklen_t addr_len);
-static void rtp_recv_cb(rtp_socket_t *socket, unsigned char *data, ssize_t data_len, ssrc_t ssrc);
+static void udp_recv_cb(udp_socket_t *socket, packet_t *packet);
+static void rtp_recv_cb(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc);
 static void timeout_cb(EV_P_ ev_timer *timer, int revents);
 
 static rtptun_udp_info_t *info_map_set(rtptun_client_t *client, struct sockaddr_storage *saddr, ssrc_t ssrc);
@@ -25,7 +25,8 @@ static rtptun_udp_info_t *info_map_find_reverse(rtptun_client_t *client, ssrc_t
 static void info_map_free(rtptun_client_t *client);
 
 rtptun_client_t *rtptun_client_new(struct ev_loop *loop, const char *local_addr, const char *local_port,
-                                   const char *remote_addr, const char *remote_port, const char *key)
+                                   const char *remote_addr, const char *remote_port, const char *key,
+                                   const udp_options_t *options)
 {
     rtptun_client_t *client = calloc(1, sizeof(*client));
     if (!client)
@@ -38,7 +39,7 @@ rtptun_client_t *rtptun_client_new(struct ev_loop *loop, const char *local_addr,
     client->info_map = NULL;
     client->info_map_reverse = NULL;
 
-    client->udp_local = udp_listen(loop, local_addr, local_port, udp_recv_cb, NULL, client);
+    client->udp_local = udp_listen(loop, local_addr, local_port, options, udp_recv_cb, NULL, client);
     if (!client->udp_local)
     {
         log_e("Failed to create local UDP socket");
@@ -47,7 +48,7 @@ rtptun_client_t *rtptun_client_new(struct ev_loop *loop, const char *local_addr,
 
     client->udp_addr_len = client->udp_local->local_address_len;
 
-    client->rtp_remote = rtp_connect(loop, remote_addr, remote_port, key, rtp_recv_cb, NULL, client);
+    client->rtp_remote = rtp_connect(loop, remote_addr, remote_port, key, options, rtp_recv_cb, NULL, client);
     if (!client->rtp_remote)
     {
         log_e("Failed to create remote RTP socket");
@@ -88,6 +89,26 @@ void rtptun_client_free(rtptun_client_t *client)
     free(client);
 }
 
+void rtptun_client_log_stats(rtptun_client_t *client)
+{
+    udp_stats_log("Local socket", &client->udp_local->stats);
+    udp_stats_log("RTP socket", &client->rtp_remote->udp_sock->stats);
+    if (client->rtp_remote->too_big > 0)
+        log_i("Local socket: %llu datagrams dropped for exceeding the path MTU", client->rtp_remote->too_big);
+    if (client->rtp_remote->fragmented > 0)
+        log_i("RTP socket: %llu datagrams split into %llu fragments", client->rtp_remote->fragmented, client->rtp_remote->fragments);
+    if (client->rtp_remote->reassembled > 0 || client->rtp_remote->reassembly_timeouts > 0 || client->rtp_remote->reassembly_evictions > 0)
+        log_i("RTP socket: %llu datagrams reassembled, %llu timed out, %llu evicted (peak memory %zu KiB)",
+              client->rtp_remote->reassembled, client->rtp_remote->reassembly_timeouts, client->rtp_remote->reassembly_evictions,
+              client->rtp_remote->reassembly_peak / 1024);
+    if (client->rtp_remote->aggregates > 0)
+        log_i("RTP socket: %llu datagrams sent in %llu aggregate packets", client->rtp_remote->aggregated,
+              client->rtp_remote->aggregates);
+    dwell_log_stats("Local socket", "RTP socket");
+    udp_backend_log_stats(client->loop);
+    packet_pool_log_stats();
+}
+
 static rtptun_udp_info_t *info_map_set(rtptun_client_t *client, struct sockaddr_storage *saddr, ssrc_t ssrc)
 {
     rtptun_udp_info_t *info = NULL, *rev_info = NULL;
@@ -155,31 +176,34 @@ void info_map_free(rtptun_client_t *client)
     }
 }
 
-void udp_recv_cb(udp_socket_t *socket, unsigned char *data, ssize_t data_len,
-                 struct sockaddr_storage *address, socklen_t addr_len)
+void udp_recv_cb(udp_socket_t *socket, packet_t *packet)
 {
     rtptun_client_t *client = socket->user_data;
 
-    rtptun_udp_info_t *info = info_map_find(client, address);
+    rtptun_udp_info_t *info = info_map_find(client, &packet->addr);
     if (!info)
     {
         log_d("Received packet from new sender");
 
-        info = info_map_set(client, address, rtp_random_ssrc(client->rtp_remote));
+        info = info_map_set(client, &packet->addr, rtp_random_ssrc(client->rtp_remote));
         if (!info)
         {
             log_e("Failed to map local socket");
+            packet_free(packet);
             return;
         }
     }
 
     info->active = true;
 
-    if (rtp_send(client->rtp_remote, data, data_len, info->ssrc) != 0)
+    if (rtp_drop_oversized(client->rtp_remote, info->ssrc, socket, packet))
+        return;
+
+    if (rtp_send_packet(client->rtp_remote, packet, info->ssrc) != 0)
         log_e("Failed to send RTP packet");
 }
 
-void rtp_recv_cb(rtp_socket_t *socket, unsigned char *data, ssize_t data_len, ssrc_t ssrc)
+void rtp_recv_cb(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc)
 {
     rtptun_client_t *client = socket->user_data;
 
@@ -187,12 +211,13 @@ void rtp_recv_cb(rtp_socket_t *socket, unsigned char *data, ssize_t data_len, ss
     if (!info)
     {
         log_d("Received packet from unrecognized SSRC #%d", ssrc);
+        packet_free(packet);
         return;
     }
 
     info->active = true;
 
-    if (udp_sendto(client->udp_local, data, data_len, &info->saddr, client->udp_addr_len) != 0)
+    if (udp_sendto_packet(client->udp_local, packet, &info->saddr, client->udp_addr_len) != 0)
         log_e("Failed to send UDP packet");
 }
 
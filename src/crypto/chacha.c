@@ -42,11 +42,18 @@ chacha_ret_t chacha_init(chacha_cipher_t *cipher, const char *b64_key)
     return CHACHA_RET_SUCCESS;
 }
 
-chacha_ret_t chacha_encrypt(chacha_cipher_t *cipher, const unsigned char *data, size_t data_len, unsigned char *ciphertext, unsigned char mac[CHACHA_MAC_LEN], unsigned char nonce[CHACHA_NONCE_LEN])
+void chacha_set_domain(chacha_cipher_t *cipher, uint8_t domain)
+{
+    // Nonces are incremented little-endian, so the most significant byte stays fixed
+    // and ciphers sharing a key in different domains can never produce the same nonce
+    cipher->nonce[sizeof(cipher->nonce) - 1] = domain;
+}
+
+chacha_ret_t chacha_encrypt(chacha_cipher_t *cipher, const unsigned char *data, size_t data_len, const unsigned char *ad, size_t ad_len, unsigned char *ciphertext, unsigned char mac[CHACHA_MAC_LEN], unsigned char nonce[CHACHA_NONCE_LEN])
 {
     unsigned long long mac_len;
     if (crypto_aead_chacha20poly1305_ietf_encrypt_detached(ciphertext, mac, &mac_len, data, data_len,
-                                                           NULL, 0, NULL, cipher->nonce, cipher->key) == -1)
+                                                           ad, ad_len, NULL, cipher->nonce, cipher->key) == -1)
         return CHACHA_RET_ENCERR;
     memcpy(nonce, cipher->nonce, sizeof(cipher->nonce));
 
@@ -55,10 +62,10 @@ chacha_ret_t chacha_encrypt(chacha_cipher_t *cipher, const unsigned char *data,
     return CHACHA_RET_SUCCESS;
 }
 
-chacha_ret_t chacha_decrypt(chacha_cipher_t *cipher, const unsigned char *ciphertext, size_t ciphertext_len, const unsigned char mac[CHACHA_MAC_LEN], const unsigned char nonce[CHACHA_NONCE_LEN], unsigned char *data)
+chacha_ret_t chacha_decrypt(chacha_cipher_t *cipher, const unsigned char *ciphertext, size_t ciphertext_len, const unsigned char *ad, size_t ad_len, const unsigned char mac[CHACHA_MAC_LEN], const unsigned char nonce[CHACHA_NONCE_LEN], unsigned char *data)
 {
     if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(data, NULL, ciphertext, ciphertext_len,
-                                                           mac, NULL, 0, nonce, cipher->key) == -1)
+                                                           mac, ad, ad_len, nonce, cipher->key) == -1)
         return CHACHA_RET_ENCERR;
 
     return CHACHA_RET_SUCCESS;
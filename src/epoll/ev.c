@@ -0,0 +1,905 @@
+#define _GNU_SOURCE
+
+#include <ev.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "log.h"
+
+#define EV_EPOLL_EVENTS 64
+
+typedef struct ev_fd
+{
+    ev_io *head;
+
+    // Events the descriptor is registered for with epoll, 0 if it isn't
+    uint32_t registered;
+    bool changed;
+    bool force;
+} ev_fd_t;
+
+typedef struct ev_pending
+{
+    ev_watcher *w;
+    int revents;
+} ev_pending_t;
+
+struct ev_loop
+{
+    int epoll_fd;
+    int timer_fd;
+    int event_fd;
+    int signal_fd;
+
+    ev_fd_t *fds;
+    int fds_len;
+    int *changes;
+    int changes_len;
+    int changes_cap;
+
+    // Min-heap on the expiry time, a running timer's active field is its index + 1
+    ev_timer **timers;
+    int timers_len;
+    int timers_cap;
+    ev_tstamp timer_armed;
+
+    ev_prepare *prepares;
+    ev_idle *idles;
+    ev_async *asyncs;
+    atomic_int async_sent;
+    ev_signal *signals;
+    sigset_t signal_mask;
+
+    ev_pending_t *pendings;
+    int pendings_len;
+    int pendings_cap;
+
+    ev_tstamp now;
+    ev_tstamp mono_now;
+
+    int active;
+    int done;
+
+    void *userdata;
+    void (*invoke_pending_cb)(struct ev_loop *loop);
+};
+
+static struct ev_loop *default_loop = NULL;
+
+static void loop_poll(struct ev_loop *loop, bool block);
+static void loop_update_time(struct ev_loop *loop);
+static void queue_event(struct ev_loop *loop, ev_watcher *w, int revents);
+static void clear_pending(struct ev_loop *loop, ev_watcher *w);
+
+static int fd_reserve(struct ev_loop *loop, int fd);
+static void fd_change(struct ev_loop *loop, int fd, bool force);
+static void fd_reify(struct ev_loop *loop);
+static void fd_event(struct ev_loop *loop, int fd, uint32_t events);
+
+static void timers_arm(struct ev_loop *loop);
+static void timers_expire(struct ev_loop *loop);
+static void timers_up(struct ev_loop *loop, int index);
+static void timers_down(struct ev_loop *loop, int index);
+
+static void asyncs_collect(struct ev_loop *loop);
+static void signals_collect(struct ev_loop *loop);
+static int signals_update(struct ev_loop *loop);
+
+static ev_tstamp clock_seconds(clockid_t clock);
+
+struct ev_loop *ev_default_loop(unsigned int flags)
+{
+    if (!default_loop)
+        default_loop = ev_loop_new(flags);
+
+    return default_loop;
+}
+
+struct ev_loop *ev_loop_new(unsigned int flags)
+{
+    struct ev_loop *loop = calloc(1, sizeof(*loop));
+    if (!loop)
+    {
+        elog_e("calloc(ev_loop) failed");
+        return NULL;
+    }
+
+    loop->timer_fd = -1;
+    loop->event_fd = -1;
+    loop->signal_fd = -1;
+    sigemptyset(&loop->signal_mask);
+    atomic_init(&loop->async_sent, 0);
+    loop->invoke_pending_cb = ev_invoke_pending;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+    {
+        elog_e("epoll_create1() failed");
+        goto error;
+    }
+
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd < 0)
+    {
+        elog_e("timerfd_create() failed");
+        goto error;
+    }
+
+    loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->event_fd < 0)
+    {
+        elog_e("eventfd() failed");
+        goto error;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET};
+    event.data.fd = loop->timer_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) != 0)
+    {
+        elog_e("epoll_ctl(timerfd) failed");
+        goto error;
+    }
+    event.data.fd = loop->event_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &event) != 0)
+    {
+        elog_e("epoll_ctl(eventfd) failed");
+        goto error;
+    }
+
+    loop_update_time(loop);
+
+    return loop;
+error:
+    ev_loop_destroy(loop);
+
+    return NULL;
+}
+
+void ev_loop_destroy(struct ev_loop *loop)
+{
+    if (loop->epoll_fd >= 0)
+        close(loop->epoll_fd);
+    if (loop->timer_fd >= 0)
+        close(loop->timer_fd);
+    if (loop->event_fd >= 0)
+        close(loop->event_fd);
+    if (loop->signal_fd >= 0)
+        close(loop->signal_fd);
+
+    free(loop->fds);
+    free(loop->changes);
+    free(loop->timers);
+    free(loop->pendings);
+
+    if (loop == default_loop)
+        default_loop = NULL;
+
+    free(loop);
+}
+
+int ev_run(struct ev_loop *loop, int flags)
+{
+    loop->done = EVBREAK_CANCEL;
+
+    loop->invoke_pending_cb(loop);
+
+    do
+    {
+        if (loop->prepares)
+        {
+            for (ev_prepare *w = loop->prepares; w; w = w->next)
+                queue_event(loop, (ev_watcher *)w, EV_PREPARE);
+
+            loop->invoke_pending_cb(loop);
+        }
+
+        if (loop->done)
+            break;
+
+        fd_reify(loop);
+        loop_poll(loop, !(flags & EVRUN_NOWAIT) && loop->pendings_len == 0 && loop->active > 0 && !loop->idles);
+
+        // Idle watchers only run in iterations without any other events
+        if (loop->pendings_len == 0)
+        {
+            for (ev_idle *w = loop->idles; w; w = w->next)
+                queue_event(loop, (ev_watcher *)w, EV_IDLE);
+        }
+
+        loop->invoke_pending_cb(loop);
+    } while (loop->active > 0 && !loop->done && !(flags & (EVRUN_ONCE | EVRUN_NOWAIT)));
+
+    if (loop->done == EVBREAK_ONE)
+        loop->done = EVBREAK_CANCEL;
+
+    return loop->active;
+}
+
+void ev_break(struct ev_loop *loop, int how)
+{
+    loop->done = how;
+}
+
+ev_tstamp ev_time(void)
+{
+    return clock_seconds(CLOCK_REALTIME);
+}
+
+ev_tstamp ev_now(struct ev_loop *loop)
+{
+    return loop->now;
+}
+
+void ev_set_userdata(struct ev_loop *loop, void *data)
+{
+    loop->userdata = data;
+}
+
+void *ev_userdata(struct ev_loop *loop)
+{
+    return loop->userdata;
+}
+
+void ev_set_invoke_pending_cb(struct ev_loop *loop, void (*invoke_pending_cb)(struct ev_loop *loop))
+{
+    loop->invoke_pending_cb = invoke_pending_cb;
+}
+
+void ev_invoke_pending(struct ev_loop *loop)
+{
+    // Watchers fed while invoking wait for the next round so a busy one can't keep the loop from polling
+    int count = loop->pendings_len;
+
+    for (int i = 0; i < count; i++)
+    {
+        ev_pending_t *p = &loop->pendings[i];
+        ev_watcher *w = p->w;
+        if (!w)
+            continue;
+
+        p->w = NULL;
+        w->pending = 0;
+        w->cb(loop, w, p->revents);
+    }
+
+    int remaining = loop->pendings_len - count;
+    memmove(loop->pendings, &loop->pendings[count], remaining * sizeof(*loop->pendings));
+    loop->pendings_len = remaining;
+
+    for (int i = 0; i < remaining; i++)
+    {
+        if (loop->pendings[i].w)
+            loop->pendings[i].w->pending = i + 1;
+    }
+}
+
+unsigned int ev_pending_count(struct ev_loop *loop)
+{
+    unsigned int count = 0;
+    for (int i = 0; i < loop->pendings_len; i++)
+    {
+        if (loop->pendings[i].w)
+            count++;
+    }
+
+    return count;
+}
+
+void ev_feed_event(struct ev_loop *loop, void *w, int revents)
+{
+    queue_event(loop, w, revents);
+}
+
+void ev_io_start(struct ev_loop *loop, ev_io *w)
+{
+    if (w->active)
+        return;
+
+    if (fd_reserve(loop, w->fd) != 0)
+        return;
+
+    ev_fd_t *slot = &loop->fds[w->fd];
+    w->next = slot->head;
+    slot->head = w;
+    w->active = 1;
+    loop->active++;
+
+    // A watcher set up anew may be looking at a descriptor that was closed and reused
+    fd_change(loop, w->fd, w->events & EV__IOFDSET);
+    w->events &= ~EV__IOFDSET;
+}
+
+void ev_io_stop(struct ev_loop *loop, ev_io *w)
+{
+    clear_pending(loop, (ev_watcher *)w);
+    if (!w->active)
+        return;
+
+    ev_io **link = &loop->fds[w->fd].head;
+    while (*link && *link != w)
+        link = &(*link)->next;
+    if (*link)
+        *link = w->next;
+
+    w->active = 0;
+    loop->active--;
+
+    fd_change(loop, w->fd, false);
+}
+
+void ev_timer_start(struct ev_loop *loop, ev_timer *w)
+{
+    if (w->active)
+        return;
+
+    if (loop->timers_len == loop->timers_cap)
+    {
+        int cap = (loop->timers_cap) ? loop->timers_cap * 2 : 16;
+        ev_timer **timers = realloc(loop->timers, cap * sizeof(*timers));
+        if (!timers)
+        {
+            elog_e("realloc(ev_timer) failed");
+            return;
+        }
+        loop->timers = timers;
+        loop->timers_cap = cap;
+    }
+
+    w->at += loop->mono_now;
+    loop->timers[loop->timers_len] = w;
+    w->active = ++loop->timers_len;
+    timers_up(loop, loop->timers_len - 1);
+
+    loop->active++;
+}
+
+void ev_timer_stop(struct ev_loop *loop, ev_timer *w)
+{
+    clear_pending(loop, (ev_watcher *)w);
+    if (!w->active)
+        return;
+
+    int index = w->active - 1;
+    ev_timer *last = loop->timers[--loop->timers_len];
+    if (index < loop->timers_len)
+    {
+        loop->timers[index] = last;
+        last->active = index + 1;
+        timers_up(loop, index);
+        timers_down(loop, last->active - 1);
+    }
+
+    w->at -= loop->mono_now;
+    w->active = 0;
+    loop->active--;
+}
+
+void ev_prepare_start(struct ev_loop *loop, ev_prepare *w)
+{
+    if (w->active)
+        return;
+
+    // Higher priorities run first
+    ev_prepare **link = &loop->prepares;
+    while (*link && (*link)->priority >= w->priority)
+        link = &(*link)->next;
+    w->next = *link;
+    *link = w;
+
+    w->active = 1;
+    loop->active++;
+}
+
+void ev_prepare_stop(struct ev_loop *loop, ev_prepare *w)
+{
+    clear_pending(loop, (ev_watcher *)w);
+    if (!w->active)
+        return;
+
+    ev_prepare **link = &loop->prepares;
+    while (*link && *link != w)
+        link = &(*link)->next;
+    if (*link)
+        *link = w->next;
+
+    w->active = 0;
+    loop->active--;
+}
+
+void ev_idle_start(struct ev_loop *loop, ev_idle *w)
+{
+    if (w->active)
+        return;
+
+    w->next = loop->idles;
+    loop->idles = w;
+
+    w->active = 1;
+    loop->active++;
+}
+
+void ev_idle_stop(struct ev_loop *loop, ev_idle *w)
+{
+    clear_pending(loop, (ev_watcher *)w);
+    if (!w->active)
+        return;
+
+    ev_idle **link = &loop->idles;
+    while (*link && *link != w)
+        link = &(*link)->next;
+    if (*link)
+        *link = w->next;
+
+    w->active = 0;
+    loop->active--;
+}
+
+void ev_async_start(struct ev_loop *loop, ev_async *w)
+{
+    if (w->active)
+        return;
+
+    w->next = loop->asyncs;
+    loop->asyncs = w;
+
+    w->active = 1;
+    loop->active++;
+}
+
+void ev_async_stop(struct ev_loop *loop, ev_async *w)
+{
+    clear_pending(loop, (ev_watcher *)w);
+    if (!w->active)
+        return;
+
+    ev_async **link = &loop->asyncs;
+    while (*link && *link != w)
+        link = &(*link)->next;
+    if (*link)
+        *link = w->next;
+
+    w->active = 0;
+    loop->active--;
+}
+
+void ev_async_send(struct ev_loop *loop, ev_async *w)
+{
+    atomic_store(&w->sent, 1);
+
+    // One wakeup covers every watcher sent to before the loop gets around to it
+    if (atomic_exchange(&loop->async_sent, 1) == 0)
+    {
+        uint64_t value = 1;
+        if (write(loop->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            elog_w("write(eventfd) failed");
+    }
+}
+
+void ev_signal_start(struct ev_loop *loop, ev_signal *w)
+{
+    if (w->active)
+        return;
+
+    w->next = loop->signals;
+    loop->signals = w;
+
+    w->active = 1;
+    loop->active++;
+
+    if (!sigismember(&loop->signal_mask, w->signum))
+    {
+        sigaddset(&loop->signal_mask, w->signum);
+        signals_update(loop);
+    }
+}
+
+void ev_signal_stop(struct ev_loop *loop, ev_signal *w)
+{
+    clear_pending(loop, (ev_watcher *)w);
+    if (!w->active)
+        return;
+
+    ev_signal **link = &loop->signals;
+    while (*link && *link != w)
+        link = &(*link)->next;
+    if (*link)
+        *link = w->next;
+
+    w->active = 0;
+    loop->active--;
+
+    for (ev_signal *other = loop->signals; other; other = other->next)
+    {
+        if (other->signum == w->signum)
+            return;
+    }
+
+    sigdelset(&loop->signal_mask, w->signum);
+    signals_update(loop);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, w->signum);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+void loop_poll(struct ev_loop *loop, bool block)
+{
+    int timeout = 0;
+    if (block)
+    {
+        timers_arm(loop);
+
+        // The timerfd wakes the loop up, unless the next timer is already due
+        if (loop->timers_len == 0 || loop->timers[0]->at > clock_seconds(CLOCK_MONOTONIC))
+            timeout = -1;
+    }
+
+    struct epoll_event events[EV_EPOLL_EVENTS];
+    int count = epoll_wait(loop->epoll_fd, events, EV_EPOLL_EVENTS, timeout);
+    if (count < 0 && errno != EINTR)
+        elog_w("epoll_wait() failed");
+
+    loop_update_time(loop);
+
+    for (int i = 0; i < count; i++)
+    {
+        int fd = events[i].data.fd;
+
+        if (fd == loop->timer_fd)
+        {
+            uint64_t expirations;
+            if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                elog_w("read(timerfd) failed");
+            loop->timer_armed = 0;
+        }
+        else if (fd == loop->event_fd)
+        {
+            asyncs_collect(loop);
+        }
+        else if (fd == loop->signal_fd)
+        {
+            signals_collect(loop);
+        }
+        else
+        {
+            fd_event(loop, fd, events[i].events);
+        }
+    }
+
+    timers_expire(loop);
+}
+
+void loop_update_time(struct ev_loop *loop)
+{
+    loop->now = clock_seconds(CLOCK_REALTIME);
+    loop->mono_now = clock_seconds(CLOCK_MONOTONIC);
+}
+
+void queue_event(struct ev_loop *loop, ev_watcher *w, int revents)
+{
+    if (w->pending)
+    {
+        loop->pendings[w->pending - 1].revents |= revents;
+        return;
+    }
+
+    if (loop->pendings_len == loop->pendings_cap)
+    {
+        int cap = (loop->pendings_cap) ? loop->pendings_cap * 2 : 64;
+        ev_pending_t *pendings = realloc(loop->pendings, cap * sizeof(*pendings));
+        if (!pendings)
+        {
+            elog_e("realloc(ev_pending) failed");
+            return;
+        }
+        loop->pendings = pendings;
+        loop->pendings_cap = cap;
+    }
+
+    loop->pendings[loop->pendings_len].w = w;
+    loop->pendings[loop->pendings_len].revents = revents;
+    w->pending = ++loop->pendings_len;
+}
+
+void clear_pending(struct ev_loop *loop, ev_watcher *w)
+{
+    if (!w->pending)
+        return;
+
+    loop->pendings[w->pending - 1].w = NULL;
+    w->pending = 0;
+}
+
+int fd_reserve(struct ev_loop *loop, int fd)
+{
+    if (fd < loop->fds_len)
+        return 0;
+
+    int len = (loop->fds_len) ? loop->fds_len : 64;
+    while (len <= fd)
+        len *= 2;
+
+    ev_fd_t *fds = realloc(loop->fds, len * sizeof(*fds));
+    if (!fds)
+    {
+        elog_e("realloc(ev_fd) failed");
+        return -1;
+    }
+    memset(&fds[loop->fds_len], 0, (len - loop->fds_len) * sizeof(*fds));
+
+    loop->fds = fds;
+    loop->fds_len = len;
+
+    return 0;
+}
+
+void fd_change(struct ev_loop *loop, int fd, bool force)
+{
+    ev_fd_t *slot = &loop->fds[fd];
+    slot->force |= force;
+    if (slot->changed)
+        return;
+
+    if (loop->changes_len == loop->changes_cap)
+    {
+        int cap = (loop->changes_cap) ? loop->changes_cap * 2 : 16;
+        int *changes = realloc(loop->changes, cap * sizeof(*changes));
+        if (!changes)
+        {
+            elog_e("realloc(ev_fd changes) failed");
+            return;
+        }
+        loop->changes = changes;
+        loop->changes_cap = cap;
+    }
+
+    slot->changed = true;
+    loop->changes[loop->changes_len++] = fd;
+}
+
+void fd_reify(struct ev_loop *loop)
+{
+    for (int i = 0; i < loop->changes_len; i++)
+    {
+        int fd = loop->changes[i];
+        ev_fd_t *slot = &loop->fds[fd];
+
+        int events = 0;
+        for (ev_io *w = slot->head; w; w = w->next)
+            events |= w->events;
+
+        uint32_t wanted = 0;
+        if (events & EV_READ)
+            wanted |= EPOLLIN;
+        if (events & EV_WRITE)
+            wanted |= EPOLLOUT;
+
+        bool force = slot->force;
+        slot->changed = false;
+        slot->force = false;
+
+        // Stopping and restarting a watcher within one iteration costs nothing
+        if (wanted == slot->registered && !force)
+            continue;
+
+        if (!wanted)
+        {
+            // Fails harmlessly if the descriptor was closed already
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            slot->registered = 0;
+            continue;
+        }
+
+        struct epoll_event event = {.events = wanted | EPOLLET};
+        event.data.fd = fd;
+
+        int op = (slot->registered) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        int ret = epoll_ctl(loop->epoll_fd, op, fd, &event);
+        if (ret != 0 && errno == ENOENT)
+            ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        else if (ret != 0 && errno == EEXIST)
+            ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+
+        if (ret != 0)
+        {
+            elog_w("epoll_ctl(%d) failed", fd);
+            slot->registered = 0;
+            continue;
+        }
+
+        slot->registered = wanted;
+    }
+
+    loop->changes_len = 0;
+}
+
+void fd_event(struct ev_loop *loop, int fd, uint32_t events)
+{
+    if (fd >= loop->fds_len)
+        return;
+
+    // Errors and hangups wake up readers and writers alike, as with libev
+    int revents = 0;
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        revents |= EV_READ;
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        revents |= EV_WRITE;
+
+    for (ev_io *w = loop->fds[fd].head; w; w = w->next)
+    {
+        if (w->events & revents)
+            queue_event(loop, (ev_watcher *)w, w->events & revents);
+    }
+}
+
+void timers_arm(struct ev_loop *loop)
+{
+    ev_tstamp at = (loop->timers_len > 0) ? loop->timers[0]->at : 0;
+    if (at == loop->timer_armed)
+        return;
+
+    // A zero expiry would disarm the timer instead of firing it right away
+    struct itimerspec spec = {0};
+    if (at > 0)
+    {
+        spec.it_value.tv_sec = (time_t)at;
+        spec.it_value.tv_nsec = (long)((at - (time_t)at) * 1e9);
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+    {
+        elog_w("timerfd_settime() failed");
+        return;
+    }
+
+    loop->timer_armed = at;
+}
+
+void timers_expire(struct ev_loop *loop)
+{
+    while (loop->timers_len > 0 && loop->timers[0]->at <= loop->mono_now)
+    {
+        ev_timer *w = loop->timers[0];
+
+        if (w->repeat > 0)
+        {
+            w->at += w->repeat;
+            if (w->at < loop->mono_now)
+                w->at = loop->mono_now;
+
+            timers_down(loop, 0);
+        }
+        else
+        {
+            ev_timer_stop(loop, w);
+        }
+
+        queue_event(loop, (ev_watcher *)w, EV_TIMER);
+    }
+}
+
+void timers_up(struct ev_loop *loop, int index)
+{
+    ev_timer *w = loop->timers[index];
+    while (index > 0)
+    {
+        int parent = (index - 1) / 2;
+        if (loop->timers[parent]->at <= w->at)
+            break;
+
+        loop->timers[index] = loop->timers[parent];
+        loop->timers[index]->active = index + 1;
+        index = parent;
+    }
+
+    loop->timers[index] = w;
+    w->active = index + 1;
+}
+
+void timers_down(struct ev_loop *loop, int index)
+{
+    ev_timer *w = loop->timers[index];
+    for (;;)
+    {
+        int child = 2 * index + 1;
+        if (child >= loop->timers_len)
+            break;
+        if (child + 1 < loop->timers_len && loop->timers[child + 1]->at < loop->timers[child]->at)
+            child++;
+        if (w->at <= loop->timers[child]->at)
+            break;
+
+        loop->timers[index] = loop->timers[child];
+        loop->timers[index]->active = index + 1;
+        index = child;
+    }
+
+    loop->timers[index] = w;
+    w->active = index + 1;
+}
+
+void asyncs_collect(struct ev_loop *loop)
+{
+    // Clear the flag before looking at the watchers, a send racing with this one writes again
+    atomic_store(&loop->async_sent, 0);
+
+    uint64_t value;
+    if (read(loop->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        elog_w("read(eventfd) failed");
+
+    for (ev_async *w = loop->asyncs; w; w = w->next)
+    {
+        if (atomic_exchange(&w->sent, 0))
+            queue_event(loop, (ev_watcher *)w, EV_ASYNC);
+    }
+}
+
+void signals_collect(struct ev_loop *loop)
+{
+    struct signalfd_siginfo info;
+    while (read(loop->signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        for (ev_signal *w = loop->signals; w; w = w->next)
+        {
+            if (w->signum == (int)info.ssi_signo)
+                queue_event(loop, (ev_watcher *)w, EV_SIGNAL);
+        }
+    }
+}
+
+int signals_update(struct ev_loop *loop)
+{
+    // Signals are only delivered through the signalfd while blocked, threads started afterwards
+    // inherit the mask
+    if (pthread_sigmask(SIG_BLOCK, &loop->signal_mask, NULL) != 0)
+    {
+        log_w("pthread_sigmask() failed");
+        return -1;
+    }
+
+    bool created = (loop->signal_fd < 0);
+    int fd = signalfd(loop->signal_fd, &loop->signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+    {
+        elog_e("signalfd() failed");
+        return -1;
+    }
+    loop->signal_fd = fd;
+
+    if (created)
+    {
+        struct epoll_event event = {.events = EPOLLIN | EPOLLET};
+        event.data.fd = fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            elog_e("epoll_ctl(signalfd) failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+ev_tstamp clock_seconds(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
\ No newline at end of file
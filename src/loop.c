@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+
+#include "loop.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <ev.h>
+
+#include "log.h"
+
+typedef struct loop_state
+{
+    bool stop;
+    bool polled;
+    unsigned long long events;
+
+    ev_prepare prepare;
+} loop_state_t;
+
+static void invoke_pending(EV_P);
+static void prepare_callback(EV_P_ ev_prepare *prepare, int revents);
+
+void rtptun_loop_setup(const rtptun_loop_options_t *options)
+{
+    if (options->mlock)
+    {
+        // Page faults on the forwarding path would undo everything else
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+            elog_w("mlockall() failed");
+        else
+            log_d("Memory locked");
+    }
+
+    if (options->realtime_priority > 0)
+    {
+        struct sched_param param = {.sched_priority = options->realtime_priority};
+
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret != 0)
+        {
+            errno = ret;
+            elog_w("Failed to switch to SCHED_FIFO priority %u", options->realtime_priority);
+        }
+        else
+        {
+            log_d("Running with SCHED_FIFO priority %u", options->realtime_priority);
+        }
+    }
+}
+
+void rtptun_loop_run(struct ev_loop *loop, const rtptun_loop_options_t *options)
+{
+    if (!options || !options->low_latency)
+    {
+        ev_run(loop, 0);
+        return;
+    }
+
+    loop_state_t state;
+    memset(&state, 0, sizeof(state));
+
+    ev_set_userdata(loop, &state);
+    ev_set_invoke_pending_cb(loop, invoke_pending);
+
+    // Marks the end of the prepare phase, only watchers invoked after polling count as events
+    ev_prepare_init(&state.prepare, prepare_callback);
+    ev_set_priority(&state.prepare, EV_MAXPRI);
+    ev_prepare_start(loop, &state.prepare);
+
+    ev_tstamp spin_time = options->spin_time / 1e6;
+    ev_tstamp last_event = ev_time();
+
+    while (!state.stop)
+    {
+        unsigned long long events = state.events;
+        ev_run(loop, EVRUN_NOWAIT);
+
+        ev_tstamp now = ev_time();
+        if (state.events != events)
+        {
+            last_event = now;
+        }
+        else if (now - last_event >= spin_time)
+        {
+            // Idle for a while, sleep in the kernel until the next event
+            ev_run(loop, EVRUN_ONCE);
+            last_event = ev_time();
+        }
+    }
+
+    ev_prepare_stop(loop, &state.prepare);
+    ev_set_invoke_pending_cb(loop, ev_invoke_pending);
+    ev_set_userdata(loop, NULL);
+}
+
+void rtptun_loop_break(struct ev_loop *loop)
+{
+    loop_state_t *state = ev_userdata(loop);
+    if (state)
+        state->stop = true;
+
+    ev_break(loop, EVBREAK_ALL);
+}
+
+void invoke_pending(EV_P)
+{
+    loop_state_t *state = ev_userdata(EV_A);
+
+    if (state->polled)
+    {
+        state->polled = false;
+        state->events += ev_pending_count(EV_A);
+    }
+
+    ev_invoke_pending(EV_A);
+}
+
+void prepare_callback(EV_P_ ev_prepare *prepare, int revents)
+{
+    loop_state_t *state = ev_userdata(EV_A);
+    state->polled = true;
+}
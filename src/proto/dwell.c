@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "proto/dwell.h"
+
+#include <time.h>
+
+#include "log.h"
+
+static _Thread_local dwell_hist_t hists[DWELL_DIRECTIONS][DWELL_STAGES];
+
+static unsigned int bucket_index(uint64_t value);
+static uint64_t bucket_upper(unsigned int index);
+static uint64_t hist_percentile(const dwell_hist_t *hist, double percentile);
+
+uint64_t dwell_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void dwell_record(dwell_direction_t direction, dwell_stage_t stage, uint64_t rx_time, unsigned int count)
+{
+    // Steps of the realtime clock would show up as packets from the future
+    uint64_t now = dwell_now();
+    if (now < rx_time)
+        return;
+
+    uint64_t dwell = now - rx_time;
+    dwell_hist_t *hist = &hists[direction][stage];
+    hist->buckets[bucket_index(dwell)] += count;
+    hist->count += count;
+    if (dwell > hist->max)
+        hist->max = dwell;
+}
+
+void dwell_log_stats(const char *listen_name, const char *connect_name)
+{
+    static const char *stages[DWELL_STAGES] = {"queued", "sent"};
+    const char *names[DWELL_DIRECTIONS] = {listen_name, connect_name};
+
+    for (unsigned int direction = 0; direction < DWELL_DIRECTIONS; direction++)
+    {
+        for (unsigned int stage = 0; stage < DWELL_STAGES; stage++)
+        {
+            const dwell_hist_t *hist = &hists[direction][stage];
+            if (hist->count == 0)
+                continue;
+
+            log_i("%s: dwell time until %s for %llu packets: p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+                  "p99.9 %.1f us, max %.1f us",
+                  names[direction], stages[stage], hist->count,
+                  hist_percentile(hist, 0.5) / 1e3, hist_percentile(hist, 0.9) / 1e3,
+                  hist_percentile(hist, 0.99) / 1e3, hist_percentile(hist, 0.999) / 1e3, hist->max / 1e3);
+        }
+    }
+}
+
+unsigned int bucket_index(uint64_t value)
+{
+    if (value < (1 << DWELL_SUB_BITS))
+        return value;
+
+    unsigned int shift = 63 - __builtin_clzll(value) - DWELL_SUB_BITS;
+    return ((shift + 1) << DWELL_SUB_BITS) | ((value >> shift) & ((1 << DWELL_SUB_BITS) - 1));
+}
+
+uint64_t bucket_upper(unsigned int index)
+{
+    if (index < (1 << DWELL_SUB_BITS))
+        return index;
+
+    unsigned int shift = (index >> DWELL_SUB_BITS) - 1;
+    uint64_t lower = (uint64_t)((1 << DWELL_SUB_BITS) | (index & ((1 << DWELL_SUB_BITS) - 1))) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t hist_percentile(const dwell_hist_t *hist, double percentile)
+{
+    unsigned long long rank = (unsigned long long)(percentile * hist->count);
+    if (rank >= hist->count)
+        rank = hist->count - 1;
+
+    unsigned long long seen = 0;
+    for (unsigned int i = 0; i < DWELL_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen > rank)
+            return (bucket_upper(i) < hist->max) ? bucket_upper(i) : hist->max;
+    }
+
+    return hist->max;
+}
\ No newline at end of file
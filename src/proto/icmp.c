@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+
+#include "proto/icmp.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+
+#define ICMP_IP_HDR_LEN 20
+#define ICMP_IP6_HDR_LEN 40
+#define ICMP_UDP_HDR_LEN 8
+#define ICMP_HDR_LEN 8
+
+// Raw sockets are opened on first use by every thread, 0 for IPv4 and 1 for IPv6
+static _Thread_local int raw_fds[2] = {-1, -1};
+static _Thread_local bool raw_failed[2];
+
+static int raw_socket(int family);
+static bool address_is_any(const struct sockaddr_storage *address);
+static uint16_t checksum(const unsigned char *data, size_t len);
+
+int icmp_send_too_big(udp_socket_t *socket, const packet_t *packet, size_t max_payload)
+{
+    // The quoted header needs the address the datagram was sent to, which wildcard listeners don't know
+    struct sockaddr_storage local = socket->local_address;
+    socklen_t local_len = socket->local_address_len;
+    if (local_len == 0 || address_is_any(&local))
+    {
+        local_len = sizeof(local);
+        if (getsockname(socket->fd, (struct sockaddr *)&local, &local_len) != 0 || address_is_any(&local))
+        {
+            log_d("Not sending ICMP error, local address unknown");
+            return -1;
+        }
+    }
+    if (local.ss_family != packet->addr.ss_family)
+        return -1;
+
+    int fd = raw_socket(local.ss_family);
+    if (fd < 0)
+        return -1;
+
+    size_t quote_len = (packet->data_len < ICMP_QUOTE_LEN) ? packet->data_len : ICMP_QUOTE_LEN;
+    unsigned char msg[ICMP_HDR_LEN + ICMP_IP6_HDR_LEN + ICMP_UDP_HDR_LEN + ICMP_QUOTE_LEN];
+    memset(msg, 0, sizeof(msg));
+
+    unsigned char *ip = &msg[ICMP_HDR_LEN];
+    unsigned char *udp;
+    uint16_t value;
+    size_t msg_len;
+
+    if (local.ss_family == AF_INET)
+    {
+        const struct sockaddr_in *src = (const struct sockaddr_in *)&packet->addr;
+        const struct sockaddr_in *dst = (const struct sockaddr_in *)&local;
+
+        // Fragmentation needed, the MTU is that of the sender's IP packets
+        msg[0] = 3;
+        msg[1] = 4;
+        value = htons(max_payload + ICMP_IP_HDR_LEN + ICMP_UDP_HDR_LEN);
+        memcpy(&msg[6], &value, 2);
+
+        ip[0] = 0x45;
+        value = htons(ICMP_IP_HDR_LEN + ICMP_UDP_HDR_LEN + packet->data_len);
+        memcpy(&ip[2], &value, 2);
+        value = htons(0x4000); // Don't fragment
+        memcpy(&ip[6], &value, 2);
+        ip[8] = 64;
+        ip[9] = IPPROTO_UDP;
+        memcpy(&ip[12], &src->sin_addr, 4);
+        memcpy(&ip[16], &dst->sin_addr, 4);
+        value = checksum(ip, ICMP_IP_HDR_LEN);
+        memcpy(&ip[10], &value, 2);
+
+        udp = &ip[ICMP_IP_HDR_LEN];
+        memcpy(&udp[0], &src->sin_port, 2);
+        memcpy(&udp[2], &dst->sin_port, 2);
+        msg_len = ICMP_HDR_LEN + ICMP_IP_HDR_LEN + ICMP_UDP_HDR_LEN + quote_len;
+    }
+    else
+    {
+        const struct sockaddr_in6 *src = (const struct sockaddr_in6 *)&packet->addr;
+        const struct sockaddr_in6 *dst = (const struct sockaddr_in6 *)&local;
+
+        // Packet too big, the kernel fills in the checksum of ICMPv6 raw sockets
+        msg[0] = 2;
+        msg[1] = 0;
+        uint32_t mtu = htonl(max_payload + ICMP_IP6_HDR_LEN + ICMP_UDP_HDR_LEN);
+        memcpy(&msg[4], &mtu, 4);
+
+        ip[0] = 0x60;
+        value = htons(ICMP_UDP_HDR_LEN + packet->data_len);
+        memcpy(&ip[4], &value, 2);
+        ip[6] = IPPROTO_UDP;
+        ip[7] = 64;
+        memcpy(&ip[8], &src->sin6_addr, 16);
+        memcpy(&ip[24], &dst->sin6_addr, 16);
+
+        udp = &ip[ICMP_IP6_HDR_LEN];
+        memcpy(&udp[0], &src->sin6_port, 2);
+        memcpy(&udp[2], &dst->sin6_port, 2);
+        msg_len = ICMP_HDR_LEN + ICMP_IP6_HDR_LEN + ICMP_UDP_HDR_LEN + quote_len;
+    }
+
+    value = htons(ICMP_UDP_HDR_LEN + packet->data_len);
+    memcpy(&udp[4], &value, 2);
+    memcpy(&udp[ICMP_UDP_HDR_LEN], packet->data, quote_len);
+
+    if (local.ss_family == AF_INET)
+    {
+        value = checksum(msg, msg_len);
+        memcpy(&msg[2], &value, 2);
+    }
+
+    // Raw sockets take no port
+    struct sockaddr_storage dest = packet->addr;
+    if (dest.ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)&dest)->sin6_port = 0;
+    else
+        ((struct sockaddr_in *)&dest)->sin_port = 0;
+
+    if (sendto(fd, msg, msg_len, 0, (struct sockaddr *)&dest, packet->addr_len) < 0)
+    {
+        elog_d("sendto(ICMP) failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+int raw_socket(int family)
+{
+    int index = (family == AF_INET6) ? 1 : 0;
+    if (raw_fds[index] >= 0 || raw_failed[index])
+        return raw_fds[index];
+
+    raw_fds[index] = (family == AF_INET6) ? socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_ICMPV6)
+                                          : socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_ICMP);
+    if (raw_fds[index] < 0)
+    {
+        elog_w("Failed to open raw socket, datagrams too large for the tunnel are dropped silently");
+        raw_failed[index] = true;
+        return -1;
+    }
+
+    // Nothing is ever read, don't let replies and errors of other hosts pile up
+    int size = 0;
+    if (setsockopt(raw_fds[index], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0)
+        elog_d("setsockopt(SO_RCVBUF) failed");
+
+    return raw_fds[index];
+}
+
+bool address_is_any(const struct sockaddr_storage *address)
+{
+    if (address->ss_family == AF_INET6)
+        return IN6_IS_ADDR_UNSPECIFIED(&((const struct sockaddr_in6 *)address)->sin6_addr);
+
+    return ((const struct sockaddr_in *)address)->sin_addr.s_addr == htonl(INADDR_ANY);
+}
+
+uint16_t checksum(const unsigned char *data, size_t len)
+{
+    // Words are summed as they appear in memory, which keeps the result in network byte order
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2)
+    {
+        uint16_t word;
+        memcpy(&word, &data[i], 2);
+        sum += word;
+    }
+    if (len & 1)
+    {
+        uint16_t word = 0;
+        memcpy(&word, &data[len - 1], 1);
+        sum += word;
+    }
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "proto/inner.h"
+
+#include <string.h>
+
+#define WG_HANDSHAKE_INITIATION 1
+#define WG_HANDSHAKE_RESPONSE 2
+#define WG_COOKIE_REPLY 3
+#define WG_TRANSPORT_DATA 4
+
+#define WG_HANDSHAKE_INITIATION_LEN 148
+#define WG_HANDSHAKE_RESPONSE_LEN 92
+#define WG_COOKIE_REPLY_LEN 64
+#define WG_TRANSPORT_DATA_MIN_LEN 32
+
+static bool wg_type(const unsigned char *data, size_t data_len, unsigned int *type);
+static bool wg_client_session(const unsigned char *data, size_t data_len, uint64_t *session);
+static bool wg_upstream_session(const unsigned char *data, size_t data_len, uint64_t *session);
+
+static const inner_proto_t protocols[] = {
+    {"wireguard", wg_client_session, wg_upstream_session},
+};
+
+const inner_proto_t *inner_proto_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(protocols) / sizeof(protocols[0]); i++)
+    {
+        if (strcmp(protocols[i].name, name) == 0)
+            return &protocols[i];
+    }
+
+    return NULL;
+}
+
+bool wg_type(const unsigned char *data, size_t data_len, unsigned int *type)
+{
+    // Message type followed by three reserved zero bytes
+    if (data_len < 8 || data[1] != 0 || data[2] != 0 || data[3] != 0)
+        return false;
+
+    *type = data[0];
+    return true;
+}
+
+bool wg_client_session(const unsigned char *data, size_t data_len, uint64_t *session)
+{
+    unsigned int type;
+    if (!wg_type(data, data_len, &type))
+        return false;
+
+    // Every handshake picks a new sender index, the peer addresses all later messages to it
+    if ((type == WG_HANDSHAKE_INITIATION && data_len == WG_HANDSHAKE_INITIATION_LEN) ||
+        (type == WG_HANDSHAKE_RESPONSE && data_len == WG_HANDSHAKE_RESPONSE_LEN))
+    {
+        uint32_t sender;
+        memcpy(&sender, &data[4], sizeof(sender));
+        *session = sender;
+        return true;
+    }
+
+    return false;
+}
+
+bool wg_upstream_session(const unsigned char *data, size_t data_len, uint64_t *session)
+{
+    unsigned int type;
+    if (!wg_type(data, data_len, &type))
+        return false;
+
+    // Initiations from upstream only carry the sender's own index, so they can't be routed
+    uint32_t receiver;
+    if (type == WG_HANDSHAKE_RESPONSE && data_len == WG_HANDSHAKE_RESPONSE_LEN)
+        memcpy(&receiver, &data[8], sizeof(receiver));
+    else if ((type == WG_COOKIE_REPLY && data_len == WG_COOKIE_REPLY_LEN) ||
+             (type == WG_TRANSPORT_DATA && data_len >= WG_TRANSPORT_DATA_MIN_LEN))
+        memcpy(&receiver, &data[4], sizeof(receiver));
+    else
+        return false;
+
+    *session = receiver;
+    return true;
+}
\ No newline at end of file
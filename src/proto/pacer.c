@@ -0,0 +1,68 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "proto/pacer.h"
+
+#include <time.h>
+
+static uint64_t pacer_rate(pacer_t *pacer, size_t len, uint64_t now);
+
+void pacer_init(pacer_t *pacer, uint64_t rate)
+{
+    pacer->rate = rate;
+    pacer->estimate = 0;
+    pacer->window_start = 0;
+    pacer->window_bytes = 0;
+    pacer->next_departure = 0;
+}
+
+uint64_t pacer_schedule(pacer_t *pacer, size_t len, uint64_t now)
+{
+    uint64_t rate = pacer_rate(pacer, len, now);
+    if (rate == 0)
+        return now;
+
+    // Idle time isn't saved up for a later burst
+    uint64_t departure = (pacer->next_departure > now) ? pacer->next_departure : now;
+    if (departure > now + PACER_HORIZON)
+        departure = now + PACER_HORIZON;
+
+    pacer->next_departure = departure + len * 1000000000ULL / rate;
+
+    return departure;
+}
+
+uint64_t pacer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t pacer_rate(pacer_t *pacer, size_t len, uint64_t now)
+{
+    if (pacer->rate > 0)
+        return pacer->rate;
+
+    if (pacer->window_start == 0)
+        pacer->window_start = now;
+    pacer->window_bytes += len;
+
+    uint64_t elapsed = now - pacer->window_start;
+    if (elapsed >= PACER_WINDOW)
+    {
+        uint64_t sample = pacer->window_bytes * 1000000000ULL / elapsed;
+
+        // Smooth the estimate so a single quiet or busy window doesn't swing it around
+        pacer->estimate = (pacer->estimate == 0) ? sample : (3 * pacer->estimate + sample) / 4;
+        pacer->window_start = now;
+        pacer->window_bytes = 0;
+    }
+
+    // Nothing to pace against until the first window completes
+    if (pacer->estimate == 0)
+        return 0;
+
+    uint64_t rate = pacer->estimate * PACER_HEADROOM_PERCENT / 100;
+    return (rate < PACER_MIN_RATE) ? PACER_MIN_RATE : rate;
+}
\ No newline at end of file
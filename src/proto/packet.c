@@ -0,0 +1,188 @@
+#include "proto/packet.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "log.h"
+
+typedef struct packet_free_list
+{
+    packet_t *head;
+    unsigned int count;
+    unsigned int max;
+} packet_free_list_t;
+
+typedef struct packet_pool
+{
+    packet_free_list_t lists[2];
+
+    unsigned long long allocated;
+    unsigned long long allocated_jumbo;
+    unsigned long long reused;
+} packet_pool_t;
+
+// Every loop thread recycles its own buffers, so no locking is needed
+static _Thread_local packet_pool_t pool = {
+    .lists = {
+        [PACKET_CLASS_MTU] = {.max = PACKET_POOL_MAX},
+        [PACKET_CLASS_JUMBO] = {.max = PACKET_POOL_MAX_JUMBO},
+    },
+};
+
+static packet_t *packet_new(packet_class_t class);
+
+packet_t *packet_alloc(size_t data_len)
+{
+    if (data_len > packet_capacity(PACKET_CLASS_JUMBO))
+        return NULL;
+
+    packet_class_t class = (data_len <= packet_capacity(PACKET_CLASS_MTU)) ? PACKET_CLASS_MTU : PACKET_CLASS_JUMBO;
+
+    packet_t *packet = packet_alloc_class(class);
+    if (packet)
+        packet->data_len = data_len;
+
+    return packet;
+}
+
+packet_t *packet_alloc_class(packet_class_t class)
+{
+    packet_free_list_t *list = &pool.lists[class];
+
+    packet_t *packet = list->head;
+    if (packet)
+    {
+        list->head = packet->next;
+        list->count--;
+        pool.reused++;
+    }
+    else
+    {
+        packet = packet_new(class);
+        if (!packet)
+            return NULL;
+    }
+
+    packet->next = NULL;
+    packet->data = &packet->buf[PACKET_HEADROOM];
+    packet->data_len = 0;
+    packet->addr_len = 0;
+    packet->txtime = 0;
+    packet->rx_time = 0;
+    packet->ecn = 0;
+    packet->has_link = false;
+
+    return packet;
+}
+
+void packet_free(packet_t *packet)
+{
+    if (!packet)
+        return;
+
+    packet_free_list_t *list = &pool.lists[packet->class];
+    if (list->count >= list->max)
+    {
+        free(packet);
+        return;
+    }
+
+    packet->next = list->head;
+    list->head = packet;
+    list->count++;
+}
+
+size_t packet_capacity(packet_class_t class)
+{
+    return (class == PACKET_CLASS_MTU) ? PACKET_MTU_SIZE : PACKET_JUMBO_SIZE;
+}
+
+size_t packet_headroom(const packet_t *packet)
+{
+    return packet->data - packet->buf;
+}
+
+size_t packet_tailroom(const packet_t *packet)
+{
+    return packet->size - packet_headroom(packet) - packet->data_len;
+}
+
+unsigned char *packet_push(packet_t *packet, size_t len)
+{
+    if (packet_headroom(packet) < len)
+        return NULL;
+
+    packet->data -= len;
+    packet->data_len += len;
+
+    return packet->data;
+}
+
+unsigned char *packet_put(packet_t *packet, size_t len)
+{
+    if (packet_tailroom(packet) < len)
+        return NULL;
+
+    unsigned char *tail = &packet->data[packet->data_len];
+    packet->data_len += len;
+
+    return tail;
+}
+
+void packet_pool_reserve(unsigned int count)
+{
+    packet_free_list_t *list = &pool.lists[PACKET_CLASS_MTU];
+
+    while (list->count < count && list->count < list->max)
+    {
+        packet_t *packet = packet_new(PACKET_CLASS_MTU);
+        if (!packet)
+            return;
+
+        packet->next = list->head;
+        list->head = packet;
+        list->count++;
+    }
+}
+
+void packet_pool_destroy(void)
+{
+    for (size_t i = 0; i < sizeof(pool.lists) / sizeof(pool.lists[0]); i++)
+    {
+        packet_free_list_t *list = &pool.lists[i];
+        while (list->head)
+        {
+            packet_t *next = list->head->next;
+            free(list->head);
+            list->head = next;
+        }
+        list->count = 0;
+    }
+}
+
+void packet_pool_log_stats(void)
+{
+    log_i("Packet pool: %llu buffers allocated (%llu jumbo), %llu reused",
+          pool.allocated, pool.allocated_jumbo, pool.reused);
+}
+
+packet_t *packet_new(packet_class_t class)
+{
+    size_t size = PACKET_HEADROOM + packet_capacity(class) + PACKET_TAILROOM;
+
+    packet_t *packet = malloc(sizeof(*packet) + size);
+    if (!packet)
+    {
+        elog_e("malloc(packet_t) failed");
+        return NULL;
+    }
+
+    packet->class = class;
+    packet->size = size;
+
+    pool.allocated++;
+    if (class == PACKET_CLASS_JUMBO)
+        pool.allocated_jumbo++;
+
+    return packet;
+}
@@ -4,10 +4,13 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <limits.h>
 
 #include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
 #include <arpa/inet.h>
 
 #include <ev.h>
@@ -16,19 +19,53 @@
 
 #include "log.h"
 #include "proto/rtp.h"
+#include "proto/icmp.h"
 
-static void udp_recv_callback(udp_socket_t *socket, unsigned char *data, ssize_t data_len,
-                              struct sockaddr_storage *address, socklen_t addrlen);
+// Probe payloads start with their type and size, the rest is padding
+#define RTP_PROBE_REQUEST 1
+#define RTP_PROBE_REPLY 2
+#define RTP_PROBE_LEN 8
+
+static void udp_recv_callback(udp_socket_t *socket, packet_t *packet);
 static void udp_send_callback(udp_socket_t *socket, ssize_t sent);
 
+static rtp_dest_t *rtp_dest_lookup(rtp_socket_t *socket, ssrc_t ssrc);
+static int rtp_seal(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet, const unsigned char *data,
+                    uint8_t payload_type);
+static int rtp_emit(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet, const unsigned char *data,
+                    uint8_t payload_type);
+static void rtp_pace(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet);
+
+static void pmtu_start(rtp_socket_t *socket, rtp_dest_t *dest);
+static void pmtu_next(rtp_socket_t *socket, rtp_dest_t *dest);
+static int pmtu_probe(rtp_socket_t *socket, rtp_dest_t *dest, size_t size);
+static void pmtu_finish(rtp_socket_t *socket, rtp_dest_t *dest);
+static void pmtu_recv(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc);
+static void pmtu_callback(EV_P_ ev_timer *timer, int revents);
+
+static int aggregate_add(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet);
+static int aggregate_flush(rtp_socket_t *socket, rtp_dest_t *dest);
+static bool aggregate_valid(const unsigned char *data, size_t data_len);
+static void aggregate_recv(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc);
+static void aggregate_callback(EV_P_ ev_timer *timer, int revents);
+
+static size_t fragment_limit(rtp_socket_t *socket, rtp_dest_t *dest);
+static int fragment_send(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet, size_t limit);
+static void fragment_recv(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc, uint16_t seq, bool last);
+static void reassembly_complete(rtp_socket_t *socket, rtp_reassembly_t *entry, ssrc_t ssrc);
+static void reassembly_drop(rtp_socket_t *socket, rtp_reassembly_t *entry);
+static void reassembly_free(rtp_socket_t *socket);
+static void reassembly_callback(EV_P_ ev_timer *timer, int revents);
+
 static rtp_dest_t *rtp_dest_find(rtp_socket_t *socket, ssrc_t ssrc);
 static rtp_dest_t *rtp_dest_set(rtp_socket_t *socket, ssrc_t ssrc, struct sockaddr_storage *address,
                                 socklen_t address_len, uint8_t payload_type);
 static int rtp_dest_del(rtp_socket_t *socket, ssrc_t ssrc);
+static void rtp_dest_release(rtp_socket_t *socket, rtp_dest_t *dest);
 static void rtp_dest_free(rtp_socket_t *socket);
 
 rtp_socket_t *rtp_connect(struct ev_loop *loop, const char *address, const char *port, const char *key,
-                          rtp_recv_callback_t recv_callback, rtp_send_callback_t send_callback, void *user_data)
+                          const udp_options_t *options, rtp_recv_callback_t recv_callback, rtp_send_callback_t send_callback, void *user_data)
 {
     rtp_socket_t *sock = calloc(1, sizeof(*sock));
     if (!sock)
@@ -37,6 +74,7 @@ rtp_socket_t *rtp_connect(struct ev_loop *loop, const char *address, const char
         goto error;
     }
 
+    sock->loop = loop;
     sock->connected = 1;
 
     sock->rand_seed = time(NULL);
@@ -54,13 +92,24 @@ rtp_socket_t *rtp_connect(struct ev_loop *loop, const char *address, const char
 
     sock->rtp_dest_map = NULL;
 
-    sock->udp_sock = udp_connect(loop, address, port, udp_recv_callback, udp_send_callback, sock);
+    sock->reassembly_map = NULL;
+    ev_timer_init(&sock->reassembly_timer, reassembly_callback, RTP_REASSEMBLY_INTERVAL, RTP_REASSEMBLY_INTERVAL);
+    sock->reassembly_timer.data = sock;
+
+    // Full MTU sized datagrams from the other side arrive with RTP wrapped around them
+    udp_options_t udp_options = *options;
+    udp_options.recv_overhead = RTP_OVERHEAD;
+
+    sock->udp_sock = udp_connect(loop, address, port, &udp_options, udp_recv_callback, udp_send_callback, sock);
     if (!sock->udp_sock)
     {
         log_e("udp_connect(%s:%s) failed", address, port);
         goto error;
     }
 
+    if (sock->udp_sock->options.path_mtu && udp_set_dont_fragment(sock->udp_sock) != 0)
+        sock->udp_sock->options.path_mtu = false;
+
     return sock;
 error:
     if (sock)
@@ -74,7 +123,7 @@ error:
 }
 
 rtp_socket_t *rtp_listen(struct ev_loop *loop, const char *address, const char *port, const char *key,
-                         rtp_recv_callback_t recv_callback, rtp_send_callback_t send_callback, void *user_data)
+                         const udp_options_t *options, rtp_recv_callback_t recv_callback, rtp_send_callback_t send_callback, void *user_data)
 {
     rtp_socket_t *sock = calloc(1, sizeof(*sock));
     if (!sock)
@@ -83,6 +132,7 @@ rtp_socket_t *rtp_listen(struct ev_loop *loop, const char *address, const char *
         goto error;
     }
 
+    sock->loop = loop;
     sock->connected = 0;
     sock->rand_seed = time(NULL);
     sock->seq_num = rand_r(&sock->rand_seed);
@@ -99,13 +149,24 @@ rtp_socket_t *rtp_listen(struct ev_loop *loop, const char *address, const char *
 
     sock->rtp_dest_map = NULL;
 
-    sock->udp_sock = udp_listen(loop, address, port, udp_recv_callback, udp_send_callback, sock);
+    sock->reassembly_map = NULL;
+    ev_timer_init(&sock->reassembly_timer, reassembly_callback, RTP_REASSEMBLY_INTERVAL, RTP_REASSEMBLY_INTERVAL);
+    sock->reassembly_timer.data = sock;
+
+    // Full MTU sized datagrams from the other side arrive with RTP wrapped around them
+    udp_options_t udp_options = *options;
+    udp_options.recv_overhead = RTP_OVERHEAD;
+
+    sock->udp_sock = udp_listen(loop, address, port, &udp_options, udp_recv_callback, udp_send_callback, sock);
     if (!sock->udp_sock)
     {
         log_e("udp_listen([%s]:%s) failed", address, port);
         goto error;
     }
 
+    if (sock->udp_sock->options.path_mtu && udp_set_dont_fragment(sock->udp_sock) != 0)
+        sock->udp_sock->options.path_mtu = false;
+
     return sock;
 error:
     if (sock)
@@ -120,8 +181,9 @@ error:
 
 void rtp_destroy(rtp_socket_t *socket)
 {
-    udp_destroy(socket->udp_sock);
     rtp_dest_free(socket);
+    reassembly_free(socket);
+    udp_destroy(socket->udp_sock);
 
     free(socket);
 }
@@ -134,60 +196,184 @@ int rtp_send(rtp_socket_t *socket, const unsigned char *data, size_t data_len, s
         return -1;
     }
 
-    unsigned char buffer[UDP_BUFFER_SIZE];
-    rtphdr_t *header = (rtphdr_t *)buffer;
+    packet_t *packet = packet_alloc(data_len);
+    if (!packet)
+    {
+        log_e("Failed to allocate packet");
+        return -1;
+    }
 
-    memset(header, 0, sizeof(*header));
-    header->version = 2;
-    header->ssrc = htonl(ssrc);
-    header->seq_number = htons(socket->seq_num);
+    rtp_dest_t *dest = rtp_dest_lookup(socket, ssrc);
+    if (!dest)
+    {
+        packet_free(packet);
+        return -1;
+    }
 
-    unsigned char *payload = &buffer[sizeof(rtphdr_t)];
-    if (chacha_encrypt(&socket->cipher, data, data_len,
-                       payload,
-                       &payload[data_len + CHACHA_NONCE_LEN],
-                       &payload[data_len]) != CHACHA_RET_SUCCESS)
+    // Datagrams waiting to be aggregated were there first
+    if (dest->aggregate)
+        aggregate_flush(socket, dest);
+
+    // Encrypting straight into the packet doubles as the copy
+    return rtp_seal(socket, dest, packet, data, dest->pl_type);
+}
+
+int rtp_send_packet(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc)
+{
+    if (packet->data_len > RTP_MAX_PAYLOAD_SIZE)
     {
-        log_e("Failed to encrypt data");
+        log_e("Maximum UDP buffer size exceeded");
+        packet_free(packet);
+        return -1;
+    }
+
+    rtp_dest_t *dest = rtp_dest_lookup(socket, ssrc);
+    if (!dest)
+    {
+        packet_free(packet);
         return -1;
     }
 
-    socket->seq_num = (socket->seq_num + 1) % UINT16_MAX;
+    if (socket->udp_sock->options.aggregate > 0)
+    {
+        if (packet->data_len <= RTP_AGGREGATE_SMALL)
+            return aggregate_add(socket, dest, packet);
 
-    size_t total_len = data_len + sizeof(rtphdr_t) + CHACHA_NONCE_LEN + CHACHA_MAC_LEN;
+        // Datagrams waiting to be aggregated were there first
+        if (dest->aggregate)
+            aggregate_flush(socket, dest);
+    }
 
-    if (socket->connected)
+    size_t limit = fragment_limit(socket, dest);
+    if (limit > 0 && packet->data_len + RTP_OVERHEAD > limit)
+        return fragment_send(socket, dest, packet, limit);
+
+    if (packet_headroom(packet) >= sizeof(rtphdr_t) && packet_tailroom(packet) >= RTP_TRAILER_SIZE)
+        return rtp_seal(socket, dest, packet, packet->data, dest->pl_type);
+
+    // Not enough room around the payload, move it into a fresh packet
+    packet_t *copy = packet_alloc(packet->data_len);
+    if (!copy)
     {
-        rtp_dest_t *dest = rtp_dest_set(socket, ssrc, NULL, 0, RTP_PAYLOAD_TYPE);
-        if (!dest)
-        {
-            log_e("Failed to map RTP socket");
-            return -1;
-        }
+        log_e("Failed to allocate packet");
+        packet_free(packet);
+        return -1;
+    }
 
-        header->timestamp = htonl(dest->timestamp);
-        header->payload_type = dest->pl_type;
+    copy->rx_time = packet->rx_time;
+    copy->ecn = packet->ecn;
 
-        dest->timestamp += RTP_TIMESTAMP_INCREMENT;
+    int ret = rtp_seal(socket, dest, copy, packet->data, dest->pl_type);
+    packet_free(packet);
+
+    return ret;
+}
 
-        return udp_send(socket->udp_sock, buffer, total_len);
+rtp_dest_t *rtp_dest_lookup(rtp_socket_t *socket, ssrc_t ssrc)
+{
+    rtp_dest_t *dest;
+    if (socket->connected)
+    {
+        dest = rtp_dest_set(socket, ssrc, NULL, 0, RTP_PAYLOAD_TYPE);
+        if (!dest)
+            log_e("Failed to map RTP socket");
     }
     else
     {
-        rtp_dest_t *dest = rtp_dest_find(socket, ssrc);
+        dest = rtp_dest_find(socket, ssrc);
         if (!dest)
-        {
             log_e("Failed to find address for SSRC#%u", ssrc);
-            return -1;
-        }
+    }
+
+    return dest;
+}
+
+int rtp_seal(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet, const unsigned char *data,
+             uint8_t payload_type)
+{
+    int ret = rtp_emit(socket, dest, packet, data, payload_type);
+
+    // The kernel has heard of a smaller path MTU, find out how small. Searches nobody answered are
+    // only retried once their timer fires
+    if (ret != 0 && errno == EMSGSIZE && socket->udp_sock->options.path_mtu && dest->probe_size == 0 &&
+        (dest->mtu > 0 || !ev_is_active(&dest->probe_timer)))
+        pmtu_start(socket, dest);
 
-        header->timestamp = htonl(dest->timestamp);
-        header->payload_type = dest->pl_type;
+    return ret;
+}
+
+int rtp_emit(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet, const unsigned char *data,
+             uint8_t payload_type)
+{
+    size_t data_len = packet->data_len;
 
-        dest->timestamp += RTP_TIMESTAMP_INCREMENT;
+    rtphdr_t header;
+    memset(&header, 0, sizeof(header));
+    header.version = 2;
+    header.ssrc = htonl(dest->ssrc);
+    header.seq_number = htons(socket->seq_num);
+    header.timestamp = htonl(dest->timestamp);
+    header.payload_type = payload_type & ~RTP_MARKER;
+    header.marker = (payload_type & RTP_MARKER) != 0;
 
-        return udp_sendto(socket->udp_sock, buffer, total_len, &dest->addr, dest->addr_len);
+    // Payload is followed by the nonce and MAC, data may point at the payload itself. The header decides
+    // how the payload is parsed, so it is authenticated along with it
+    unsigned char *trailer = packet_put(packet, RTP_TRAILER_SIZE);
+    if (chacha_encrypt(&socket->cipher, data, data_len,
+                       (const unsigned char *)&header, sizeof(header),
+                       packet->data,
+                       &trailer[CHACHA_NONCE_LEN],
+                       trailer) != CHACHA_RET_SUCCESS)
+    {
+        log_e("Failed to encrypt data");
+        packet_free(packet);
+        return -1;
     }
+
+    memcpy(packet_push(packet, sizeof(header)), &header, sizeof(header));
+
+    // Wraps around like the field on the wire, fragments rely on consecutive numbers
+    socket->seq_num++;
+    dest->timestamp += RTP_TIMESTAMP_INCREMENT;
+
+    // Probes measure the path, they don't take from the flow's pacing budget
+    if (header.payload_type != RTP_PROBE_PAYLOAD_TYPE)
+        rtp_pace(socket, dest, packet);
+
+    if (socket->connected)
+        return udp_send_packet(socket->udp_sock, packet);
+    else
+        return udp_sendto_packet(socket->udp_sock, packet, &dest->addr, dest->addr_len);
+}
+
+void rtp_pace(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet)
+{
+    if (socket->udp_sock->options.pacing == UDP_PACING_OFF)
+        return;
+
+    packet->txtime = pacer_schedule(&dest->pacer, packet->data_len, pacer_now());
+}
+
+bool rtp_drop_oversized(rtp_socket_t *rtp, ssrc_t ssrc, udp_socket_t *socket, packet_t *packet)
+{
+    // Datagrams are split up rather than dropped with fragmentation
+    if (!rtp->udp_sock->options.path_mtu || rtp->udp_sock->options.fragment_size > 0)
+        return false;
+
+    rtp_dest_t *dest = rtp_dest_find(rtp, ssrc);
+    if (!dest || dest->mtu == 0 || packet->data_len + RTP_OVERHEAD <= dest->mtu)
+        return false;
+
+    size_t max_payload = dest->mtu - RTP_OVERHEAD;
+    rtp->too_big++;
+    log_d("Dropping %zu byte datagram for SSRC #%u, the tunnel carries up to %zu bytes",
+          packet->data_len, ssrc, max_payload);
+
+    if (socket->options.icmp_too_big)
+        icmp_send_too_big(socket, packet, max_payload);
+
+    packet_free(packet);
+    return true;
 }
 
 int rtp_close_stream(rtp_socket_t *socket, ssrc_t ssrc)
@@ -226,8 +412,8 @@ rtp_dest_t *rtp_dest_set(rtp_socket_t *socket, ssrc_t ssrc, struct sockaddr_stor
         }
         else
         {
-            HASH_DEL(socket->rtp_dest_map, existing);
-            free(existing);
+            // A new path, its MTU is searched from scratch
+            rtp_dest_release(socket, existing);
         }
     }
 
@@ -244,6 +430,43 @@ rtp_dest_t *rtp_dest_set(rtp_socket_t *socket, ssrc_t ssrc, struct sockaddr_stor
     dest->timestamp = rand_r(&socket->rand_seed);
     dest->pl_type = payload_type;
 
+    // Every SSRC is paced on its own, pacing_rate is in kbit/s
+    pacer_init(&dest->pacer, (uint64_t)socket->udp_sock->options.pacing_rate * 125);
+
+    dest->mtu = 0;
+    dest->probe_low = 0;
+    dest->probe_high = 0;
+    dest->probe_size = 0;
+    dest->probe_count = 0;
+    dest->probe_confirmed = false;
+    dest->socket = socket;
+    ev_timer_init(&dest->probe_timer, pmtu_callback, 0, 0);
+    dest->probe_timer.data = dest;
+
+    dest->aggregate = NULL;
+    dest->aggregate_count = 0;
+    ev_timer_init(&dest->aggregate_timer, aggregate_callback, 0, 0);
+    dest->aggregate_timer.data = dest;
+
+    if (socket->udp_sock->options.path_mtu)
+    {
+        // Flows to the same peer share its path, which may have been searched already
+        rtp_dest_t *current, *tmp;
+        HASH_ITER(hh, socket->rtp_dest_map, current, tmp)
+        {
+            if (current->mtu > 0 && current->addr_len == dest->addr_len &&
+                memcmp(&current->addr, &dest->addr, dest->addr_len) == 0)
+            {
+                dest->mtu = current->mtu;
+                ev_timer_set(&dest->probe_timer, RTP_PMTU_INTERVAL, 0);
+                break;
+            }
+        }
+
+        // Otherwise the search starts once the datagram that created the destination has been sent
+        ev_timer_start(socket->loop, &dest->probe_timer);
+    }
+
     HASH_ADD(hh, socket->rtp_dest_map, ssrc, sizeof(ssrc_t), dest);
 
     return dest;
@@ -255,12 +478,24 @@ int rtp_dest_del(rtp_socket_t *socket, ssrc_t ssrc)
     if (!deletee)
         return -1;
 
-    HASH_DEL(socket->rtp_dest_map, deletee);
-    free(deletee);
+    rtp_dest_release(socket, deletee);
 
     return 0;
 }
 
+void rtp_dest_release(rtp_socket_t *socket, rtp_dest_t *dest)
+{
+    ev_timer_stop(socket->loop, &dest->probe_timer);
+
+    // Datagrams still waiting to be aggregated go down with the flow
+    ev_timer_stop(socket->loop, &dest->aggregate_timer);
+    if (dest->aggregate)
+        packet_free(dest->aggregate);
+
+    HASH_DEL(socket->rtp_dest_map, dest);
+    free(dest);
+}
+
 void rtp_dest_free(rtp_socket_t *socket)
 {
     if (!socket->rtp_dest_map)
@@ -269,52 +504,629 @@ void rtp_dest_free(rtp_socket_t *socket)
     rtp_dest_t *current, *tmp;
     HASH_ITER(hh, socket->rtp_dest_map, current, tmp)
     {
-        HASH_DEL(socket->rtp_dest_map, current);
-        free(current);
+        rtp_dest_release(socket, current);
+    }
+}
+
+void pmtu_start(rtp_socket_t *socket, rtp_dest_t *dest)
+{
+    const struct sockaddr_storage *address = (socket->connected) ? &socket->udp_sock->remote_address : &dest->addr;
+    socklen_t addr_len = (socket->connected) ? socket->udp_sock->remote_address_len : dest->addr_len;
+
+    // The kernel knows the interface MTU and whatever ICMP errors said, nothing larger can get through
+    int limit = udp_path_mtu(address, addr_len);
+    if (limit < 0 || limit > RTP_PMTU_MAX)
+        limit = RTP_PMTU_MAX;
+
+    dest->probe_low = (limit < RTP_PMTU_BASE) ? limit : RTP_PMTU_BASE;
+    dest->probe_high = limit + 1;
+    dest->probe_confirmed = false;
+
+    // Most paths are as wide as the interface, which takes a single probe to confirm
+    if (dest->probe_high - dest->probe_low > RTP_PMTU_RESOLUTION && pmtu_probe(socket, dest, limit) == 0)
+        return;
+
+    dest->probe_high = limit;
+    pmtu_next(socket, dest);
+}
+
+void pmtu_next(rtp_socket_t *socket, rtp_dest_t *dest)
+{
+    while (dest->probe_high - dest->probe_low > RTP_PMTU_RESOLUTION)
+    {
+        size_t size = dest->probe_low + (dest->probe_high - dest->probe_low) / 2;
+        if (pmtu_probe(socket, dest, size) == 0)
+            return;
+
+        dest->probe_high = size;
+    }
+
+    pmtu_finish(socket, dest);
+}
+
+int pmtu_probe(rtp_socket_t *socket, rtp_dest_t *dest, size_t size)
+{
+    if (size != dest->probe_size)
+        dest->probe_count = 0;
+    dest->probe_size = size;
+    dest->probe_count++;
+
+    // Lost probes are sent again once the timer fires
+    ev_timer_stop(socket->loop, &dest->probe_timer);
+    ev_timer_set(&dest->probe_timer, RTP_PMTU_PROBE_TIMEOUT, 0);
+    ev_timer_start(socket->loop, &dest->probe_timer);
+
+    packet_t *packet = packet_alloc(size - RTP_OVERHEAD);
+    if (!packet)
+    {
+        log_e("Failed to allocate packet");
+        return 0;
+    }
+    memset(packet->data, 0, packet->data_len);
+    packet->data[0] = RTP_PROBE_REQUEST;
+    uint32_t value = htonl(size);
+    memcpy(&packet->data[4], &value, sizeof(value));
+
+    // Datagrams above the path MTU the kernel knows of fail right away
+    if (rtp_emit(socket, dest, packet, packet->data, RTP_PROBE_PAYLOAD_TYPE) != 0 && errno == EMSGSIZE)
+        return -1;
+
+    return 0;
+}
+
+void pmtu_finish(rtp_socket_t *socket, rtp_dest_t *dest)
+{
+    dest->probe_size = 0;
+    ev_timer_stop(socket->loop, &dest->probe_timer);
+
+    // Without a single reply the peer may just not answer probes, the size found so far stays
+    if (!dest->probe_confirmed)
+    {
+        log_d("No path MTU probe for SSRC #%u was answered, trying again later", dest->ssrc);
+        ev_timer_set(&dest->probe_timer, RTP_PMTU_RETRY, 0);
+        ev_timer_start(socket->loop, &dest->probe_timer);
+        return;
+    }
+
+    if (dest->probe_low != dest->mtu)
+        log_i("Path MTU for SSRC #%u is %zu bytes, tunneling datagrams of up to %zu bytes",
+              dest->ssrc, dest->probe_low, dest->probe_low - RTP_OVERHEAD);
+
+    dest->mtu = dest->probe_low;
+
+    // Paths change, look again every now and then
+    ev_timer_set(&dest->probe_timer, RTP_PMTU_INTERVAL, 0);
+    ev_timer_start(socket->loop, &dest->probe_timer);
+}
+
+void pmtu_recv(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc)
+{
+    if (packet->data_len < RTP_PROBE_LEN)
+    {
+        log_d("Received probe with invalid size");
+        packet_free(packet);
+        return;
+    }
+
+    // Peers only rely on the tunnel when both ends search the path
+    if (!socket->udp_sock->options.path_mtu)
+    {
+        log_d("Ignoring path MTU probe, path-mtu is disabled");
+        packet_free(packet);
+        return;
+    }
+
+    uint32_t size;
+    memcpy(&size, &packet->data[4], sizeof(size));
+    size = ntohl(size);
+
+    // Requests are padded to the size they carry, replies are cut back to the size alone
+    bool request = (packet->data[0] == RTP_PROBE_REQUEST && packet->data_len + RTP_OVERHEAD == size);
+    bool reply = (packet->data[0] == RTP_PROBE_REPLY && packet->data_len == RTP_PROBE_LEN);
+    if (!request && !reply)
+    {
+        log_d("Received malformed probe");
+        packet_free(packet);
+        return;
+    }
+
+    rtp_dest_t *dest = (socket->connected) ? rtp_dest_set(socket, ssrc, NULL, 0, RTP_PAYLOAD_TYPE)
+                                           : rtp_dest_find(socket, ssrc);
+    if (!dest)
+    {
+        packet_free(packet);
+        return;
+    }
+
+    if (request)
+    {
+        // Only the size goes back, the padding has done its job
+        packet->data_len = RTP_PROBE_LEN;
+        packet->data[0] = RTP_PROBE_REPLY;
+        rtp_emit(socket, dest, packet, packet->data, RTP_PROBE_PAYLOAD_TYPE);
+        return;
+    }
+
+    // Replies to probes given up on already don't count
+    if (dest->probe_size > 0 && size == dest->probe_size)
+    {
+        dest->probe_low = size;
+        dest->probe_confirmed = true;
+        pmtu_next(socket, dest);
+    }
+
+    packet_free(packet);
+}
+
+void pmtu_callback(EV_P_ ev_timer *timer, int revents)
+{
+    rtp_dest_t *dest = timer->data;
+    rtp_socket_t *socket = dest->socket;
+
+    if (dest->probe_size == 0)
+    {
+        pmtu_start(socket, dest);
+        return;
+    }
+
+    if (dest->probe_count < RTP_PMTU_MAX_PROBES && pmtu_probe(socket, dest, dest->probe_size) == 0)
+        return;
+
+    dest->probe_high = dest->probe_size;
+    pmtu_next(socket, dest);
+}
+
+int aggregate_add(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet)
+{
+    // Aggregates are never split up, so they stay within the fragment size. Without one they are kept
+    // small enough for any path, and for the one found if it is smaller still
+    size_t limit = fragment_limit(socket, dest);
+    if (limit == 0)
+    {
+        limit = RTP_AGGREGATE_MAX;
+        if (dest->mtu > 0 && dest->mtu < limit)
+            limit = dest->mtu;
+    }
+    limit -= RTP_OVERHEAD;
+
+    size_t len = RTP_AGGREGATE_PREFIX + packet->data_len;
+
+    // Datagrams only share a packet with ones carrying the same ECN codepoint
+    if (dest->aggregate && (dest->aggregate->data_len + len > limit || dest->aggregate->ecn != packet->ecn))
+        aggregate_flush(socket, dest);
+
+    if (!dest->aggregate)
+    {
+        dest->aggregate = packet_alloc(limit);
+        if (!dest->aggregate)
+        {
+            log_e("Failed to allocate packet");
+            packet_free(packet);
+            return -1;
+        }
+        dest->aggregate->data_len = 0;
+        dest->aggregate->ecn = packet->ecn;
+        dest->aggregate->rx_time = packet->rx_time;
+        dest->aggregate_count = 0;
+
+        ev_timer_set(&dest->aggregate_timer, socket->udp_sock->options.aggregate / 1e6, 0);
+        ev_timer_start(socket->loop, &dest->aggregate_timer);
+    }
+
+    unsigned char *slot = packet_put(dest->aggregate, len);
+    slot[0] = packet->data_len >> 8;
+    slot[1] = packet->data_len & 0xff;
+    memcpy(&slot[RTP_AGGREGATE_PREFIX], packet->data, packet->data_len);
+    dest->aggregate_count++;
+
+    packet_free(packet);
+
+    // Not even an empty datagram would fit anymore
+    if (dest->aggregate->data_len + RTP_AGGREGATE_PREFIX >= limit)
+        return aggregate_flush(socket, dest);
+
+    return 0;
+}
+
+int aggregate_flush(rtp_socket_t *socket, rtp_dest_t *dest)
+{
+    packet_t *packet = dest->aggregate;
+    dest->aggregate = NULL;
+    ev_timer_stop(socket->loop, &dest->aggregate_timer);
+
+    // A datagram nothing else came along for goes out like any other
+    if (dest->aggregate_count == 1)
+    {
+        packet->data += RTP_AGGREGATE_PREFIX;
+        packet->data_len -= RTP_AGGREGATE_PREFIX;
+
+        return rtp_seal(socket, dest, packet, packet->data, dest->pl_type);
+    }
+
+    socket->aggregated += dest->aggregate_count;
+    socket->aggregates++;
+
+    return rtp_seal(socket, dest, packet, packet->data, RTP_AGGREGATE_PAYLOAD_TYPE);
+}
+
+bool aggregate_valid(const unsigned char *data, size_t data_len)
+{
+    // Senders only pack small datagrams and leave no room behind the last one
+    size_t count = 0;
+    while (data_len > 0)
+    {
+        if (data_len < RTP_AGGREGATE_PREFIX)
+            return false;
+
+        size_t len = ((size_t)data[0] << 8) | data[1];
+        if (len > RTP_AGGREGATE_SMALL || len > data_len - RTP_AGGREGATE_PREFIX)
+            return false;
+
+        data += RTP_AGGREGATE_PREFIX + len;
+        data_len -= RTP_AGGREGATE_PREFIX + len;
+        count++;
+    }
+
+    return count > 0;
+}
+
+void aggregate_recv(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc)
+{
+    // Checked as a whole up front, a malformed aggregate delivers nothing rather than its first few datagrams
+    if (!aggregate_valid(packet->data, packet->data_len))
+    {
+        log_d("Received aggregate packet with invalid length");
+        packet_free(packet);
+        return;
+    }
+
+    const unsigned char *data = packet->data;
+    size_t remaining = packet->data_len;
+
+    // Every datagram is delivered in a packet of its own, they are small enough to be copied cheaply
+    while (remaining > 0)
+    {
+        size_t len = ((size_t)data[0] << 8) | data[1];
+        data += RTP_AGGREGATE_PREFIX;
+        remaining -= RTP_AGGREGATE_PREFIX;
+
+        packet_t *inner = packet_alloc(len);
+        if (!inner)
+        {
+            log_e("Failed to allocate packet");
+            break;
+        }
+        memcpy(inner->data, data, len);
+        memcpy(&inner->addr, &packet->addr, packet->addr_len);
+        inner->addr_len = packet->addr_len;
+        inner->rx_time = packet->rx_time;
+        inner->ecn = packet->ecn;
+
+        data += len;
+        remaining -= len;
+
+        if (socket->recv_cb)
+            (socket->recv_cb)(socket, inner, ssrc);
+        else
+            packet_free(inner);
+    }
+
+    packet_free(packet);
+}
+
+void aggregate_callback(EV_P_ ev_timer *timer, int revents)
+{
+    rtp_dest_t *dest = timer->data;
+
+    aggregate_flush(dest->socket, dest);
+}
+
+size_t fragment_limit(rtp_socket_t *socket, rtp_dest_t *dest)
+{
+    size_t limit = socket->udp_sock->options.fragment_size;
+    if (limit == 0)
+        return 0;
+
+    if (dest->mtu > 0 && dest->mtu < limit)
+        limit = dest->mtu;
+
+    return (limit < RTP_FRAGMENT_MIN_SIZE) ? RTP_FRAGMENT_MIN_SIZE : limit;
+}
+
+int fragment_send(rtp_socket_t *socket, rtp_dest_t *dest, packet_t *packet, size_t limit)
+{
+    // All fragments but the last carry the same amount, the receiver only needs their order
+    size_t chunk = limit - RTP_OVERHEAD - RTP_FRAGMENT_HEADER;
+    size_t count = (packet->data_len + chunk - 1) / chunk;
+
+    socket->fragmented++;
+
+    const unsigned char *data = packet->data;
+    size_t remaining = packet->data_len;
+    int ret = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len = (remaining < chunk) ? remaining : chunk;
+
+        packet_t *fragment = packet_alloc(RTP_FRAGMENT_HEADER + len);
+        if (!fragment)
+        {
+            log_e("Failed to allocate packet");
+            ret = -1;
+            break;
+        }
+        fragment->data[0] = i;
+        memcpy(&fragment->data[RTP_FRAGMENT_HEADER], data, len);
+        fragment->ecn = packet->ecn;
+        // Counted once towards the dwell time
+        if (i == 0)
+            fragment->rx_time = packet->rx_time;
+
+        data += len;
+        remaining -= len;
+
+        uint8_t payload_type = RTP_FRAGMENT_PAYLOAD_TYPE;
+        if (i == count - 1)
+            payload_type |= RTP_MARKER;
+
+        // The datagram is lost once one fragment is, the rest would only take up the receiver's memory
+        ret = rtp_seal(socket, dest, fragment, fragment->data, payload_type);
+        if (ret != 0)
+            break;
+
+        socket->fragments++;
     }
+
+    packet_free(packet);
+    return ret;
 }
 
-void udp_recv_callback(udp_socket_t *socket, unsigned char *data, ssize_t data_len,
-                       struct sockaddr_storage *address, socklen_t addrlen)
+void fragment_recv(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc, uint16_t seq, bool last)
 {
-    if (data_len <= sizeof(rtphdr_t) + CHACHA_MAC_LEN + CHACHA_NONCE_LEN)
+    if (packet->data_len <= RTP_FRAGMENT_HEADER)
+    {
+        log_d("Received fragment with invalid size");
+        packet_free(packet);
+        return;
+    }
+
+    unsigned int index = packet->data[0];
+
+    rtp_reassembly_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.ssrc = ssrc;
+    key.seq = seq - index;
+
+    rtp_reassembly_t *entry = NULL;
+    HASH_FIND(hh, socket->reassembly_map, &key, sizeof(key), entry);
+    if (!entry)
+    {
+        entry = calloc(1, sizeof(*entry));
+        if (!entry)
+        {
+            elog_e("calloc(rtp_reassembly_t) failed");
+            packet_free(packet);
+            return;
+        }
+        memcpy(&entry->key, &key, sizeof(key));
+        entry->created = ev_now(socket->loop);
+        entry->bytes = sizeof(*entry);
+        socket->reassembly_bytes += entry->bytes;
+
+        // Added last, so the map stays ordered by age
+        HASH_ADD(hh, socket->reassembly_map, key, sizeof(key), entry);
+        if (!ev_is_active(&socket->reassembly_timer))
+            ev_timer_start(socket->loop, &socket->reassembly_timer);
+    }
+
+    // The last fragment has to come after every other one and there is only one of it
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    if ((entry->received[index / 64] & bit) || (entry->count > 0 && (last || index >= entry->count)) ||
+        (last && entry->received_count > 0 && entry->highest > index))
+    {
+        log_d("Dropping duplicate or inconsistent fragment");
+        packet_free(packet);
+        return;
+    }
+
+    // Make room by giving up on the oldest datagrams, which is never the one the fragment belongs to
+    size_t size = sizeof(*packet) + packet->size;
+    size_t limit = (size_t)socket->udp_sock->options.reassembly_limit * 1024;
+    while (socket->reassembly_bytes + size > limit && socket->reassembly_map != entry)
+    {
+        socket->reassembly_evictions++;
+        reassembly_drop(socket, socket->reassembly_map);
+    }
+    if (socket->reassembly_bytes + size > limit)
+    {
+        log_d("Datagram too large to reassemble within the memory limit");
+        socket->reassembly_evictions++;
+        reassembly_drop(socket, entry);
+        packet_free(packet);
+        return;
+    }
+
+    // Fragments mostly arrive in order, the search starts at the front all the same
+    packet_t **slot = &entry->fragments;
+    while (*slot && (*slot)->data[0] < index)
+        slot = &(*slot)->next;
+    packet->next = *slot;
+    *slot = packet;
+
+    entry->received[index / 64] |= bit;
+    entry->received_count++;
+    if (index > entry->highest)
+        entry->highest = index;
+    entry->bytes += size;
+    if (last)
+        entry->count = index + 1;
+
+    socket->reassembly_bytes += size;
+    if (socket->reassembly_bytes > socket->reassembly_peak)
+        socket->reassembly_peak = socket->reassembly_bytes;
+
+    if (entry->count > 0 && entry->received_count == entry->count)
+        reassembly_complete(socket, entry, ssrc);
+}
+
+void reassembly_complete(rtp_socket_t *socket, rtp_reassembly_t *entry, ssrc_t ssrc)
+{
+    size_t data_len = 0;
+    for (packet_t *fragment = entry->fragments; fragment; fragment = fragment->next)
+        data_len += fragment->data_len - RTP_FRAGMENT_HEADER;
+
+    packet_t *packet = packet_alloc(data_len);
+    if (!packet)
+    {
+        log_e("Failed to allocate packet");
+        reassembly_drop(socket, entry);
+        return;
+    }
+
+    // The datagram arrived with its last fragment, from wherever that came from
+    unsigned char *data = packet->data;
+    uint64_t rx_time = 0;
+    for (packet_t *fragment = entry->fragments; fragment; fragment = fragment->next)
+    {
+        memcpy(data, &fragment->data[RTP_FRAGMENT_HEADER], fragment->data_len - RTP_FRAGMENT_HEADER);
+        data += fragment->data_len - RTP_FRAGMENT_HEADER;
+
+        if (fragment->rx_time && (!rx_time || fragment->rx_time < rx_time))
+            rx_time = fragment->rx_time;
+        // Congestion experienced by any fragment was experienced by the datagram
+        if (fragment->ecn == IPTOS_ECN_CE || packet->ecn == 0)
+            packet->ecn = fragment->ecn;
+        if (!fragment->next)
+        {
+            memcpy(&packet->addr, &fragment->addr, fragment->addr_len);
+            packet->addr_len = fragment->addr_len;
+        }
+    }
+    packet->rx_time = rx_time;
+
+    socket->reassembled++;
+    reassembly_drop(socket, entry);
+
+    if (socket->recv_cb)
+        (socket->recv_cb)(socket, packet, ssrc);
+    else
+        packet_free(packet);
+}
+
+void reassembly_drop(rtp_socket_t *socket, rtp_reassembly_t *entry)
+{
+    while (entry->fragments)
+    {
+        packet_t *fragment = entry->fragments;
+        entry->fragments = fragment->next;
+        packet_free(fragment);
+    }
+    socket->reassembly_bytes -= entry->bytes;
+
+    HASH_DEL(socket->reassembly_map, entry);
+    free(entry);
+
+    if (!socket->reassembly_map)
+        ev_timer_stop(socket->loop, &socket->reassembly_timer);
+}
+
+void reassembly_free(rtp_socket_t *socket)
+{
+    while (socket->reassembly_map)
+        reassembly_drop(socket, socket->reassembly_map);
+}
+
+void reassembly_callback(EV_P_ ev_timer *timer, int revents)
+{
+    rtp_socket_t *socket = timer->data;
+
+    // The oldest datagrams come first, the search stops at the first one still in time
+    ev_tstamp deadline = ev_now(EV_A) - RTP_REASSEMBLY_TIMEOUT;
+    while (socket->reassembly_map && socket->reassembly_map->created <= deadline)
+    {
+        socket->reassembly_timeouts++;
+        reassembly_drop(socket, socket->reassembly_map);
+    }
+}
+
+void udp_recv_callback(udp_socket_t *socket, packet_t *packet)
+{
+    if (packet->data_len <= sizeof(rtphdr_t) + RTP_TRAILER_SIZE)
     {
         log_d("Received packet with invalid size");
+        packet_free(packet);
         return;
     }
 
-    rtphdr_t *header = (rtphdr_t *)data;
+    rtphdr_t *header = (rtphdr_t *)packet->data;
     if (header->version != 2)
     {
         log_d("Received packet with invalid RTP version");
+        packet_free(packet);
         return;
     }
 
     rtp_socket_t *rtp_sock = socket->user_data;
     ssrc_t ssrc = ntohl(header->ssrc);
+    uint16_t seq = ntohs(header->seq_number);
+    uint8_t payload_type = header->payload_type;
+    bool marker = header->marker;
 
+    unsigned char *data = packet->data;
+    size_t data_len = packet->data_len;
     unsigned char *cipher = (data + sizeof(rtphdr_t));
-    size_t payload_len = data_len - (sizeof(rtphdr_t) + CHACHA_MAC_LEN + CHACHA_NONCE_LEN);
+    size_t payload_len = data_len - (sizeof(rtphdr_t) + RTP_TRAILER_SIZE);
 
-    unsigned char dec_payload[RTP_MAX_PAYLOAD_SIZE];
+    // Decrypt over the ciphertext, the payload never leaves the receive buffer
     if (chacha_decrypt(&rtp_sock->cipher, cipher, payload_len,
+                       data, sizeof(rtphdr_t),
                        &data[data_len - CHACHA_MAC_LEN],
-                       &data[data_len - (CHACHA_NONCE_LEN + CHACHA_MAC_LEN)],
-                       dec_payload) != CHACHA_RET_SUCCESS)
+                       &data[data_len - RTP_TRAILER_SIZE],
+                       cipher) != CHACHA_RET_SUCCESS)
     {
         log_e("Failed to decrypt data");
+        packet_free(packet);
         return;
     }
 
+    packet->data = cipher;
+    packet->data_len = payload_len;
+    udp_confirm_peer(socket, packet);
+
+    // Probes, aggregates and fragments share the flow's address, but not its payload type
+    bool probe = (payload_type == RTP_PROBE_PAYLOAD_TYPE);
+    bool aggregate = (payload_type == RTP_AGGREGATE_PAYLOAD_TYPE);
+    bool fragment = (payload_type == RTP_FRAGMENT_PAYLOAD_TYPE);
+    if (probe || aggregate || fragment)
+        payload_type = RTP_PAYLOAD_TYPE;
+
     // Map SSRC to socket address if listening socket
     if (!rtp_sock->connected)
     {
-        if (!rtp_dest_set(rtp_sock, ssrc, address, addrlen, header->payload_type))
+        if (!rtp_dest_set(rtp_sock, ssrc, &packet->addr, packet->addr_len, payload_type))
             log_e("Failed to map RTP socket");
     }
 
+    if (probe)
+    {
+        pmtu_recv(rtp_sock, packet, ssrc);
+        return;
+    }
+    if (aggregate)
+    {
+        aggregate_recv(rtp_sock, packet, ssrc);
+        return;
+    }
+    if (fragment)
+    {
+        fragment_recv(rtp_sock, packet, ssrc, seq, marker);
+        return;
+    }
+
     if (rtp_sock->recv_cb)
-        (rtp_sock->recv_cb)(rtp_sock, dec_payload, payload_len, ssrc);
+        (rtp_sock->recv_cb)(rtp_sock, packet, ssrc);
+    else
+        packet_free(packet);
 }
 
 void udp_send_callback(udp_socket_t *socket, ssize_t sent)
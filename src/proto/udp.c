@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 
 #include "proto/udp.h"
 
@@ -6,23 +6,173 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 
 #include "log.h"
+#include "proto/uring.h"
+#include "proto/pacer.h"
+#include "proto/xsk.h"
+#include "proto/dwell.h"
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define UDP_HAVE_MMSG
+#endif
+
+#if defined(UDP_HAVE_MMSG)
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/filter.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE 33
+#endif
+#ifndef SO_SNDBUFFORCE
+#define SO_SNDBUFFORCE 32
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+#define UDP_HAVE_GSO
+#endif
+
+#define UDP_RECV_CONTROL_LEN 128
+
+typedef struct udp_recv_batch
+{
+    unsigned int size;
+
+    // Filled from the packet pool, delivered packets are replaced on the next read
+    packet_t **packets;
+    struct iovec *iovecs;
+#ifdef UDP_HAVE_MMSG
+    struct mmsghdr *msgs;
+    unsigned char *controls;
+#endif
+} udp_recv_batch_t;
+
+// Receive slots are shared by every socket running on the same thread
+static _Thread_local udp_recv_batch_t recv_batch;
+
+// Sockets with queued datagrams, flushed right before the loop goes to sleep
+static _Thread_local udp_socket_t *flush_list;
+static _Thread_local ev_prepare flush_watcher;
+
+// Destroyed sockets whose zerocopy sends the kernel may still read from
+static _Thread_local udp_socket_t *closing_list;
+static _Thread_local struct ev_loop *closing_loop;
+static _Thread_local ev_timer closing_timer;
+
+static int recv_batch_reserve(unsigned int size);
+static packet_t *recv_batch_slot(unsigned int index, packet_class_t class, size_t recv_len);
+static void socket_recv(udp_socket_t *sock);
+static void socket_deliver_msg(udp_socket_t *sock, packet_t *packet, struct msghdr *hdr);
+static void socket_deliver(udp_socket_t *sock, packet_t *packet);
+static dwell_direction_t socket_direction(udp_socket_t *sock);
+static int socket_family(udp_socket_t *sock);
+static void options_init(udp_socket_t *sock, const udp_options_t *options);
+
+static int send_batch_queue(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address, socklen_t addr_len);
+static bool send_batch_coalesce(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address,
+                                socklen_t addr_len);
+static struct iovec *send_batch_hold(udp_send_batch_t *batch, packet_t *packet);
+static void send_batch_flush(udp_socket_t *sock);
+static void send_batch_split(udp_socket_t *sock, unsigned int index);
+static void send_batch_free(udp_socket_t *sock);
+static void flush_list_add(udp_socket_t *sock);
+static void flush_list_remove(udp_socket_t *sock);
+static void flush_callback(EV_P_ ev_prepare *prepare, int revents);
+static void closing_list_add(udp_socket_t *sock);
+static void closing_callback(EV_P_ ev_timer *timer, int revents);
+static void socket_release(udp_socket_t *sock);
+
+static bool zerocopy_eligible(udp_socket_t *sock, packet_t *packet);
+static int zerocopy_track(udp_socket_t *sock, packet_t *packet);
+static void zerocopy_reap(udp_socket_t *sock);
+static void zerocopy_complete(udp_socket_t *sock, uint32_t first, uint32_t last, bool copied);
+static void zerocopy_free(udp_socket_t *sock);
+
+static int pacing_queue_push(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address, socklen_t addr_len);
+static void pacing_queue_arm(udp_socket_t *sock);
+static void pacing_queue_free(udp_socket_t *sock);
+static void pacing_callback(EV_P_ ev_timer *timer, int revents);
+
+static int send_queue_push(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address, socklen_t addr_len);
+static void send_queue_drain(udp_socket_t *sock);
+static void send_queue_free(udp_socket_t *sock);
+
+static void socket_setup(udp_socket_t *sock);
+static int socket_set_buffer(udp_socket_t *sock, int optname, int force_optname, unsigned int size);
+static void socket_count_overflows(udp_socket_t *sock, uint32_t count);
+static void socket_start(udp_socket_t *sock);
+static void uring_recv_callback(void *ctx, unsigned char *data, ssize_t data_len, struct msghdr *msg);
+static void uring_send_callback(void *ctx, ssize_t sent);
+static void xsk_recv_callback(void *ctx, packet_t *packet);
+static void msg_push_cmsg(struct msghdr *hdr, int level, int type, const void *data, size_t len);
+static void msg_push_ecn(struct msghdr *hdr, int family, uint8_t ecn);
+static ssize_t socket_sendmsg(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address,
+                              socklen_t addr_len, int flags);
 static int socket_set_nonblock(int fd);
+static void socket_set_events(udp_socket_t *sock, int events);
 static int socket_parse_addr(const char *address, const char *port, struct sockaddr_storage *saddress, socklen_t *saddress_len);
 
 static void ev_callback(EV_P_ ev_io *io, int events);
 
-udp_socket_t *udp_connect(struct ev_loop *loop, const char *address, const char *port,
+udp_socket_t *udp_connect(struct ev_loop *loop, const char *address, const char *port, const udp_options_t *options,
                           udp_recv_callback_t recv_callback, udp_send_callback_t send_callback, void *user_data)
+{
+    struct sockaddr_storage remote_address;
+    socklen_t remote_address_len;
+    if (udp_resolve(address, port, &remote_address, &remote_address_len) != 0)
+        return NULL;
+
+    return udp_connect_addr(loop, &remote_address, remote_address_len, options,
+                            recv_callback, send_callback, user_data);
+}
+
+udp_socket_t *udp_connect_addr(struct ev_loop *loop, const struct sockaddr_storage *address, socklen_t addr_len,
+                               const udp_options_t *options, udp_recv_callback_t recv_callback,
+                               udp_send_callback_t send_callback, void *user_data)
 {
     udp_socket_t *sock = malloc(sizeof(*sock));
     if (!sock)
@@ -31,38 +181,14 @@ udp_socket_t *udp_connect(struct ev_loop *loop, const char *address, const char
         goto error;
     }
 
+    options_init(sock, options);
+
     sock->loop = loop;
     sock->recv_callback = (void *)recv_callback;
     sock->send_callback = (void *)send_callback;
     sock->user_data = user_data;
 
-    struct addrinfo hints = {
-        .ai_flags = AI_NUMERICSERV,
-        .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_DGRAM,
-    };
-    struct in6_addr addr = {};
-    if (inet_pton(AF_INET, address, &addr) == 1)
-    {
-        hints.ai_family = AF_INET;
-        hints.ai_flags |= AI_NUMERICHOST;
-    }
-    else if (inet_pton(AF_INET6, address, &addr) == 1)
-    {
-        hints.ai_family = AF_INET6;
-        hints.ai_flags |= AI_NUMERICHOST;
-    }
-    struct addrinfo *res = NULL;
-    int result = getaddrinfo(address, port, &hints, &res);
-    if (result != 0)
-    {
-        log_e("Failed to resolve %s:%s (%s)", address, port, gai_strerror(result));
-        if (result == EAI_SYSTEM)
-            elog_e("getaddrinfo() failed");
-        goto error;
-    }
-
-    sock->fd = socket(res[0].ai_family, res[0].ai_socktype, res[0].ai_protocol);
+    sock->fd = socket(address->ss_family, SOCK_DGRAM, 0);
     if (sock->fd < 0)
     {
         elog_e("socket() failed");
@@ -71,8 +197,16 @@ udp_socket_t *udp_connect(struct ev_loop *loop, const char *address, const char
 
     sock->local_address_len = 0;
 
-    sock->remote_address_len = res[0].ai_addrlen;
-    memcpy(&sock->remote_address, res[0].ai_addr, res[0].ai_addrlen);
+    sock->remote_address_len = addr_len;
+    memcpy(&sock->remote_address, address, addr_len);
+
+    // The kernel then only delivers datagrams from the peer, finds the socket by its full 4-tuple
+    // and keeps the route for datagrams sent without an address
+    if (connect(sock->fd, (struct sockaddr *)address, addr_len) != 0)
+    {
+        elog_e("connect() failed");
+        goto error;
+    }
 
     if (socket_set_nonblock(sock->fd) != 0)
     {
@@ -80,17 +214,18 @@ udp_socket_t *udp_connect(struct ev_loop *loop, const char *address, const char
         goto error;
     }
 
+    socket_setup(sock);
+
     ev_io_init(&sock->ev, ev_callback, sock->fd, EV_READ);
     sock->ev.data = sock;
-    ev_io_start(loop, &sock->ev);
+    socket_start(sock);
 
-    freeaddrinfo(res);
     return sock;
 error:
     if (sock)
     {
-        if (res)
-            freeaddrinfo(res);
+        if (sock->fd >= 0)
+            close(sock->fd);
 
         free(sock);
     }
@@ -98,7 +233,42 @@ error:
     return NULL;
 }
 
-udp_socket_t *udp_listen(struct ev_loop *loop, const char *address, const char *port,
+int udp_resolve(const char *address, const char *port, struct sockaddr_storage *saddress, socklen_t *saddress_len)
+{
+    struct addrinfo hints = {
+        .ai_flags = AI_NUMERICSERV,
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct in6_addr addr = {};
+    if (inet_pton(AF_INET, address, &addr) == 1)
+    {
+        hints.ai_family = AF_INET;
+        hints.ai_flags |= AI_NUMERICHOST;
+    }
+    else if (inet_pton(AF_INET6, address, &addr) == 1)
+    {
+        hints.ai_family = AF_INET6;
+        hints.ai_flags |= AI_NUMERICHOST;
+    }
+    struct addrinfo *res = NULL;
+    int result = getaddrinfo(address, port, &hints, &res);
+    if (result != 0)
+    {
+        log_e("Failed to resolve %s:%s (%s)", address, port, gai_strerror(result));
+        if (result == EAI_SYSTEM)
+            elog_e("getaddrinfo() failed");
+        return -1;
+    }
+
+    *saddress_len = res[0].ai_addrlen;
+    memcpy(saddress, res[0].ai_addr, res[0].ai_addrlen);
+
+    freeaddrinfo(res);
+    return 0;
+}
+
+udp_socket_t *udp_listen(struct ev_loop *loop, const char *address, const char *port, const udp_options_t *options,
                          udp_recv_callback_t recv_callback, udp_send_callback_t send_callback, void *user_data)
 {
     udp_socket_t *sock = malloc(sizeof(*sock));
@@ -108,6 +278,8 @@ udp_socket_t *udp_listen(struct ev_loop *loop, const char *address, const char *
         goto error;
     }
 
+    options_init(sock, options);
+
     sock->remote_address_len = 0;
 
     sock->local_address_len = sizeof(sock->local_address);
@@ -129,15 +301,47 @@ udp_socket_t *udp_listen(struct ev_loop *loop, const char *address, const char *
         goto error;
     }
 
+    if (sock->options.reuseport)
+    {
+#ifdef SO_REUSEPORT
+        int enable = 1;
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0)
+        {
+            elog_e("setsockopt(SO_REUSEPORT) failed");
+            goto error;
+        }
+#else
+        log_e("SO_REUSEPORT not supported");
+        goto error;
+#endif
+    }
+
     if (bind(sock->fd, (struct sockaddr *)&sock->local_address, sock->local_address_len) != 0)
     {
         elog_e("bind() failed");
         goto error;
     }
 
+    if (socket_set_nonblock(sock->fd) != 0)
+    {
+        elog_e("Failed to make socket non-blocking");
+        goto error;
+    }
+
+    socket_setup(sock);
+
     ev_io_init(&sock->ev, ev_callback, sock->fd, EV_READ);
     sock->ev.data = sock;
-    ev_io_start(loop, &sock->ev);
+    socket_start(sock);
+
+    // The kernel socket stays bound, it keeps the port reserved and receives whatever the XDP program passes
+    if (sock->options.xdp_interface)
+    {
+        sock->xsk = xsk_open(loop, sock->options.xdp_interface, sock->options.xdp_queue, &sock->local_address,
+                             sock, xsk_recv_callback);
+        if (!sock->xsk)
+            log_w("AF_XDP unavailable on %s, using the regular socket", sock->options.xdp_interface);
+    }
 
     return sock;
 error:
@@ -149,11 +353,39 @@ error:
 
 void udp_destroy(udp_socket_t *socket)
 {
+    if (socket->flush_pending)
+    {
+        send_batch_flush(socket);
+        flush_list_remove(socket);
+    }
+    send_batch_free(socket);
+    send_queue_free(socket);
+    pacing_queue_free(socket);
+
     ev_io_stop(socket->loop, &socket->ev);
+    if (socket->uring)
+        uring_close(socket->uring);
+    if (socket->xsk)
+        xsk_close(socket->xsk);
+
+    // Buffers of zerocopy sends may only be reused once the kernel is done with them, which it can only
+    // tell through the socket's error queue
+    zerocopy_reap(socket);
+    if (socket->zerocopy.count > 0)
+    {
+        closing_list_add(socket);
+        return;
+    }
 
-    close(socket->fd);
+    socket_release(socket);
+}
+
+void socket_release(udp_socket_t *sock)
+{
+    zerocopy_free(sock);
+    close(sock->fd);
 
-    free(socket);
+    free(sock);
 }
 
 int udp_send(udp_socket_t *socket, const unsigned char *data, size_t data_len)
@@ -176,117 +408,1848 @@ int udp_sendto(udp_socket_t *socket, const unsigned char *data, size_t data_len,
         return -1;
     }
 
-    ssize_t sent = sendto(socket->fd, data, data_len, 0, (struct sockaddr *)address, addr_len);
-    if (sent < 0)
+    packet_t *packet = packet_alloc(data_len);
+    if (!packet)
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        log_e("Failed to allocate packet");
+        return -1;
+    }
+    memcpy(packet->data, data, data_len);
+
+    return udp_sendto_packet(socket, packet, address, addr_len);
+}
+
+int udp_send_packet(udp_socket_t *socket, packet_t *packet)
+{
+    if (socket->remote_address_len == 0)
+    {
+        log_e("Socket not connected");
+        packet_free(packet);
+        return -1;
+    }
+
+    return udp_sendto_packet(socket, packet, &socket->remote_address, socket->remote_address_len);
+}
+
+int udp_sendto_packet(udp_socket_t *socket, packet_t *packet,
+                      struct sockaddr_storage *address, socklen_t addr_len)
+{
+    if (packet->data_len > UDP_BUFFER_SIZE)
+    {
+        log_e("Maximum UDP buffer size exceeded");
+        packet_free(packet);
+        return -1;
+    }
+
+    // Datagrams to the peer of a connected socket go out without an address, which spares the
+    // kernel the route lookup. Queued ones keep the empty address until they are sent.
+    if (addr_len > 0 && addr_len == socket->remote_address_len &&
+        memcmp(address, &socket->remote_address, addr_len) == 0)
+        addr_len = 0;
+
+    if (packet->rx_time)
+        dwell_record(socket_direction(socket), DWELL_STAGE_QUEUED, packet->rx_time, 1);
+
+    if (packet->txtime)
+    {
+        socket->stats.tx_paced++;
+
+        // Without SO_TXTIME the datagram waits here until it's due, or behind earlier ones that
+        // are overdue already
+        if (socket->options.pacing != UDP_PACING_TXTIME)
         {
-            if (socket->out_buffer.data_len > 0)
-                log_w("Send buffer overrun");
+            if (packet->txtime > pacer_now() + UDP_PACING_SLACK || socket->pacing_queue.count > 0)
+                return pacing_queue_push(socket, packet, address, addr_len);
+            packet->txtime = 0;
+        }
+    }
 
-            memcpy(&socket->out_buffer.saddr, address, addr_len);
-            socket->out_buffer.saddr_len = addr_len;
-            memcpy(socket->out_buffer.data, data, data_len);
-            socket->out_buffer.data_len = data_len;
+    // Datagrams to peers the AF_XDP socket hasn't heard from yet go out through the kernel, and so
+    // does everything while earlier datagrams still wait there
+    uint64_t rx_time = packet->rx_time;
+    if (socket->xsk && socket->send_queue.count == 0 && socket->send_batch.count == 0 &&
+        xsk_sendto(socket->xsk, packet, address, addr_len) == 0)
+    {
+        if (rx_time)
+            dwell_record(socket_direction(socket), DWELL_STAGE_SENT, rx_time, 1);
+        socket->stats.tx_packets++;
+        socket->stats.tx_xdp++;
+        return 0;
+    }
 
-            ev_io_set(&socket->ev, socket->fd, EV_READ | EV_WRITE);
+    if (socket->uring)
+    {
+        int ret = 0;
 
-            return 0;
+        // Requests the kernel hasn't completed yet stand in for the send queue
+        if (uring_in_flight(socket->uring) >= socket->options.send_queue)
+        {
+            socket->stats.tx_dropped++;
+            log_d("Send queue full, dropping datagram");
         }
         else
         {
-            elog_w("sendto() failed");
+            _Alignas(struct cmsghdr) unsigned char control[CMSG_SPACE(sizeof(int))];
+            struct msghdr hdr = {.msg_control = control, .msg_controllen = 0};
+            if (packet->ecn)
+                msg_push_ecn(&hdr, socket_family(socket), packet->ecn);
+
+            // Sent straight from the packet, which the ring releases once the kernel is done with it
+            ret = uring_send_packet(socket->uring, packet, address, addr_len, control, hdr.msg_controllen);
+            if (ret == 0 && rx_time)
+                dwell_record(socket_direction(socket), DWELL_STAGE_SENT, rx_time, 1);
+            return ret;
+        }
+
+        packet_free(packet);
+        return ret;
+    }
+
+    // Keep datagrams in order while earlier ones are still waiting
+    if (socket->send_queue.count > 0)
+        return send_queue_push(socket, packet, address, addr_len);
+
+    int flags = 0;
+    bool zerocopy = zerocopy_eligible(socket, packet);
+    if (zerocopy || packet->txtime)
+    {
+        // Large datagrams skip the batch, whose sendmmsg() the kernel copies from, and so do ones
+        // with a departure time, which GSO would merge with others, but neither may overtake it
+        if (socket->send_batch.count > 0)
+            send_batch_flush(socket);
+        if (socket->send_batch.count > 0)
+            return send_queue_push(socket, packet, address, addr_len);
+
+        if (zerocopy)
+            flags = MSG_ZEROCOPY;
+    }
+    else if (socket->options.send_batch > 0)
+    {
+        return send_batch_queue(socket, packet, address, addr_len);
+    }
+
+    ssize_t sent = socket_sendmsg(socket, packet, address, addr_len, flags);
+    if (sent < 0 && errno == ENOBUFS && flags)
+    {
+        // Out of optmem for pinned pages, send this one the regular way
+        flags = 0;
+        sent = socket_sendmsg(socket, packet, address, addr_len, 0);
+    }
+    if (sent < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return send_queue_push(socket, packet, address, addr_len);
+        }
+        else
+        {
+            // Callers tell datagrams above the path MTU apart by errno
+            int err = errno;
+            if (err == EMSGSIZE)
+                elog_d("sendto() failed");
+            else
+                elog_w("sendto() failed");
+            packet_free(packet);
+            errno = err;
             return -1;
         }
     }
 
+    socket->stats.tx_packets++;
+
+    // The kernel reads straight from the packet until it reports completion
+    if (flags & MSG_ZEROCOPY)
+        return zerocopy_track(socket, packet);
+
+    packet_free(packet);
+
     return 0;
 }
 
-int socket_set_nonblock(int fd)
+int udp_set_dont_fragment(udp_socket_t *socket)
 {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags < 0)
-        return -1;
+#if defined(IP_MTU_DISCOVER) && defined(IPV6_MTU_DISCOVER)
+    int family = socket_family(socket);
 
-    flags &= O_NONBLOCK;
-    if (fcntl(fd, F_SETFL, flags) != 0)
+    int value = IP_PMTUDISC_DO;
+    if (family == AF_INET6)
+    {
+        value = IPV6_PMTUDISC_DO;
+        if (setsockopt(socket->fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &value, sizeof(value)) != 0)
+        {
+            elog_w("setsockopt(IPV6_MTU_DISCOVER) failed");
+            return -1;
+        }
+
+        // Dual stack sockets send IPv4 datagrams as well
+        value = IP_PMTUDISC_DO;
+        if (setsockopt(socket->fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value)) != 0)
+            elog_d("setsockopt(IP_MTU_DISCOVER) failed");
+
+        return 0;
+    }
+
+    if (setsockopt(socket->fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value)) != 0)
+    {
+        elog_w("setsockopt(IP_MTU_DISCOVER) failed");
         return -1;
+    }
 
     return 0;
+#else
+    log_w("Path MTU discovery not supported");
+    return -1;
+#endif
 }
 
-int socket_parse_addr(const char *address, const char *port, struct sockaddr_storage *saddress, socklen_t *saddress_len)
+int udp_path_mtu(const struct sockaddr_storage *address, socklen_t addr_len)
 {
-    char *endptr;
-    long port_num = strtol(port, &endptr, 10);
-    if (*endptr != '\0')
-        return -1;
-    if (port_num > UINT16_MAX)
+#if defined(IP_MTU) && defined(IPV6_MTU)
+    // Only connected sockets report the path MTU, a throwaway one is cheap and never sends anything
+    int fd = socket(address->ss_family, SOCK_DGRAM, 0);
+    if (fd < 0)
         return -1;
 
-    struct sockaddr_in *sin = (struct sockaddr_in *)saddress;
-    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)saddress;
-    if (inet_pton(AF_INET, address, &sin->sin_addr) == 1)
+    int mtu = -1;
+    socklen_t mtu_len = sizeof(mtu);
+    int ret = -1;
+    if (connect(fd, (const struct sockaddr *)address, addr_len) == 0)
     {
-        sin->sin_family = AF_INET;
-        sin->sin_port = htons(port_num);
-
-        *saddress_len = sizeof(*sin);
-        return 0;
+        if (address->ss_family == AF_INET6)
+            ret = getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &mtu_len);
+        else
+            ret = getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &mtu_len);
     }
-    if (inet_pton(AF_INET6, address, &sin6->sin6_addr) == 1)
+    close(fd);
+
+    if (ret != 0)
+        return -1;
+
+    // Reported for the whole IP packet
+    mtu -= (address->ss_family == AF_INET6) ? 40 + 8 : 20 + 8;
+    return (mtu > 0) ? mtu : -1;
+#else
+    return -1;
+#endif
+}
+
+int udp_steer_reuseport(udp_socket_t *socket, size_t key_offset, unsigned int count)
+{
+#if defined(UDP_HAVE_MMSG) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    // Runs with the UDP header already pulled, datagrams too short for the key go to the first member
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, key_offset),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    // The program is shared by the whole group, attaching it to one member is enough
+    if (setsockopt(socket->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0)
     {
-        sin6->sin6_family = AF_INET6;
-        sin6->sin6_port = htons(port_num);
+        elog_w("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed");
+        return -1;
+    }
 
-        *saddress_len = sizeof(*sin6);
-        return 0;
+    return 0;
+#else
+    log_w("SO_REUSEPORT steering not supported");
+    return -1;
+#endif
+}
+
+int udp_set_incoming_cpu(udp_socket_t *socket, int cpu)
+{
+#ifdef SO_INCOMING_CPU
+    if (setsockopt(socket->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0)
+    {
+        elog_w("setsockopt(SO_INCOMING_CPU) failed");
+        return -1;
     }
 
+    return 0;
+#else
     return -1;
+#endif
 }
 
-void ev_callback(EV_P_ ev_io *io, int events)
+int udp_disable_gro(udp_socket_t *socket)
 {
-    udp_socket_t *sock = (udp_socket_t *)io->data;
+    if (!socket->options.gro)
+        return 0;
 
-    if (events & EV_WRITE)
+#ifdef UDP_HAVE_GSO
+    int enable = 0;
+    if (setsockopt(socket->fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) != 0)
     {
-        ssize_t sent = sendto(sock->fd, sock->out_buffer.data, sock->out_buffer.data_len, 0,
-                              (struct sockaddr *)&sock->out_buffer.saddr, sock->out_buffer.saddr_len);
+        elog_w("setsockopt(UDP_GRO) failed");
+        return -1;
+    }
+#endif
+    socket->options.gro = false;
 
-        sock->out_buffer.data_len = 0;
-        ev_io_set(&sock->ev, sock->fd, EV_READ);
+    return 0;
+}
 
-        if (sent < 0)
-        {
-            elog_w("sendto() failed");
-            return;
-        }
+void udp_confirm_peer(udp_socket_t *socket, const packet_t *packet)
+{
+    if (socket->xsk && packet->has_link)
+        xsk_learn(socket->xsk, packet);
+}
 
-        if (sock->send_callback)
-            sock->send_callback(sock, sent);
-    }
-    else if (events & EV_READ)
-    {
-        unsigned char buffer[UDP_BUFFER_SIZE];
+void udp_stats_add(udp_stats_t *total, const udp_stats_t *stats)
+{
+    total->rx_packets += stats->rx_packets;
+    total->rx_syscalls += stats->rx_syscalls;
+    total->tx_packets += stats->tx_packets;
+    total->tx_syscalls += stats->tx_syscalls;
+    total->tx_gso_packets += stats->tx_gso_packets;
+    total->rx_gro_packets += stats->rx_gro_packets;
+    total->rx_truncated += stats->rx_truncated;
+    total->rx_overflows += stats->rx_overflows;
+    total->tx_zerocopy += stats->tx_zerocopy;
+    total->tx_zerocopy_copied += stats->tx_zerocopy_copied;
+    total->tx_paced += stats->tx_paced;
+    total->rx_xdp += stats->rx_xdp;
+    total->tx_xdp += stats->tx_xdp;
+    total->rx_ecn_ce += stats->rx_ecn_ce;
+    if (stats->tx_pacing_queue_max > total->tx_pacing_queue_max)
+        total->tx_pacing_queue_max = stats->tx_pacing_queue_max;
+    total->tx_queued += stats->tx_queued;
+    total->tx_dropped += stats->tx_dropped;
+    if (stats->tx_queue_max > total->tx_queue_max)
+        total->tx_queue_max = stats->tx_queue_max;
+    if (stats->tx_batch_max > total->tx_batch_max)
+        total->tx_batch_max = stats->tx_batch_max;
+}
 
-        struct sockaddr_storage saddr;
-        socklen_t addr_len = sizeof(saddr);
-        ssize_t nread = recvfrom(sock->fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&saddr, &addr_len);
-        if (nread < 0)
-        {
-            elog_w("recvfrom() failed");
-            return;
-        }
-        if (sock->remote_address_len > 0 && memcmp(&sock->remote_address, &saddr, sock->remote_address_len) != 0)
-        {
-            log_d("Dropping packet received from non-connected party");
-            return;
-        }
+void udp_backend_log_stats(struct ev_loop *loop)
+{
+    uring_stats_t stats;
+    if (!uring_stats_get(loop, &stats))
+        return;
 
-        if (sock->recv_callback)
-            sock->recv_callback(sock, buffer, nread, &saddr, addr_len);
-    }
+    double ratio = (stats.submitted) ? (double)stats.enter_calls / stats.submitted : 0;
+    log_i("io_uring: %llu requests submitted in %llu io_uring_enter calls (%.3f calls/request), %llu completions",
+          stats.submitted, stats.enter_calls, ratio, stats.completions);
+}
+
+void udp_stats_log(const char *name, const udp_stats_t *stats)
+{
+    double rx_ratio = (stats->rx_packets) ? (double)stats->rx_syscalls / stats->rx_packets : 0;
+    double tx_ratio = (stats->tx_packets) ? (double)stats->tx_syscalls / stats->tx_packets : 0;
+
+    log_i("%s: received %llu packets in %llu syscalls (%.3f syscalls/packet)",
+          name, stats->rx_packets, stats->rx_syscalls, rx_ratio);
+    log_i("%s: sent %llu packets in %llu syscalls (%.3f syscalls/packet)",
+          name, stats->tx_packets, stats->tx_syscalls, tx_ratio);
+    if (stats->tx_batch_max > 0)
+        log_i("%s: average send batch %.2f packets, largest %llu messages",
+              name, (tx_ratio > 0) ? 1 / tx_ratio : 0, stats->tx_batch_max);
+    if (stats->tx_gso_packets > 0)
+        log_i("%s: %llu GSO packets sent", name, stats->tx_gso_packets);
+    if (stats->rx_gro_packets > 0)
+        log_i("%s: %llu GRO packets received", name, stats->rx_gro_packets);
+    if (stats->rx_truncated > 0)
+        log_i("%s: %llu truncated packets dropped", name, stats->rx_truncated);
+    if (stats->tx_zerocopy > 0)
+        log_i("%s: %llu packets sent with MSG_ZEROCOPY, %llu copied by the kernel anyway",
+              name, stats->tx_zerocopy, stats->tx_zerocopy_copied);
+    if (stats->rx_overflows > 0)
+        log_i("%s: %llu packets dropped by the kernel on receive buffer overflow", name, stats->rx_overflows);
+    if (stats->tx_paced > 0)
+        log_i("%s: %llu packets paced, maximum pacing queue depth %llu",
+              name, stats->tx_paced, stats->tx_pacing_queue_max);
+    if (stats->rx_xdp > 0 || stats->tx_xdp > 0)
+        log_i("%s: %llu packets received and %llu sent through AF_XDP", name, stats->rx_xdp, stats->tx_xdp);
+    if (stats->rx_ecn_ce > 0)
+        log_i("%s: %llu packets received with congestion experienced", name, stats->rx_ecn_ce);
+    if (stats->tx_queued > 0)
+        log_i("%s: %llu packets queued, %llu dropped, maximum queue depth %llu",
+              name, stats->tx_queued, stats->tx_dropped, stats->tx_queue_max);
+}
+
+void options_init(udp_socket_t *sock, const udp_options_t *options)
+{
+    static const udp_options_t defaults = UDP_OPTIONS_DEFAULT;
+    if (!options)
+        options = &defaults;
+
+    sock->options = *options;
+    if (sock->options.recv_batch == 0)
+        sock->options.recv_batch = 1;
+    else if (sock->options.recv_batch > UDP_MAX_RECV_BATCH)
+        sock->options.recv_batch = UDP_MAX_RECV_BATCH;
+    if (sock->options.recv_budget < sock->options.recv_batch)
+        sock->options.recv_budget = sock->options.recv_batch;
+    if (sock->options.recv_buffer > UDP_MAX_SOCKET_BUFFER)
+        sock->options.recv_buffer = UDP_MAX_SOCKET_BUFFER;
+    if (sock->options.send_buffer > UDP_MAX_SOCKET_BUFFER)
+        sock->options.send_buffer = UDP_MAX_SOCKET_BUFFER;
+    if (sock->options.send_queue == 0)
+        sock->options.send_queue = 1;
+    else if (sock->options.send_queue > UDP_MAX_SEND_QUEUE)
+        sock->options.send_queue = UDP_MAX_SEND_QUEUE;
+#ifdef UDP_HAVE_MMSG
+    if (sock->options.send_batch == 1)
+        sock->options.send_batch = 0;
+    else if (sock->options.send_batch > UDP_MAX_SEND_BATCH)
+        sock->options.send_batch = UDP_MAX_SEND_BATCH;
+#else
+    sock->options.send_batch = 0;
+    // Timestamps and ECN codepoints arrive as control messages, which single reads don't ask for
+    sock->options.timestamps = false;
+    sock->options.ecn = false;
+#endif
+#ifdef UDP_HAVE_GSO
+    // GSO only has something to coalesce when sends are deferred
+    if (sock->options.gso && sock->options.send_batch == 0)
+        sock->options.send_batch = UDP_DEFAULT_GSO_BATCH;
+#else
+    sock->options.gso = false;
+    sock->options.gro = false;
+    sock->options.zerocopy = 0;
+    if (sock->options.pacing == UDP_PACING_TXTIME)
+        sock->options.pacing = UDP_PACING_TIMER;
+#endif
+    // Coalesced GRO buffers don't fit into MTU sized packets
+    if (sock->options.gro)
+        sock->options.jumbo = true;
+    if (sock->options.recv_overhead > PACKET_TAILROOM)
+        sock->options.recv_overhead = PACKET_TAILROOM;
+
+    memset(&sock->stats, 0, sizeof(sock->stats));
+    memset(&sock->send_batch, 0, sizeof(sock->send_batch));
+    memset(&sock->send_queue, 0, sizeof(sock->send_queue));
+    memset(&sock->zerocopy, 0, sizeof(sock->zerocopy));
+    memset(&sock->pacing_queue, 0, sizeof(sock->pacing_queue));
+    sock->uring = NULL;
+    sock->xsk = NULL;
+    sock->rx_overflow_count = 0;
+    sock->recv_buffer_size = 0;
+    sock->autotune_drops = 0;
+    sock->autotune_start = 0;
+    sock->flush_pending = false;
+    sock->flush_next = NULL;
+}
+
+int send_batch_queue(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address, socklen_t addr_len)
+{
+#ifdef UDP_HAVE_MMSG
+    udp_send_batch_t *batch = &sock->send_batch;
+    unsigned int capacity = sock->options.send_batch;
+    size_t data_len = packet->data_len;
+
+    if (!batch->msgs)
+    {
+        // Every packet gets an iovec of its own, GSO strings several of them together into one message
+        batch->slots = sock->options.gso ? capacity * UDP_GSO_MAX_SEGMENTS : capacity;
+        if (batch->slots > UDP_SEND_BATCH_PACKETS)
+            batch->slots = UDP_SEND_BATCH_PACKETS;
+
+        batch->packets = malloc(batch->slots * sizeof(*batch->packets));
+        batch->iovecs = malloc(batch->slots * sizeof(*batch->iovecs));
+        batch->addrs = malloc(capacity * sizeof(*batch->addrs));
+        batch->msgs = malloc(capacity * sizeof(*batch->msgs));
+        batch->meta = malloc(capacity * sizeof(*batch->meta));
+        if (!batch->packets || !batch->iovecs || !batch->addrs || !batch->msgs || !batch->meta)
+        {
+            elog_e("malloc(udp_send_batch_t) failed");
+            send_batch_free(sock);
+            packet_free(packet);
+            return -1;
+        }
+    }
+
+    // Flush early once the oldest datagram has waited long enough or the batch is full
+    if (batch->count > 0 &&
+        (batch->data_len + data_len > UDP_SEND_BATCH_BYTES || batch->packet_count == batch->slots ||
+         (ev_time() - batch->first_queued) * 1e6 >= sock->options.send_delay))
+        send_batch_flush(sock);
+
+    if (batch->data_len + data_len > UDP_SEND_BATCH_BYTES || batch->packet_count == batch->slots)
+    {
+        // Still blocked on a previous flush
+        return send_queue_push(sock, packet, address, addr_len);
+    }
+
+    if (send_batch_coalesce(sock, packet, address, addr_len))
+        return 0;
+
+    if (batch->count == capacity)
+    {
+        send_batch_flush(sock);
+
+        if (batch->count == capacity)
+            return send_queue_push(sock, packet, address, addr_len);
+    }
+
+    if (batch->count == 0)
+        batch->first_queued = ev_time();
+
+    unsigned int i = batch->count++;
+    memcpy(&batch->addrs[i], address, addr_len);
+
+    memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+    batch->msgs[i].msg_hdr.msg_name = (addr_len > 0) ? &batch->addrs[i] : NULL;
+    batch->msgs[i].msg_hdr.msg_namelen = addr_len;
+    batch->msgs[i].msg_hdr.msg_iov = send_batch_hold(batch, packet);
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+
+    batch->meta[i].segment_size = data_len;
+    batch->meta[i].segments = 1;
+    batch->meta[i].len = data_len;
+    batch->meta[i].closed = false;
+    batch->meta[i].rx_time = packet->rx_time;
+    batch->meta[i].ecn = packet->ecn;
+    if (packet->ecn)
+    {
+        batch->msgs[i].msg_hdr.msg_control = batch->meta[i].control;
+        msg_push_ecn(&batch->msgs[i].msg_hdr, socket_family(sock), packet->ecn);
+    }
+
+    if (batch->count == capacity && !sock->options.gso)
+        send_batch_flush(sock);
+    else if (!sock->flush_pending)
+        flush_list_add(sock);
+
+    return 0;
+#else
+    packet_free(packet);
+    return -1;
+#endif
+}
+
+bool send_batch_coalesce(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address, socklen_t addr_len)
+{
+#ifdef UDP_HAVE_GSO
+    udp_send_batch_t *batch = &sock->send_batch;
+    if (!sock->options.gso || batch->count <= batch->head)
+        return false;
+
+    // The datagram may join the last queued message as one more segment
+    unsigned int last = batch->count - 1;
+    udp_send_msg_t *meta = &batch->meta[last];
+    size_t data_len = packet->data_len;
+
+    if (meta->closed || data_len > meta->segment_size || meta->segments >= UDP_GSO_MAX_SEGMENTS ||
+        meta->len + data_len > UDP_GSO_MAX_BYTES || packet->ecn != meta->ecn)
+        return false;
+    if (batch->msgs[last].msg_hdr.msg_namelen != addr_len || memcmp(&batch->addrs[last], address, addr_len) != 0)
+        return false;
+
+    // Iovecs are handed out in order, so the new one directly follows the message's others
+    send_batch_hold(batch, packet);
+    batch->msgs[last].msg_hdr.msg_iovlen++;
+    meta->len += data_len;
+    meta->segments++;
+    if (data_len < meta->segment_size)
+        meta->closed = true;
+
+    // Attach the segment size once there is more than one segment
+    if (meta->segments == 2)
+    {
+        struct msghdr *hdr = &batch->msgs[last].msg_hdr;
+        hdr->msg_control = meta->control;
+        msg_push_cmsg(hdr, SOL_UDP, UDP_SEGMENT, &meta->segment_size, sizeof(uint16_t));
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+struct iovec *send_batch_hold(udp_send_batch_t *batch, packet_t *packet)
+{
+    // The kernel reads the payload straight from the packet, which stays queued until the flush
+    unsigned int p = batch->packet_count++;
+    batch->packets[p] = packet;
+    batch->iovecs[p].iov_base = packet->data;
+    batch->iovecs[p].iov_len = packet->data_len;
+    batch->data_len += packet->data_len;
+
+    return &batch->iovecs[p];
+}
+
+void send_batch_flush(udp_socket_t *sock)
+{
+#ifdef UDP_HAVE_MMSG
+    udp_send_batch_t *batch = &sock->send_batch;
+
+    while (batch->head < batch->count)
+    {
+        int sent = sendmmsg(sock->fd, &batch->msgs[batch->head], batch->count - batch->head, 0);
+        sock->stats.tx_syscalls++;
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Resume once the socket becomes writable
+                socket_set_events(sock, EV_READ | EV_WRITE);
+                return;
+            }
+
+            // Reporting the error cleared it, nothing has been sent yet
+            if (errno == ECONNREFUSED)
+                continue;
+
+            // Only the first datagram failed, skip it and carry on with the rest
+            if (batch->meta[batch->head].segments > 1)
+                send_batch_split(sock, batch->head);
+            else
+                elog_w("sendmmsg() failed");
+
+            batch->head++;
+            continue;
+        }
+
+        for (int i = 0; i < sent; i++)
+        {
+            udp_send_msg_t *meta = &batch->meta[batch->head + i];
+
+            sock->stats.tx_packets += meta->segments;
+            if (meta->segments > 1)
+                sock->stats.tx_gso_packets++;
+            if (meta->rx_time)
+                dwell_record(socket_direction(sock), DWELL_STAGE_SENT, meta->rx_time, meta->segments);
+
+            if (sock->send_callback)
+            {
+                size_t remaining = batch->msgs[batch->head + i].msg_len;
+                for (; remaining > meta->segment_size; remaining -= meta->segment_size)
+                    sock->send_callback(sock, meta->segment_size);
+                sock->send_callback(sock, remaining);
+            }
+        }
+        if (sent > sock->stats.tx_batch_max)
+            sock->stats.tx_batch_max = sent;
+
+        batch->head += sent;
+    }
+
+    for (unsigned int i = 0; i < batch->packet_count; i++)
+        packet_free(batch->packets[i]);
+
+    batch->count = 0;
+    batch->head = 0;
+    batch->packet_count = 0;
+    batch->data_len = 0;
+#endif
+}
+
+void send_batch_split(udp_socket_t *sock, unsigned int index)
+{
+#ifdef UDP_HAVE_GSO
+    udp_send_batch_t *batch = &sock->send_batch;
+    udp_send_msg_t *meta = &batch->meta[index];
+
+    // EINVAL is returned for segments exceeding the path MTU, anything else means no GSO support
+    if (errno != EINVAL && sock->options.gso)
+    {
+        elog_w("UDP GSO send failed, disabling GSO");
+        sock->options.gso = false;
+    }
+    else
+    {
+        elog_d("UDP GSO send failed, sending segments one by one");
+    }
+
+    // Each segment is a packet with an iovec of its own
+    struct msghdr *hdr = &batch->msgs[index].msg_hdr;
+    for (size_t i = 0; i < hdr->msg_iovlen; i++)
+    {
+        struct msghdr msg = {
+            .msg_name = hdr->msg_name,
+            .msg_namelen = hdr->msg_namelen,
+            .msg_iov = &hdr->msg_iov[i],
+            .msg_iovlen = 1,
+        };
+        _Alignas(struct cmsghdr) unsigned char control[CMSG_SPACE(sizeof(int))];
+        if (meta->ecn)
+        {
+            msg.msg_control = control;
+            msg_push_ecn(&msg, socket_family(sock), meta->ecn);
+        }
+
+        ssize_t sent = sendmsg(sock->fd, &msg, 0);
+        sock->stats.tx_syscalls++;
+        if (sent < 0)
+            elog_w("sendto() failed");
+        else
+            sock->stats.tx_packets++;
+    }
+#endif
+}
+
+int send_queue_push(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address, socklen_t addr_len)
+{
+    udp_send_queue_t *queue = &sock->send_queue;
+    unsigned int capacity = sock->options.send_queue;
+
+    if (!queue->entries)
+    {
+        queue->entries = calloc(capacity, sizeof(*queue->entries));
+        if (!queue->entries)
+        {
+            elog_e("calloc(udp_send_queue_t) failed");
+            packet_free(packet);
+            return -1;
+        }
+    }
+
+    if (queue->count == capacity)
+    {
+        sock->stats.tx_dropped++;
+
+        if (sock->options.send_queue_drop == UDP_DROP_TAIL)
+        {
+            log_d("Send queue full, dropping datagram");
+            packet_free(packet);
+            return 0;
+        }
+
+        log_d("Send queue full, dropping oldest datagram");
+        packet_free(queue->entries[queue->head]);
+        queue->entries[queue->head] = NULL;
+        queue->head = (queue->head + 1) % capacity;
+        queue->count--;
+    }
+
+    // The queue takes over the packet, only the destination has to be kept
+    if (address != &packet->addr)
+        memcpy(&packet->addr, address, addr_len);
+    packet->addr_len = addr_len;
+
+    queue->entries[(queue->head + queue->count) % capacity] = packet;
+    queue->count++;
+
+    sock->stats.tx_queued++;
+    if (queue->count > sock->stats.tx_queue_max)
+        sock->stats.tx_queue_max = queue->count;
+
+    socket_set_events(sock, EV_READ | EV_WRITE);
+
+    return 0;
+}
+
+void send_queue_drain(udp_socket_t *sock)
+{
+    udp_send_queue_t *queue = &sock->send_queue;
+    unsigned int capacity = sock->options.send_queue;
+
+    while (queue->count > 0)
+    {
+        packet_t *entry = queue->entries[queue->head];
+
+        ssize_t sent = socket_sendmsg(sock, entry, &entry->addr, entry->addr_len, 0);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                socket_set_events(sock, EV_READ | EV_WRITE);
+                return;
+            }
+
+            elog_w("sendto() failed");
+        }
+        else
+        {
+            sock->stats.tx_packets++;
+        }
+
+        packet_free(entry);
+        queue->entries[queue->head] = NULL;
+        queue->head = (queue->head + 1) % capacity;
+        queue->count--;
+
+        if (sent >= 0 && sock->send_callback)
+            sock->send_callback(sock, sent);
+    }
+
+    queue->head = 0;
+}
+
+void send_queue_free(udp_socket_t *sock)
+{
+    udp_send_queue_t *queue = &sock->send_queue;
+    if (!queue->entries)
+        return;
+
+    for (unsigned int i = 0; i < queue->count; i++)
+        packet_free(queue->entries[(queue->head + i) % sock->options.send_queue]);
+    free(queue->entries);
+
+    memset(queue, 0, sizeof(*queue));
+}
+
+void send_batch_free(udp_socket_t *sock)
+{
+    udp_send_batch_t *batch = &sock->send_batch;
+
+    // Packets of a batch that never made it out
+    for (unsigned int i = 0; i < batch->packet_count; i++)
+        packet_free(batch->packets[i]);
+
+    free(batch->packets);
+    free(batch->addrs);
+    free(batch->iovecs);
+    free(batch->msgs);
+    free(batch->meta);
+
+    memset(batch, 0, sizeof(*batch));
+}
+
+bool zerocopy_eligible(udp_socket_t *sock, packet_t *packet)
+{
+    // io_uring sockets don't watch the error queue for completions
+    return sock->options.zerocopy > 0 && packet->data_len >= sock->options.zerocopy && !sock->uring &&
+           sock->zerocopy.count < UDP_ZEROCOPY_MAX_PENDING;
+}
+
+int zerocopy_track(udp_socket_t *sock, packet_t *packet)
+{
+    udp_zerocopy_t *zc = &sock->zerocopy;
+
+    if (!zc->pending)
+    {
+        zc->pending = calloc(UDP_ZEROCOPY_MAX_PENDING, sizeof(*zc->pending));
+        if (!zc->pending)
+        {
+            elog_e("calloc(udp_zerocopy_t) failed, disabling MSG_ZEROCOPY");
+            sock->options.zerocopy = 0;
+
+            // The send already went out, the kernel holds its own references to the pages
+            packet_free(packet);
+            return 0;
+        }
+    }
+
+    sock->stats.tx_zerocopy++;
+
+    // Notification ids count successful zerocopy sends, so the slot follows from the order
+    zc->pending[(zc->head + zc->count) % UDP_ZEROCOPY_MAX_PENDING] = packet;
+    zc->count++;
+
+    // Collect early when the ring fills up, further sends copy until slots free up
+    if (zc->count == UDP_ZEROCOPY_MAX_PENDING)
+        zerocopy_reap(sock);
+
+    return 0;
+}
+
+void zerocopy_reap(udp_socket_t *sock)
+{
+#ifdef UDP_HAVE_MMSG
+    while (sock->zerocopy.count > 0)
+    {
+        unsigned char control[UDP_RECV_CONTROL_LEN];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+
+        if (recvmsg(sock->fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                elog_w("recvmsg(MSG_ERRQUEUE) failed");
+            return;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // ee_info and ee_data hold the first and last id of a range of completed sends
+            zerocopy_complete(sock, err.ee_info, err.ee_data, err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+        }
+    }
+#endif
+}
+
+void zerocopy_complete(udp_socket_t *sock, uint32_t first, uint32_t last, bool copied)
+{
+    udp_zerocopy_t *zc = &sock->zerocopy;
+
+    for (uint32_t id = first;; id++)
+    {
+        uint32_t offset = id - zc->head_id;
+        if (offset < zc->count)
+        {
+            unsigned int index = (zc->head + offset) % UDP_ZEROCOPY_MAX_PENDING;
+            packet_free(zc->pending[index]);
+            zc->pending[index] = NULL;
+
+            if (copied)
+                sock->stats.tx_zerocopy_copied++;
+        }
+
+        if (id == last)
+            break;
+    }
+
+    // Ranges may complete out of order, only advance past released slots
+    while (zc->count > 0 && !zc->pending[zc->head])
+    {
+        zc->head = (zc->head + 1) % UDP_ZEROCOPY_MAX_PENDING;
+        zc->head_id++;
+        zc->count--;
+    }
+
+    // Paths like loopback or devices without scatter-gather always copy, zerocopy only costs extra there
+    if (!copied)
+    {
+        zc->copied = 0;
+    }
+    else if ((zc->copied += last - first + 1) >= UDP_ZEROCOPY_COPIED_LIMIT && sock->options.zerocopy > 0)
+    {
+        log_i("Kernel keeps copying zerocopy sends, falling back to regular sends");
+        sock->options.zerocopy = 0;
+    }
+}
+
+void zerocopy_free(udp_socket_t *sock)
+{
+    udp_zerocopy_t *zc = &sock->zerocopy;
+    if (!zc->pending)
+        return;
+
+    for (unsigned int i = 0; i < zc->count; i++)
+        packet_free(zc->pending[(zc->head + i) % UDP_ZEROCOPY_MAX_PENDING]);
+    free(zc->pending);
+
+    memset(zc, 0, sizeof(*zc));
+}
+
+int pacing_queue_push(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address, socklen_t addr_len)
+{
+    udp_pacing_queue_t *queue = &sock->pacing_queue;
+
+    if (!queue->heap)
+    {
+        queue->heap = calloc(UDP_MAX_PACING_QUEUE, sizeof(*queue->heap));
+        if (!queue->heap)
+        {
+            elog_e("calloc(udp_pacing_queue_t) failed");
+            packet_free(packet);
+            return -1;
+        }
+
+        ev_timer_init(&queue->timer, pacing_callback, 0, 0);
+        queue->timer.data = sock;
+    }
+
+    if (queue->count == UDP_MAX_PACING_QUEUE)
+    {
+        log_d("Pacing queue full, dropping datagram");
+        sock->stats.tx_dropped++;
+        packet_free(packet);
+        return 0;
+    }
+
+    if (address != &packet->addr)
+        memcpy(&packet->addr, address, addr_len);
+    packet->addr_len = addr_len;
+
+    // Flows are paced independently, so departure times only ascend per flow
+    unsigned int i = queue->count++;
+    while (i > 0)
+    {
+        unsigned int parent = (i - 1) / 2;
+        if (queue->heap[parent]->txtime <= packet->txtime)
+            break;
+
+        queue->heap[i] = queue->heap[parent];
+        i = parent;
+    }
+    queue->heap[i] = packet;
+
+    if (queue->count > sock->stats.tx_pacing_queue_max)
+        sock->stats.tx_pacing_queue_max = queue->count;
+
+    if (i == 0)
+        pacing_queue_arm(sock);
+
+    return 0;
+}
+
+void pacing_queue_arm(udp_socket_t *sock)
+{
+    udp_pacing_queue_t *queue = &sock->pacing_queue;
+
+    ev_timer_stop(sock->loop, &queue->timer);
+    if (queue->count == 0)
+        return;
+
+    uint64_t now = pacer_now();
+    uint64_t due = queue->heap[0]->txtime;
+
+    ev_timer_set(&queue->timer, (due > now) ? (due - now) / 1e9 : 0, 0);
+    ev_timer_start(sock->loop, &queue->timer);
+}
+
+void pacing_queue_free(udp_socket_t *sock)
+{
+    udp_pacing_queue_t *queue = &sock->pacing_queue;
+    if (!queue->heap)
+        return;
+
+    ev_timer_stop(sock->loop, &queue->timer);
+
+    for (unsigned int i = 0; i < queue->count; i++)
+        packet_free(queue->heap[i]);
+    free(queue->heap);
+
+    memset(queue, 0, sizeof(*queue));
+}
+
+void pacing_callback(EV_P_ ev_timer *timer, int revents)
+{
+    udp_socket_t *sock = timer->data;
+    udp_pacing_queue_t *queue = &sock->pacing_queue;
+
+    uint64_t deadline = pacer_now() + UDP_PACING_SLACK;
+    while (queue->count > 0 && queue->heap[0]->txtime <= deadline)
+    {
+        packet_t *packet = queue->heap[0];
+
+        // Sift the last entry down from the root
+        packet_t *last = queue->heap[--queue->count];
+        unsigned int i = 0;
+        for (;;)
+        {
+            unsigned int child = 2 * i + 1;
+            if (child >= queue->count)
+                break;
+            if (child + 1 < queue->count && queue->heap[child + 1]->txtime < queue->heap[child]->txtime)
+                child++;
+            if (last->txtime <= queue->heap[child]->txtime)
+                break;
+
+            queue->heap[i] = queue->heap[child];
+            i = child;
+        }
+        if (queue->count > 0)
+            queue->heap[i] = last;
+
+        packet->txtime = 0;
+        udp_sendto_packet(sock, packet, &packet->addr, packet->addr_len);
+    }
+
+    pacing_queue_arm(sock);
+}
+
+void flush_list_add(udp_socket_t *sock)
+{
+    if (!flush_list)
+    {
+        ev_prepare_init(&flush_watcher, flush_callback);
+        ev_prepare_start(sock->loop, &flush_watcher);
+    }
+
+    sock->flush_next = flush_list;
+    sock->flush_pending = true;
+    flush_list = sock;
+}
+
+void closing_list_add(udp_socket_t *sock)
+{
+    if (!closing_list)
+    {
+        closing_loop = sock->loop;
+        ev_timer_init(&closing_timer, closing_callback, UDP_ZEROCOPY_CLOSE_INTERVAL, UDP_ZEROCOPY_CLOSE_INTERVAL);
+        ev_timer_start(closing_loop, &closing_timer);
+    }
+
+    sock->closing_deadline = ev_now(sock->loop) + UDP_ZEROCOPY_CLOSE_TIMEOUT;
+    sock->closing_next = closing_list;
+    closing_list = sock;
+}
+
+void closing_callback(EV_P_ ev_timer *timer, int revents)
+{
+    ev_tstamp now = ev_now(EV_A);
+
+    udp_socket_t **ptr = &closing_list;
+    while (*ptr)
+    {
+        udp_socket_t *sock = *ptr;
+
+        zerocopy_reap(sock);
+        if (sock->zerocopy.count > 0 && now < sock->closing_deadline)
+        {
+            ptr = &sock->closing_next;
+            continue;
+        }
+
+        if (sock->zerocopy.count > 0)
+            log_w("%u zerocopy sends still unconfirmed %.1f seconds after closing the socket, releasing them",
+                  sock->zerocopy.count, UDP_ZEROCOPY_CLOSE_TIMEOUT);
+
+        *ptr = sock->closing_next;
+        socket_release(sock);
+    }
+
+    if (!closing_list)
+        ev_timer_stop(EV_A_ timer);
+}
+
+void flush_list_remove(udp_socket_t *sock)
+{
+    for (udp_socket_t **ptr = &flush_list; *ptr; ptr = &(*ptr)->flush_next)
+    {
+        if (*ptr == sock)
+        {
+            *ptr = sock->flush_next;
+            break;
+        }
+    }
+
+    sock->flush_pending = false;
+    sock->flush_next = NULL;
+
+    if (!flush_list)
+        ev_prepare_stop(sock->loop, &flush_watcher);
+}
+
+void flush_callback(EV_P_ ev_prepare *prepare, int revents)
+{
+    udp_socket_t *sock = flush_list;
+    flush_list = NULL;
+
+    while (sock)
+    {
+        udp_socket_t *next = sock->flush_next;
+
+        sock->flush_pending = false;
+        sock->flush_next = NULL;
+        send_batch_flush(sock);
+
+        sock = next;
+    }
+
+    ev_prepare_stop(EV_A_ prepare);
+}
+
+void socket_setup(udp_socket_t *sock)
+{
+    if (sock->options.recv_buffer > 0)
+        socket_set_buffer(sock, SO_RCVBUF, SO_RCVBUFFORCE, sock->options.recv_buffer);
+    if (sock->options.send_buffer > 0)
+        socket_set_buffer(sock, SO_SNDBUF, SO_SNDBUFFORCE, sock->options.send_buffer);
+
+    int size;
+    socklen_t size_len = sizeof(size);
+    if (getsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &size, &size_len) == 0)
+        sock->recv_buffer_size = size;
+
+#ifdef UDP_HAVE_MMSG
+    // Have every received datagram carry the number of packets the kernel dropped so far
+    int enable = 1;
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) != 0)
+        elog_d("setsockopt(SO_RXQ_OVFL) failed");
+
+    if (sock->options.zerocopy > 0)
+    {
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) != 0)
+        {
+            elog_w("MSG_ZEROCOPY not supported");
+            sock->options.zerocopy = 0;
+        }
+    }
+
+    if (sock->options.pacing == UDP_PACING_TXTIME)
+    {
+        // The fq qdisc expects departure times on the monotonic clock
+        struct sock_txtime txtime = {.clockid = CLOCK_MONOTONIC, .flags = 0};
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) != 0)
+        {
+            elog_w("SO_TXTIME not supported, pacing from userspace");
+            sock->options.pacing = UDP_PACING_TIMER;
+        }
+    }
+
+    if (sock->options.timestamps && setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) != 0)
+    {
+        elog_w("setsockopt(SO_TIMESTAMPNS) failed");
+        sock->options.timestamps = false;
+    }
+
+    if (sock->options.ecn)
+    {
+        int family = socket_family(sock);
+        int ret = (family == AF_INET6) ? setsockopt(sock->fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &enable, sizeof(enable))
+                                       : setsockopt(sock->fd, IPPROTO_IP, IP_RECVTOS, &enable, sizeof(enable));
+        if (ret != 0)
+        {
+            elog_w("Failed to enable ECN reporting");
+            sock->options.ecn = false;
+        }
+
+        // Dual stack sockets receive IPv4 datagrams as well
+        if (family == AF_INET6 && setsockopt(sock->fd, IPPROTO_IP, IP_RECVTOS, &enable, sizeof(enable)) != 0)
+            elog_d("setsockopt(IP_RECVTOS) failed");
+    }
+
+    if (sock->options.busy_poll > 0)
+    {
+        // Values above net.core.busy_read need CAP_NET_ADMIN
+        int busy_poll = sock->options.busy_poll;
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) != 0)
+            elog_w("setsockopt(SO_BUSY_POLL) failed");
+        else if (setsockopt(sock->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable)) != 0)
+            elog_d("setsockopt(SO_PREFER_BUSY_POLL) failed");
+    }
+#endif
+
+#ifdef UDP_HAVE_GSO
+    if (sock->options.gso)
+    {
+        // Kernels without UDP_SEGMENT would silently ignore the cmsg, so probe for it first
+        int segment_size = 0;
+        if (setsockopt(sock->fd, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) != 0)
+        {
+            elog_w("UDP GSO not supported");
+            sock->options.gso = false;
+        }
+    }
+
+    if (sock->options.gro)
+    {
+        int enable = 1;
+        if (setsockopt(sock->fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) != 0)
+        {
+            elog_w("UDP GRO not supported");
+            sock->options.gro = false;
+        }
+    }
+#endif
+}
+
+int socket_set_buffer(udp_socket_t *sock, int optname, int force_optname, unsigned int size)
+{
+    const char *name = (optname == SO_RCVBUF) ? "SO_RCVBUF" : "SO_SNDBUF";
+    int value = size;
+
+#ifdef UDP_HAVE_MMSG
+    // The FORCE variants ignore net.core.[rw]mem_max but need CAP_NET_ADMIN
+    if (setsockopt(sock->fd, SOL_SOCKET, force_optname, &value, sizeof(value)) != 0)
+#endif
+    {
+        if (setsockopt(sock->fd, SOL_SOCKET, optname, &value, sizeof(value)) != 0)
+        {
+            elog_w("setsockopt(%s) failed", name);
+            return -1;
+        }
+    }
+
+    // Linux doubles the requested size to account for bookkeeping overhead
+    int actual = 0;
+    socklen_t actual_len = sizeof(actual);
+    if (getsockopt(sock->fd, SOL_SOCKET, optname, &actual, &actual_len) != 0)
+        return -1;
+
+    if ((unsigned int)actual < size)
+        log_w("%s limited to %d bytes instead of %u, raise net.core.%s or grant CAP_NET_ADMIN",
+              name, actual, size, (optname == SO_RCVBUF) ? "rmem_max" : "wmem_max");
+    else
+        log_d("%s set to %d bytes", name, actual);
+
+    return actual;
+}
+
+void socket_count_overflows(udp_socket_t *sock, uint32_t count)
+{
+    // The counter is cumulative and wraps around
+    uint32_t drops = count - sock->rx_overflow_count;
+    sock->rx_overflow_count = count;
+    if (drops == 0)
+        return;
+
+    sock->stats.rx_overflows += drops;
+    if (!sock->options.buffer_autotune)
+        return;
+
+    ev_tstamp now = ev_now(sock->loop);
+    if (now - sock->autotune_start >= UDP_AUTOTUNE_INTERVAL)
+    {
+        sock->autotune_start = now;
+        sock->autotune_drops = 0;
+    }
+    sock->autotune_drops += drops;
+
+    // Only sustained drops count, a single burst shouldn't inflate the buffer
+    if (sock->autotune_drops < UDP_AUTOTUNE_DROPS || sock->recv_buffer_size >= UDP_MAX_SOCKET_BUFFER)
+        return;
+
+    // The size read back is already doubled, so asking for it doubles the buffer
+    unsigned int size = sock->recv_buffer_size;
+    if (size > UDP_MAX_SOCKET_BUFFER / 2)
+        size = UDP_MAX_SOCKET_BUFFER / 2;
+
+    int actual = socket_set_buffer(sock, SO_RCVBUF, SO_RCVBUFFORCE, size);
+    if (actual > 0 && (unsigned int)actual > sock->recv_buffer_size)
+    {
+        log_i("Receive buffer grown to %d bytes after %llu drops", actual, sock->autotune_drops);
+        sock->recv_buffer_size = actual;
+    }
+    else
+    {
+        // Capped by rmem_max, there's nothing left to grow into
+        log_w("Receive buffer can't grow past %u bytes, disabling auto-tuning", sock->recv_buffer_size);
+        sock->options.buffer_autotune = false;
+    }
+
+    sock->autotune_drops = 0;
+    sock->autotune_start = now;
+}
+
+void socket_start(udp_socket_t *sock)
+{
+    if (sock->options.backend == UDP_BACKEND_URING)
+    {
+        uring_t *ring = uring_get(sock->loop);
+        if (ring)
+            sock->uring = uring_open(ring, sock->fd, sock, uring_recv_callback, uring_send_callback);
+
+        if (sock->uring &&
+            uring_recv_start(sock->uring, sizeof(struct sockaddr_storage), UDP_RECV_CONTROL_LEN) == 0)
+            return;
+
+        // Sends may still go through the ring, receiving falls back to libev
+        sock->options.backend = UDP_BACKEND_EV;
+    }
+
+    // Ring sends carry no departure times
+    if (sock->uring && sock->options.pacing == UDP_PACING_TXTIME)
+        sock->options.pacing = UDP_PACING_TIMER;
+
+    ev_io_start(sock->loop, &sock->ev);
+}
+
+void uring_recv_callback(void *ctx, unsigned char *data, ssize_t data_len, struct msghdr *msg)
+{
+    udp_socket_t *sock = ctx;
+
+    if (data_len < 0)
+    {
+        errno = -data_len;
+        elog_w("io_uring recvmsg failed, falling back to libev");
+
+        sock->options.backend = UDP_BACKEND_EV;
+        ev_io_start(sock->loop, &sock->ev);
+        return;
+    }
+
+    // Ring buffers go back to the kernel once this returns, so the payload has to move
+    // into a packet of its own
+    packet_t *packet = packet_alloc(data_len);
+    if (!packet)
+    {
+        log_e("Failed to allocate packet");
+        return;
+    }
+    memcpy(packet->data, data, data_len);
+    memcpy(&packet->addr, msg->msg_name, msg->msg_namelen);
+    packet->addr_len = msg->msg_namelen;
+
+    socket_deliver_msg(sock, packet, msg);
+}
+
+void xsk_recv_callback(void *ctx, packet_t *packet)
+{
+    udp_socket_t *sock = ctx;
+
+    if (!sock->options.ecn)
+        packet->ecn = 0;
+
+    sock->stats.rx_packets++;
+    sock->stats.rx_xdp++;
+    socket_deliver(sock, packet);
+}
+
+void uring_send_callback(void *ctx, ssize_t sent)
+{
+    udp_socket_t *sock = ctx;
+
+    if (sent < 0)
+    {
+        errno = -sent;
+        elog_w("io_uring sendmsg failed");
+        return;
+    }
+
+    sock->stats.tx_packets++;
+    if (sock->send_callback)
+        sock->send_callback(sock, sent);
+}
+
+ssize_t socket_sendmsg(udp_socket_t *sock, packet_t *packet, struct sockaddr_storage *address,
+                       socklen_t addr_len, int flags)
+{
+    struct iovec iov = {.iov_base = packet->data, .iov_len = packet->data_len};
+    struct msghdr msg = {
+        .msg_name = (addr_len > 0) ? address : NULL,
+        .msg_namelen = addr_len,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+
+#ifdef UDP_HAVE_MMSG
+    _Alignas(struct cmsghdr) unsigned char control[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    if (packet->txtime)
+        msg_push_cmsg(&msg, SOL_SOCKET, SCM_TXTIME, &packet->txtime, sizeof(uint64_t));
+    if (packet->ecn)
+        msg_push_ecn(&msg, socket_family(sock), packet->ecn);
+    if (msg.msg_controllen == 0)
+        msg.msg_control = NULL;
+#endif
+
+    sock->stats.tx_syscalls++;
+    ssize_t sent = sendmsg(sock->fd, &msg, flags);
+    if (sent < 0 && errno == ECONNREFUSED)
+    {
+        // A connected socket reports an earlier ICMP port unreachable on the next call, which then
+        // sends nothing
+        sock->stats.tx_syscalls++;
+        sent = sendmsg(sock->fd, &msg, flags);
+    }
+    if (sent >= 0 && packet->rx_time)
+        dwell_record(socket_direction(sock), DWELL_STAGE_SENT, packet->rx_time, 1);
+
+    return sent;
+}
+
+void msg_push_cmsg(struct msghdr *hdr, int level, int type, const void *data, size_t len)
+{
+    // Appended behind the control messages already in the buffer, which has to have room for it
+    struct cmsghdr *cmsg = (struct cmsghdr *)((unsigned char *)hdr->msg_control + hdr->msg_controllen);
+    memset(cmsg, 0, CMSG_SPACE(len));
+    cmsg->cmsg_level = level;
+    cmsg->cmsg_type = type;
+    cmsg->cmsg_len = CMSG_LEN(len);
+    memcpy(CMSG_DATA(cmsg), data, len);
+
+    hdr->msg_controllen += CMSG_SPACE(len);
+}
+
+void msg_push_ecn(struct msghdr *hdr, int family, uint8_t ecn)
+{
+    // Sets the whole traffic class, the DSCP bits stay zero as on every other datagram
+    int tos = ecn;
+    if (family == AF_INET6)
+        msg_push_cmsg(hdr, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+    else
+        msg_push_cmsg(hdr, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+}
+
+int socket_set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+
+    flags |= O_NONBLOCK;
+    if (fcntl(fd, F_SETFL, flags) != 0)
+        return -1;
+
+    return 0;
+}
+
+void socket_set_events(udp_socket_t *sock, int events)
+{
+    if ((sock->ev.events & (EV_READ | EV_WRITE)) == events)
+        return;
+
+    // Active watchers have to be restarted for libev to pick up the new event mask
+    ev_io_stop(sock->loop, &sock->ev);
+    ev_io_set(&sock->ev, sock->fd, events);
+    ev_io_start(sock->loop, &sock->ev);
+}
+
+int socket_parse_addr(const char *address, const char *port, struct sockaddr_storage *saddress, socklen_t *saddress_len)
+{
+    char *endptr;
+    long port_num = strtol(port, &endptr, 10);
+    if (*endptr != '\0')
+        return -1;
+    if (port_num > UINT16_MAX)
+        return -1;
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)saddress;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)saddress;
+    if (inet_pton(AF_INET, address, &sin->sin_addr) == 1)
+    {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port_num);
+
+        *saddress_len = sizeof(*sin);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, address, &sin6->sin6_addr) == 1)
+    {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port_num);
+
+        *saddress_len = sizeof(*sin6);
+        return 0;
+    }
+
+    return -1;
+}
+
+void ev_callback(EV_P_ ev_io *io, int events)
+{
+    udp_socket_t *sock = (udp_socket_t *)io->data;
+
+    if (events & EV_WRITE)
+    {
+        socket_set_events(sock, EV_READ);
+
+        // Batched datagrams are older than anything in the send queue
+        if (sock->send_batch.count > 0)
+            send_batch_flush(sock);
+        if (sock->send_batch.count == 0)
+            send_queue_drain(sock);
+    }
+
+    if (events & EV_READ)
+    {
+        // Completion notifications keep the socket readable until they're collected
+        if (sock->zerocopy.count > 0)
+            zerocopy_reap(sock);
+
+        socket_recv(sock);
+    }
+}
+
+int recv_batch_reserve(unsigned int size)
+{
+    if (recv_batch.size >= size)
+        return 0;
+
+    packet_t **packets = realloc(recv_batch.packets, size * sizeof(*packets));
+    if (!packets)
+        return -1;
+    recv_batch.packets = packets;
+
+    struct iovec *iovecs = realloc(recv_batch.iovecs, size * sizeof(*iovecs));
+    if (!iovecs)
+        return -1;
+    recv_batch.iovecs = iovecs;
+
+#ifdef UDP_HAVE_MMSG
+    struct mmsghdr *msgs = realloc(recv_batch.msgs, size * sizeof(*msgs));
+    if (!msgs)
+        return -1;
+    recv_batch.msgs = msgs;
+
+    unsigned char *controls = realloc(recv_batch.controls, (size_t)size * UDP_RECV_CONTROL_LEN);
+    if (!controls)
+        return -1;
+    recv_batch.controls = controls;
+#endif
+
+    if (recv_batch.size == 0)
+        packet_pool_reserve(PACKET_POOL_RESERVE);
+
+    for (unsigned int i = recv_batch.size; i < size; i++)
+    {
+        recv_batch.packets[i] = NULL;
+
+#ifdef UDP_HAVE_MMSG
+        memset(&recv_batch.msgs[i], 0, sizeof(recv_batch.msgs[i]));
+        recv_batch.msgs[i].msg_hdr.msg_iov = &recv_batch.iovecs[i];
+        recv_batch.msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+    }
+    recv_batch.size = size;
+
+    return 0;
+}
+
+packet_t *recv_batch_slot(unsigned int index, packet_class_t class, size_t recv_len)
+{
+    packet_t *packet = recv_batch.packets[index];
+    if (packet && packet->class != class)
+    {
+        packet_free(packet);
+        packet = NULL;
+    }
+
+    if (!packet)
+    {
+        packet = packet_alloc_class(class);
+        if (!packet)
+            return NULL;
+        recv_batch.packets[index] = packet;
+    }
+
+    // Receive right behind the headroom so upper layers can prepend headers in place
+    packet->data = &packet->buf[PACKET_HEADROOM];
+    recv_batch.iovecs[index].iov_base = packet->data;
+    recv_batch.iovecs[index].iov_len = recv_len;
+
+    return packet;
+}
+
+void udp_thread_cleanup(struct ev_loop *loop)
+{
+    // Sockets are all closed, the ring they shared goes too while the loop still exists
+    uring_loop_cleanup(loop);
+
+    // The loop has stopped, so sockets still waiting for completions won't get any further
+    if (closing_list)
+        ev_timer_stop(closing_loop, &closing_timer);
+    while (closing_list)
+    {
+        udp_socket_t *next = closing_list->closing_next;
+        zerocopy_reap(closing_list);
+        socket_release(closing_list);
+        closing_list = next;
+    }
+
+    for (unsigned int i = 0; i < recv_batch.size; i++)
+    {
+        if (recv_batch.packets[i])
+            packet_free(recv_batch.packets[i]);
+    }
+    free(recv_batch.packets);
+    free(recv_batch.iovecs);
+#ifdef UDP_HAVE_MMSG
+    free(recv_batch.msgs);
+    free(recv_batch.controls);
+#endif
+
+    memset(&recv_batch, 0, sizeof(recv_batch));
+}
+
+void socket_recv(udp_socket_t *sock)
+{
+    unsigned int batch = sock->options.recv_batch;
+    if (recv_batch_reserve(batch) != 0)
+    {
+        log_w("Failed to allocate receive batch of %u, falling back to single reads", batch);
+        batch = 1;
+        if (recv_batch_reserve(batch) != 0)
+        {
+            elog_e("malloc(udp_recv_batch_t) failed");
+            return;
+        }
+    }
+
+    packet_class_t class = (sock->options.jumbo) ? PACKET_CLASS_JUMBO : PACKET_CLASS_MTU;
+    size_t recv_len = packet_capacity(class) + sock->options.recv_overhead;
+
+    // Drain the socket until it would block or the budget runs out so one busy
+    // socket can't starve the rest of the loop
+    unsigned int budget = sock->options.recv_budget;
+    while (budget > 0)
+    {
+        unsigned int vlen = (budget < batch) ? budget : batch;
+
+#ifdef UDP_HAVE_MMSG
+        for (unsigned int i = 0; i < vlen; i++)
+        {
+            packet_t *packet = recv_batch_slot(i, class, recv_len);
+            if (!packet)
+            {
+                vlen = i;
+                break;
+            }
+
+            recv_batch.msgs[i].msg_hdr.msg_name = &packet->addr;
+            recv_batch.msgs[i].msg_hdr.msg_namelen = sizeof(packet->addr);
+            recv_batch.msgs[i].msg_hdr.msg_control = &recv_batch.controls[(size_t)i * UDP_RECV_CONTROL_LEN];
+            recv_batch.msgs[i].msg_hdr.msg_controllen = UDP_RECV_CONTROL_LEN;
+        }
+        if (vlen == 0)
+        {
+            log_e("Failed to allocate receive packets");
+            return;
+        }
+
+        int count = recvmmsg(sock->fd, recv_batch.msgs, vlen, 0, NULL);
+        sock->stats.rx_syscalls++;
+        if (count < 0)
+        {
+            // ICMP port unreachable for an earlier datagram of a connected socket, datagrams behind it
+            // are still waiting
+            if (errno == ECONNREFUSED)
+            {
+                budget--;
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                elog_w("recvmmsg() failed");
+            return;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            struct msghdr *hdr = &recv_batch.msgs[i].msg_hdr;
+            if (hdr->msg_flags & MSG_TRUNC)
+            {
+                // The slot keeps its packet for the next read
+                if (sock->stats.rx_truncated++ == 0)
+                    log_w("Dropping truncated packets, enable jumbo buffers for datagrams this large");
+                else
+                    log_d("Dropping truncated packet");
+                continue;
+            }
+
+            packet_t *packet = recv_batch.packets[i];
+            recv_batch.packets[i] = NULL;
+
+            packet->data_len = recv_batch.msgs[i].msg_len;
+            packet->addr_len = hdr->msg_namelen;
+            socket_deliver_msg(sock, packet, hdr);
+        }
+#else
+        unsigned int count = 0;
+        while (count < vlen)
+        {
+            packet_t *packet = recv_batch_slot(count, class, recv_len);
+            if (!packet)
+            {
+                log_e("Failed to allocate receive packets");
+                return;
+            }
+
+            packet->addr_len = sizeof(packet->addr);
+            ssize_t nread = recvfrom(sock->fd, packet->data, recv_len, 0,
+                                     (struct sockaddr *)&packet->addr, &packet->addr_len);
+            sock->stats.rx_syscalls++;
+            if (nread < 0)
+            {
+                if (errno == ECONNREFUSED)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    elog_w("recvfrom() failed");
+                return;
+            }
+            sock->stats.rx_packets++;
+
+            recv_batch.packets[count] = NULL;
+            packet->data_len = nread;
+            socket_deliver(sock, packet);
+            count++;
+        }
+#endif
+
+        // A short batch means the receive queue has been drained
+        if ((unsigned int)count < vlen)
+            return;
+
+        budget -= count;
+    }
+
+#ifdef EV_EDGE_TRIGGERED
+    // Datagrams left behind won't trigger another wakeup, come back for them next iteration
+    ev_feed_event(sock->loop, &sock->ev, EV_READ);
+#endif
+}
+
+void socket_deliver_msg(udp_socket_t *sock, packet_t *packet, struct msghdr *hdr)
+{
+    size_t segment_size = packet->data_len;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
+    {
+#ifdef UDP_HAVE_GSO
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            if (gso_size > 0)
+                segment_size = gso_size;
+        }
+#endif
+#ifdef UDP_HAVE_MMSG
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            uint32_t count;
+            memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+            socket_count_overflows(sock, count);
+        }
+#endif
+#ifdef SO_TIMESTAMPNS
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            packet->rx_time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+#endif
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS)
+            packet->ecn = *CMSG_DATA(cmsg) & IPTOS_ECN_MASK;
+        if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_TCLASS)
+        {
+            int tclass;
+            memcpy(&tclass, CMSG_DATA(cmsg), sizeof(tclass));
+            packet->ecn = tclass & IPTOS_ECN_MASK;
+        }
+    }
+
+    if (segment_size < packet->data_len)
+        sock->stats.rx_gro_packets++;
+
+    // Coalesced GRO buffers hold equally sized datagrams, only the last one may be shorter.
+    // Each leading segment gets a packet of its own, the last one keeps the original buffer.
+    while (packet->data_len > segment_size)
+    {
+        packet_t *segment = packet_alloc(segment_size);
+        if (segment)
+        {
+            memcpy(segment->data, packet->data, segment_size);
+            memcpy(&segment->addr, &packet->addr, packet->addr_len);
+            segment->addr_len = packet->addr_len;
+            segment->rx_time = packet->rx_time;
+            segment->ecn = packet->ecn;
+
+            sock->stats.rx_packets++;
+            socket_deliver(sock, segment);
+        }
+        else
+        {
+            log_e("Failed to allocate packet");
+        }
+
+        packet->data += segment_size;
+        packet->data_len -= segment_size;
+    }
+
+    sock->stats.rx_packets++;
+    socket_deliver(sock, packet);
+}
+
+void socket_deliver(udp_socket_t *sock, packet_t *packet)
+{
+    if (packet->ecn == IPTOS_ECN_CE)
+        sock->stats.rx_ecn_ce++;
+
+    if (sock->recv_callback)
+        sock->recv_callback(sock, packet);
+    else
+        packet_free(packet);
+}
+
+dwell_direction_t socket_direction(udp_socket_t *sock)
+{
+    return (sock->remote_address_len == 0) ? DWELL_TO_LISTEN : DWELL_TO_CONNECT;
+}
+
+int socket_family(udp_socket_t *sock)
+{
+    return (sock->local_address_len > 0) ? sock->local_address.ss_family : sock->remote_address.ss_family;
 }
\ No newline at end of file
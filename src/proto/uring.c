@@ -0,0 +1,738 @@
+#define _GNU_SOURCE
+
+#include "proto/uring.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+
+#include "log.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define URING_SUPPORTED
+#endif
+#endif
+
+#ifdef URING_SUPPORTED
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_BUFFER_GROUP 0
+#define URING_CONTROL_LEN 128
+// Milliseconds a thread's ring waits for its outstanding requests before it goes away
+#define URING_CLOSE_WAIT 100
+
+typedef enum uring_op
+{
+    URING_OP_RECV,
+    URING_OP_SEND,
+} uring_op_t;
+
+struct uring
+{
+    struct uring *next;
+
+    int fd;
+
+    struct ev_loop *loop;
+    ev_io io;
+    ev_prepare prepare;
+
+    void *ring_ptr;
+    size_t ring_size;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned char *buffers;
+    size_t buffer_size;
+
+    // Requests whose final completion hasn't been reaped yet
+    unsigned int outstanding;
+
+    uring_stats_t stats;
+};
+
+struct uring_handle
+{
+    // Must stay first, completions are dispatched on it
+    uring_op_t op;
+
+    uring_t *ring;
+    int fd;
+
+    void *ctx;
+    uring_recv_callback_t recv_callback;
+    uring_send_callback_t send_callback;
+
+    struct msghdr msg;
+    bool receiving;
+
+    unsigned int refs;
+    unsigned int in_flight;
+};
+
+typedef struct uring_send
+{
+    // Must stay first, completions are dispatched on it
+    uring_op_t op;
+
+    uring_handle_t *handle;
+
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    unsigned char control[URING_SEND_CONTROL_LEN];
+
+    packet_t *packet;
+} uring_send_t;
+
+// One ring per event loop, shared by every socket of the loop. Worker loops are set up on the main
+// thread, so rings are found by their loop rather than by the calling thread
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static uring_t *rings;
+static bool rings_failed;
+
+static uring_t *ring_find(struct ev_loop *loop);
+static uring_t *ring_new(struct ev_loop *loop);
+static void ring_free(uring_t *ring);
+static int ring_setup_buffers(uring_t *ring);
+static void ring_recycle_buffer(uring_t *ring, unsigned short bid);
+
+static struct io_uring_sqe *ring_get_sqe(uring_t *ring);
+static void ring_submit(uring_t *ring);
+static void ring_reap(uring_t *ring);
+
+static void handle_put(uring_handle_t *handle);
+static void complete_recv(uring_handle_t *handle, struct io_uring_cqe *cqe);
+static void complete_send(uring_send_t *send, struct io_uring_cqe *cqe);
+
+static void io_callback(EV_P_ ev_io *io, int revents);
+static void prepare_callback(EV_P_ ev_prepare *prepare, int revents);
+
+uring_t *uring_get(struct ev_loop *loop)
+{
+    pthread_mutex_lock(&rings_lock);
+
+    uring_t *ring = ring_find(loop);
+    if (!ring && !rings_failed)
+    {
+        ring = ring_new(loop);
+        if (ring)
+        {
+            ring->next = rings;
+            rings = ring;
+        }
+        else
+        {
+            log_w("io_uring unavailable, falling back to libev");
+            rings_failed = true;
+        }
+    }
+
+    pthread_mutex_unlock(&rings_lock);
+
+    return ring;
+}
+
+uring_handle_t *uring_open(uring_t *ring, int fd, void *ctx,
+                           uring_recv_callback_t recv_callback, uring_send_callback_t send_callback)
+{
+    uring_handle_t *handle = calloc(1, sizeof(*handle));
+    if (!handle)
+    {
+        elog_e("calloc(uring_handle_t) failed");
+        return NULL;
+    }
+
+    handle->op = URING_OP_RECV;
+    handle->ring = ring;
+    handle->fd = fd;
+    handle->ctx = ctx;
+    handle->recv_callback = recv_callback;
+    handle->send_callback = send_callback;
+    handle->refs = 1;
+
+    return handle;
+}
+
+void uring_close(uring_handle_t *handle)
+{
+    uring_t *ring = handle->ring;
+
+    handle->ctx = NULL;
+
+    if (handle->receiving)
+    {
+        struct io_uring_sqe *sqe = ring_get_sqe(ring);
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uintptr_t)handle;
+            sqe->user_data = 0;
+        }
+
+        // The socket is closed right after, make sure the cancellation goes out first
+        ring_submit(ring);
+    }
+
+    handle_put(handle);
+}
+
+int uring_recv_start(uring_handle_t *handle, socklen_t name_len, size_t control_len)
+{
+    if (name_len > sizeof(struct sockaddr_storage) || control_len > URING_CONTROL_LEN)
+        return -1;
+
+    handle->msg.msg_namelen = name_len;
+    handle->msg.msg_controllen = control_len;
+
+    struct io_uring_sqe *sqe = ring_get_sqe(handle->ring);
+    if (!sqe)
+    {
+        ring_submit(handle->ring);
+        if (!(sqe = ring_get_sqe(handle->ring)))
+            return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = handle->fd;
+    sqe->addr = (uintptr_t)&handle->msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t)handle;
+
+    handle->receiving = true;
+    handle->refs++;
+    handle->ring->outstanding++;
+
+    return 0;
+}
+
+int uring_send_packet(uring_handle_t *handle, packet_t *packet,
+                      const struct sockaddr_storage *address, socklen_t addr_len,
+                      const void *control, size_t control_len)
+{
+    if (control_len > URING_SEND_CONTROL_LEN)
+    {
+        packet_free(packet);
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = ring_get_sqe(handle->ring);
+    if (!sqe)
+    {
+        ring_submit(handle->ring);
+        if (!(sqe = ring_get_sqe(handle->ring)))
+        {
+            packet_free(packet);
+            return -1;
+        }
+    }
+
+    uring_send_t *send = malloc(sizeof(*send));
+    if (!send)
+    {
+        elog_e("malloc(uring_send_t) failed");
+        packet_free(packet);
+
+        // Slot is already taken, turn it into a no-op
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = 0;
+        return -1;
+    }
+
+    // The packet has to stay valid until the kernel completes the request
+    send->op = URING_OP_SEND;
+    send->handle = handle;
+    send->packet = packet;
+    memcpy(&send->addr, address, addr_len);
+
+    send->iov.iov_base = packet->data;
+    send->iov.iov_len = packet->data_len;
+
+    memset(&send->msg, 0, sizeof(send->msg));
+    // Connected sockets send without an address
+    send->msg.msg_name = (addr_len > 0) ? &send->addr : NULL;
+    send->msg.msg_namelen = addr_len;
+    send->msg.msg_iov = &send->iov;
+    send->msg.msg_iovlen = 1;
+    if (control_len > 0)
+    {
+        memcpy(send->control, control, control_len);
+        send->msg.msg_control = send->control;
+        send->msg.msg_controllen = control_len;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = handle->fd;
+    sqe->addr = (uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)send;
+
+    handle->refs++;
+    handle->in_flight++;
+    handle->ring->outstanding++;
+
+    return 0;
+}
+
+unsigned int uring_in_flight(uring_handle_t *handle)
+{
+    return handle->in_flight;
+}
+
+bool uring_stats_get(struct ev_loop *loop, uring_stats_t *stats)
+{
+    pthread_mutex_lock(&rings_lock);
+    uring_t *ring = ring_find(loop);
+    if (ring)
+        *stats = ring->stats;
+    pthread_mutex_unlock(&rings_lock);
+
+    return ring != NULL;
+}
+
+void uring_loop_cleanup(struct ev_loop *loop)
+{
+    pthread_mutex_lock(&rings_lock);
+    uring_t *ring = NULL;
+    for (uring_t **ptr = &rings; *ptr; ptr = &(*ptr)->next)
+    {
+        if ((*ptr)->loop == loop)
+        {
+            ring = *ptr;
+            *ptr = ring->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (!ring)
+        return;
+
+    // Cancelled receives and sends still hold their handles and packets until they complete
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = 1000000};
+    for (unsigned int i = 0; i < URING_CLOSE_WAIT && ring->outstanding > 0; i++)
+    {
+        ring_submit(ring);
+        ring_reap(ring);
+        if (ring->outstanding > 0)
+            nanosleep(&wait, NULL);
+    }
+    if (ring->outstanding > 0)
+        log_w("io_uring still has %u requests outstanding, leaving them behind", ring->outstanding);
+
+    ev_io_stop(ring->loop, &ring->io);
+    ev_prepare_stop(ring->loop, &ring->prepare);
+    ring_free(ring);
+}
+
+uring_t *ring_find(struct ev_loop *loop)
+{
+    for (uring_t *ring = rings; ring; ring = ring->next)
+    {
+        if (ring->loop == loop)
+            return ring;
+    }
+
+    return NULL;
+}
+
+uring_t *ring_new(struct ev_loop *loop)
+{
+    uring_t *ring = calloc(1, sizeof(*ring));
+    if (!ring)
+    {
+        elog_e("calloc(uring_t) failed");
+        return NULL;
+    }
+    ring->fd = -1;
+    ring->loop = loop;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL)
+    {
+        // Kernels older than 5.18 don't know IORING_SETUP_SUBMIT_ALL
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0)
+    {
+        elog_w("io_uring_setup() failed");
+        goto error;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    {
+        log_w("io_uring is too old");
+        goto error;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED)
+    {
+        ring->ring_ptr = NULL;
+        elog_w("mmap(IORING_OFF_SQ_RING) failed");
+        goto error;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        elog_w("mmap(IORING_OFF_SQES) failed");
+        goto error;
+    }
+
+    unsigned char *ptr = ring->ring_ptr;
+    ring->sq_head = (unsigned int *)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(ptr + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned int *)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+
+    if (ring_setup_buffers(ring) != 0)
+        goto error;
+
+    // The ring's fd polls readable whenever completions are waiting
+    ev_io_init(&ring->io, io_callback, ring->fd, EV_READ);
+    ring->io.data = ring;
+    ev_io_start(loop, &ring->io);
+
+    ev_prepare_init(&ring->prepare, prepare_callback);
+    ring->prepare.data = ring;
+    ev_prepare_start(loop, &ring->prepare);
+
+    log_d("Using io_uring backend");
+
+    return ring;
+error:
+    ring_free(ring);
+
+    return NULL;
+}
+
+void ring_free(uring_t *ring)
+{
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->buffers);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_ptr)
+        munmap(ring->ring_ptr, ring->ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    free(ring);
+}
+
+int ring_setup_buffers(uring_t *ring)
+{
+    // Each buffer holds the recvmsg header, source address, control data and a full datagram
+    ring->buffer_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) +
+                        URING_CONTROL_LEN + UINT16_MAX + 1;
+
+    ring->buffers = malloc(URING_RECV_BUFFERS * ring->buffer_size);
+    if (!ring->buffers)
+    {
+        elog_e("malloc(uring buffers) failed");
+        return -1;
+    }
+
+    ring->buf_ring_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        elog_e("mmap(io_uring_buf_ring) failed");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    // Provided buffer rings need Linux 5.19
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        elog_w("io_uring provided buffer rings not supported");
+        return -1;
+    }
+
+    ring->buf_ring->tail = 0;
+    for (unsigned short bid = 0; bid < URING_RECV_BUFFERS; bid++)
+        ring_recycle_buffer(ring, bid);
+
+    return 0;
+}
+
+void ring_recycle_buffer(uring_t *ring, unsigned short bid)
+{
+    struct io_uring_buf_ring *br = ring->buf_ring;
+    unsigned short tail = br->tail;
+
+    struct io_uring_buf *buf = &br->bufs[tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uintptr_t)&ring->buffers[bid * ring->buffer_size];
+    buf->len = ring->buffer_size;
+    buf->bid = bid;
+
+    __atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *ring_get_sqe(uring_t *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+        return NULL;
+
+    unsigned int index = ring->sq_local_tail & *ring->sq_mask;
+    ring->sq_local_tail++;
+
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+
+    return sqe;
+}
+
+void ring_submit(uring_t *ring)
+{
+    unsigned int pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (pending == 0)
+        return;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    // A single enter submits every queued request, no matter which socket it belongs to
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, pending, 0, 0, NULL, 0);
+    ring->stats.enter_calls++;
+    if (submitted < 0)
+    {
+        // Left in the submission queue, picked up by the next enter
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+            elog_w("io_uring_enter() failed");
+        return;
+    }
+
+    ring->stats.submitted += submitted;
+}
+
+void ring_reap(uring_t *ring)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        void *user_data = (void *)(uintptr_t)cqe->user_data;
+
+        if (user_data)
+        {
+            uring_op_t op = *(uring_op_t *)user_data;
+            if (op == URING_OP_RECV)
+                complete_recv(user_data, cqe);
+            else
+                complete_send(user_data, cqe);
+        }
+
+        ring->stats.completions++;
+        head++;
+
+        // Completion handlers may queue more work, pick up anything posted meanwhile
+        if (head == tail)
+            tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void handle_put(uring_handle_t *handle)
+{
+    if (--handle->refs == 0)
+        free(handle);
+}
+
+void complete_recv(uring_handle_t *handle, struct io_uring_cqe *cqe)
+{
+    uring_t *ring = handle->ring;
+
+    if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        unsigned char *buffer = &ring->buffers[bid * ring->buffer_size];
+
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+        unsigned char *name = buffer + sizeof(*out);
+        unsigned char *control = name + handle->msg.msg_namelen;
+        unsigned char *payload = control + handle->msg.msg_controllen;
+
+        size_t payload_len = out->payloadlen;
+        if (payload + payload_len > buffer + cqe->res)
+            payload_len = (buffer + cqe->res) - payload;
+
+        if (handle->ctx && handle->recv_callback)
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = name;
+            msg.msg_namelen = out->namelen;
+            msg.msg_control = control;
+            msg.msg_controllen = out->controllen;
+            msg.msg_flags = out->flags;
+
+            handle->recv_callback(handle->ctx, payload, payload_len, &msg);
+        }
+
+        ring_recycle_buffer(ring, bid);
+    }
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    // The multishot request terminated
+    handle->receiving = false;
+    ring->outstanding--;
+
+    int err = (cqe->res < 0) ? -cqe->res : 0;
+    if (handle->ctx && err != ECANCELED)
+    {
+        if (err == 0 || err == ENOBUFS || err == ECONNREFUSED)
+        {
+            // Out of buffers, an ICMP error for a connected socket or the kernel decided to stop,
+            // arm it again
+            uring_recv_start(handle, handle->msg.msg_namelen, handle->msg.msg_controllen);
+        }
+        else if (handle->recv_callback)
+        {
+            handle->recv_callback(handle->ctx, NULL, -err, NULL);
+        }
+    }
+
+    handle_put(handle);
+}
+
+void complete_send(uring_send_t *send, struct io_uring_cqe *cqe)
+{
+    uring_handle_t *handle = send->handle;
+
+    handle->in_flight--;
+    handle->ring->outstanding--;
+    if (handle->ctx && handle->send_callback)
+        handle->send_callback(handle->ctx, cqe->res);
+
+    packet_free(send->packet);
+    free(send);
+    handle_put(handle);
+}
+
+void io_callback(EV_P_ ev_io *io, int revents)
+{
+    ring_reap(io->data);
+}
+
+void prepare_callback(EV_P_ ev_prepare *prepare, int revents)
+{
+    uring_t *ring = prepare->data;
+
+    ring_submit(ring);
+
+    // Submission may have completed requests inline
+    ring_reap(ring);
+    ring_submit(ring);
+}
+
+#else
+
+uring_t *uring_get(struct ev_loop *loop)
+{
+    return NULL;
+}
+
+uring_handle_t *uring_open(uring_t *ring, int fd, void *ctx,
+                           uring_recv_callback_t recv_callback, uring_send_callback_t send_callback)
+{
+    return NULL;
+}
+
+void uring_close(uring_handle_t *handle)
+{
+}
+
+int uring_recv_start(uring_handle_t *handle, socklen_t name_len, size_t control_len)
+{
+    return -1;
+}
+
+int uring_send_packet(uring_handle_t *handle, packet_t *packet,
+                      const struct sockaddr_storage *address, socklen_t addr_len,
+                      const void *control, size_t control_len)
+{
+    packet_free(packet);
+    return -1;
+}
+
+unsigned int uring_in_flight(uring_handle_t *handle)
+{
+    return 0;
+}
+
+bool uring_stats_get(struct ev_loop *loop, uring_stats_t *stats)
+{
+    return false;
+}
+
+void uring_loop_cleanup(struct ev_loop *loop)
+{
+}
+
+#endif
@@ -0,0 +1,838 @@
+#define _GNU_SOURCE
+
+#include "proto/xsk.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+
+#include <ev.h>
+
+#include "ext/uthash.h"
+
+#include "log.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+#define XSK_SUPPORTED
+#endif
+#endif
+
+#ifdef XSK_SUPPORTED
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XSK_ETH_HDR_LEN 14
+#define XSK_IP_HDR_LEN 20
+#define XSK_UDP_HDR_LEN 8
+#define XSK_HDR_LEN (XSK_ETH_HDR_LEN + XSK_IP_HDR_LEN + XSK_UDP_HDR_LEN)
+
+#define XSK_PROG_MAX_INSNS 32
+
+typedef struct xsk_ring
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t mask;
+
+    // Local copies of the index this side owns
+    uint32_t cached;
+
+    void *map;
+    size_t map_size;
+} xsk_ring_t;
+
+// Link layer addresses learned from authenticated frames, replies go out the way requests came in
+typedef struct xsk_peer
+{
+    uint32_t addr;
+
+    packet_link_t link;
+    ev_tstamp last_seen;
+
+    UT_hash_handle hh;
+} xsk_peer_t;
+
+struct xsk
+{
+    int fd;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+
+    unsigned int ifindex;
+    unsigned int queue;
+    unsigned int mtu;
+    uint32_t local_addr;
+    uint16_t local_port;
+
+    unsigned char *umem;
+    size_t umem_size;
+    uint64_t *free_frames;
+    unsigned int free_count;
+
+    xsk_ring_t fill;
+    xsk_ring_t comp;
+    xsk_ring_t rx;
+    xsk_ring_t tx;
+    unsigned int tx_pending;
+
+    xsk_peer_t *peers;
+    unsigned int peer_count;
+    uint16_t ip_id;
+
+    struct ev_loop *loop;
+    ev_io io;
+    ev_prepare prepare;
+    ev_timer peer_timer;
+
+    void *ctx;
+    xsk_recv_callback_t recv_callback;
+};
+
+static int bpf(int cmd, union bpf_attr *attr);
+static int prog_load(xsk_t *xsk);
+static int prog_attach(xsk_t *xsk);
+
+static int umem_setup(xsk_t *xsk);
+static int rings_setup(xsk_t *xsk);
+static int ring_map(xsk_t *xsk, xsk_ring_t *ring, const struct xdp_ring_offset *off,
+                    size_t desc_size, off_t pgoff);
+static int socket_bind(xsk_t *xsk);
+
+static void fill_ring_refill(xsk_t *xsk, const uint64_t *addrs, unsigned int count);
+static void comp_ring_reap(xsk_t *xsk);
+static void rx_ring_drain(xsk_t *xsk);
+static void rx_frame(xsk_t *xsk, const unsigned char *frame, uint32_t len);
+static void tx_kick(xsk_t *xsk);
+
+static uint16_t checksum_fold(uint32_t sum);
+static uint32_t checksum_add(uint32_t sum, const unsigned char *data, size_t len);
+
+static void io_callback(EV_P_ ev_io *io, int revents);
+static void prepare_callback(EV_P_ ev_prepare *prepare, int revents);
+static void peer_callback(EV_P_ ev_timer *timer, int revents);
+
+xsk_t *xsk_open(struct ev_loop *loop, const char *ifname, unsigned int queue,
+                const struct sockaddr_storage *local_address, void *ctx, xsk_recv_callback_t recv_callback)
+{
+    if (local_address->ss_family != AF_INET)
+    {
+        log_w("AF_XDP only supports IPv4 listeners");
+        return NULL;
+    }
+
+    xsk_t *xsk = calloc(1, sizeof(*xsk));
+    if (!xsk)
+    {
+        elog_e("calloc(xsk_t) failed");
+        return NULL;
+    }
+    xsk->fd = -1;
+    xsk->map_fd = -1;
+    xsk->prog_fd = -1;
+    xsk->link_fd = -1;
+
+    xsk->loop = loop;
+    xsk->queue = queue;
+    xsk->ctx = ctx;
+    xsk->recv_callback = recv_callback;
+
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)local_address;
+    xsk->local_addr = sin->sin_addr.s_addr;
+    xsk->local_port = sin->sin_port;
+
+    xsk->ifindex = if_nametoindex(ifname);
+    if (xsk->ifindex == 0)
+    {
+        elog_e("Unknown interface %s", ifname);
+        goto error;
+    }
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xsk->fd < 0)
+    {
+        elog_e("socket(AF_XDP) failed");
+        goto error;
+    }
+
+    // Larger datagrams are left to the kernel, which can fragment them
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    xsk->mtu = (ioctl(xsk->fd, SIOCGIFMTU, &ifr) == 0) ? ifr.ifr_mtu : 1500;
+
+    if (umem_setup(xsk) != 0 || rings_setup(xsk) != 0 || socket_bind(xsk) != 0)
+        goto error;
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = queue + 1;
+    xsk->map_fd = bpf(BPF_MAP_CREATE, &attr);
+    if (xsk->map_fd < 0)
+    {
+        elog_e("bpf(BPF_MAP_CREATE) failed");
+        goto error;
+    }
+
+    uint32_t key = queue;
+    uint32_t value = xsk->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xsk->map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    if (bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0)
+    {
+        elog_e("bpf(BPF_MAP_UPDATE_ELEM) failed");
+        goto error;
+    }
+
+    if (prog_load(xsk) != 0 || prog_attach(xsk) != 0)
+        goto error;
+
+    ev_io_init(&xsk->io, io_callback, xsk->fd, EV_READ);
+    xsk->io.data = xsk;
+    ev_io_start(loop, &xsk->io);
+
+    ev_prepare_init(&xsk->prepare, prepare_callback);
+    xsk->prepare.data = xsk;
+    ev_prepare_start(loop, &xsk->prepare);
+
+    ev_timer_init(&xsk->peer_timer, peer_callback, XSK_PEER_INTERVAL, XSK_PEER_INTERVAL);
+    xsk->peer_timer.data = xsk;
+    ev_timer_start(loop, &xsk->peer_timer);
+
+    return xsk;
+error:
+    xsk_close(xsk);
+
+    return NULL;
+}
+
+void xsk_close(xsk_t *xsk)
+{
+    if (xsk->loop)
+    {
+        ev_io_stop(xsk->loop, &xsk->io);
+        ev_prepare_stop(xsk->loop, &xsk->prepare);
+        ev_timer_stop(xsk->loop, &xsk->peer_timer);
+    }
+
+    // Closing the link detaches the program from the interface
+    if (xsk->link_fd >= 0)
+        close(xsk->link_fd);
+    if (xsk->prog_fd >= 0)
+        close(xsk->prog_fd);
+    if (xsk->map_fd >= 0)
+        close(xsk->map_fd);
+
+    xsk_ring_t *rings[] = {&xsk->fill, &xsk->comp, &xsk->rx, &xsk->tx};
+    for (size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++)
+    {
+        if (rings[i]->map)
+            munmap(rings[i]->map, rings[i]->map_size);
+    }
+
+    if (xsk->fd >= 0)
+        close(xsk->fd);
+    if (xsk->umem)
+        munmap(xsk->umem, xsk->umem_size);
+    free(xsk->free_frames);
+
+    xsk_peer_t *current, *tmp;
+    HASH_ITER(hh, xsk->peers, current, tmp)
+    {
+        HASH_DEL(xsk->peers, current);
+        free(current);
+    }
+
+    free(xsk);
+}
+
+void xsk_learn(xsk_t *xsk, const packet_t *packet)
+{
+    if (!packet->has_link || packet->addr.ss_family != AF_INET)
+        return;
+
+    uint32_t peer_addr = ((const struct sockaddr_in *)&packet->addr)->sin_addr.s_addr;
+
+    xsk_peer_t *peer;
+    HASH_FIND(hh, xsk->peers, &peer_addr, sizeof(peer_addr), peer);
+    if (!peer)
+    {
+        if (xsk->peer_count >= XSK_MAX_PEERS)
+        {
+            log_d("AF_XDP peer table full");
+            return;
+        }
+
+        peer = malloc(sizeof(*peer));
+        if (!peer)
+        {
+            elog_e("malloc(xsk_peer_t) failed");
+            return;
+        }
+        peer->addr = peer_addr;
+        HASH_ADD(hh, xsk->peers, addr, sizeof(peer->addr), peer);
+        xsk->peer_count++;
+    }
+
+    peer->link = packet->link;
+    peer->last_seen = ev_now(xsk->loop);
+}
+
+int xsk_sendto(xsk_t *xsk, packet_t *packet, const struct sockaddr_storage *address, socklen_t addr_len)
+{
+    if (address->ss_family != AF_INET || packet->data_len + XSK_IP_HDR_LEN + XSK_UDP_HDR_LEN > xsk->mtu ||
+        packet->data_len + XSK_HDR_LEN > XSK_FRAME_SIZE)
+        return -1;
+
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)address;
+
+    xsk_peer_t *peer;
+    uint32_t peer_addr = sin->sin_addr.s_addr;
+    HASH_FIND(hh, xsk->peers, &peer_addr, sizeof(peer_addr), peer);
+    if (!peer)
+        return -1;
+
+    if (xsk->free_count == 0)
+        comp_ring_reap(xsk);
+
+    uint32_t consumer = __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE);
+    if (xsk->free_count == 0 || xsk->tx.cached - consumer >= XSK_RING_SIZE)
+        return -1;
+
+    uint64_t addr = xsk->free_frames[--xsk->free_count];
+    unsigned char *frame = &xsk->umem[addr];
+    size_t udp_len = XSK_UDP_HDR_LEN + packet->data_len;
+    size_t ip_len = XSK_IP_HDR_LEN + udp_len;
+
+    unsigned char *eth = frame;
+    memcpy(&eth[0], peer->link.peer_mac, 6);
+    memcpy(&eth[6], peer->link.local_mac, 6);
+    eth[12] = 0x08;
+    eth[13] = 0x00;
+
+    unsigned char *ip = &frame[XSK_ETH_HDR_LEN];
+    uint16_t value;
+    ip[0] = 0x45;
+    ip[1] = packet->ecn;
+    value = htons(ip_len);
+    memcpy(&ip[2], &value, 2);
+    value = htons(xsk->ip_id++);
+    memcpy(&ip[4], &value, 2);
+    value = htons(0x4000); // Don't fragment
+    memcpy(&ip[6], &value, 2);
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memset(&ip[10], 0, 2);
+    memcpy(&ip[12], &peer->link.local_addr, 4);
+    memcpy(&ip[16], &peer_addr, 4);
+    value = checksum_fold(checksum_add(0, ip, XSK_IP_HDR_LEN));
+    memcpy(&ip[10], &value, 2);
+
+    unsigned char *udp = &ip[XSK_IP_HDR_LEN];
+    memcpy(&udp[0], &xsk->local_port, 2);
+    memcpy(&udp[2], &sin->sin_port, 2);
+    value = htons(udp_len);
+    memcpy(&udp[4], &value, 2);
+    memset(&udp[6], 0, 2);
+    memcpy(&udp[XSK_UDP_HDR_LEN], packet->data, packet->data_len);
+
+    // Pseudo header, then the datagram itself
+    unsigned char pseudo[12];
+    memcpy(&pseudo[0], &ip[12], 8);
+    pseudo[8] = 0;
+    pseudo[9] = IPPROTO_UDP;
+    memcpy(&pseudo[10], &udp[4], 2);
+    value = checksum_fold(checksum_add(checksum_add(0, pseudo, sizeof(pseudo)), udp, udp_len));
+    if (value == 0)
+        value = 0xffff;
+    memcpy(&udp[6], &value, 2);
+
+    struct xdp_desc *desc = &((struct xdp_desc *)xsk->tx.descs)[xsk->tx.cached & xsk->tx.mask];
+    desc->addr = addr;
+    desc->len = XSK_HDR_LEN + packet->data_len;
+    desc->options = 0;
+    __atomic_store_n(xsk->tx.producer, ++xsk->tx.cached, __ATOMIC_RELEASE);
+
+    // The kernel is kicked once per loop iteration for everything queued meanwhile
+    xsk->tx_pending++;
+
+    packet_free(packet);
+
+    return 0;
+}
+
+int bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define XSK_INSN(c, d, s, o, i) ((struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+
+int prog_load(xsk_t *xsk)
+{
+    // Packet loads are in network byte order, so compare against values in network byte order as well
+    uint16_t eth_ip = htons(0x0800);
+    uint16_t frag_mask = htons(0x3fff);
+
+    struct bpf_insn insns[XSK_PROG_MAX_INSNS];
+    int n = 0;
+    int pass_jumps[8];
+    int jumps = 0;
+
+#define XSK_JUMP_PASS(insn)         \
+    do                              \
+    {                               \
+        pass_jumps[jumps++] = n;    \
+        insns[n++] = (insn);        \
+    } while (0)
+
+    insns[n++] = XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    insns[n++] = XSK_INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, 0, 0); // data
+    insns[n++] = XSK_INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_6, 4, 0); // data_end
+    insns[n++] = XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    insns[n++] = XSK_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XSK_HDR_LEN);
+    XSK_JUMP_PASS(XSK_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0));
+
+    // IPv4 without options, UDP, not a fragment
+    insns[n++] = XSK_INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 12, 0);
+    XSK_JUMP_PASS(XSK_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, eth_ip));
+    insns[n++] = XSK_INSN(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, 14, 0);
+    XSK_JUMP_PASS(XSK_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x45));
+    insns[n++] = XSK_INSN(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, 23, 0);
+    XSK_JUMP_PASS(XSK_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, IPPROTO_UDP));
+    insns[n++] = XSK_INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 20, 0);
+    insns[n++] = XSK_INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, frag_mask);
+    XSK_JUMP_PASS(XSK_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0));
+
+    // Destination address and port of the listener
+    if (xsk->local_addr != htonl(INADDR_ANY))
+    {
+        insns[n++] = XSK_INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_5, BPF_REG_2, 30, 0);
+        XSK_JUMP_PASS(XSK_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, (int32_t)xsk->local_addr));
+    }
+    insns[n++] = XSK_INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 36, 0);
+    XSK_JUMP_PASS(XSK_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, xsk->local_port));
+
+    // bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS), queues without a socket pass
+    insns[n++] = XSK_INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, 16, 0);
+    insns[n++] = XSK_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xsk->map_fd);
+    insns[n++] = XSK_INSN(0, 0, 0, 0, 0);
+    insns[n++] = XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+    insns[n++] = XSK_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    insns[n++] = XSK_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    int pass = n;
+    insns[n++] = XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    insns[n++] = XSK_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    for (int i = 0; i < jumps; i++)
+        insns[pass_jumps[i]].off = pass - pass_jumps[i] - 1;
+
+#undef XSK_JUMP_PASS
+
+    static char verifier_log[4096];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)insns;
+    attr.insn_cnt = n;
+    attr.license = (uintptr_t) "MIT";
+    attr.log_buf = (uintptr_t)verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+
+    xsk->prog_fd = bpf(BPF_PROG_LOAD, &attr);
+    if (xsk->prog_fd < 0)
+    {
+        elog_e("Failed to load XDP program");
+        log_d("Verifier log:\n%s", verifier_log);
+        return -1;
+    }
+
+    return 0;
+}
+
+int prog_attach(xsk_t *xsk)
+{
+    // Native mode needs driver support, generic mode works everywhere but gains less
+    static const struct
+    {
+        uint32_t flags;
+        const char *name;
+    } modes[] = {
+        {XDP_FLAGS_DRV_MODE, "native"},
+        {XDP_FLAGS_SKB_MODE, "generic"},
+    };
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = xsk->prog_fd;
+        attr.link_create.target_ifindex = xsk->ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = modes[i].flags;
+
+        xsk->link_fd = bpf(BPF_LINK_CREATE, &attr);
+        if (xsk->link_fd >= 0)
+        {
+            log_i("XDP program attached in %s mode", modes[i].name);
+            return 0;
+        }
+
+        elog_d("Failed to attach XDP program in %s mode", modes[i].name);
+        if (errno == EBUSY || errno == EEXIST)
+            break;
+    }
+
+    elog_e("Failed to attach XDP program");
+    return -1;
+}
+
+int umem_setup(xsk_t *xsk)
+{
+    xsk->umem_size = (size_t)XSK_FRAMES * XSK_FRAME_SIZE;
+    xsk->umem = mmap(NULL, xsk->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xsk->umem == MAP_FAILED)
+    {
+        xsk->umem = NULL;
+        elog_e("mmap(UMEM) failed");
+        return -1;
+    }
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t)xsk->umem;
+    reg.len = xsk->umem_size;
+    reg.chunk_size = XSK_FRAME_SIZE;
+    reg.headroom = 0;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0)
+    {
+        elog_e("setsockopt(XDP_UMEM_REG) failed");
+        return -1;
+    }
+
+    xsk->free_frames = malloc(XSK_FRAMES * sizeof(*xsk->free_frames));
+    if (!xsk->free_frames)
+    {
+        elog_e("malloc(xsk frames) failed");
+        return -1;
+    }
+    for (unsigned int i = 0; i < XSK_FRAMES; i++)
+        xsk->free_frames[xsk->free_count++] = (uint64_t)(XSK_FRAMES - 1 - i) * XSK_FRAME_SIZE;
+
+    return 0;
+}
+
+int rings_setup(xsk_t *xsk)
+{
+    int size = XSK_RING_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) != 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) != 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) != 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) != 0)
+    {
+        elog_e("setsockopt(XDP ring) failed");
+        return -1;
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) != 0)
+    {
+        elog_e("getsockopt(XDP_MMAP_OFFSETS) failed");
+        return -1;
+    }
+
+    if (ring_map(xsk, &xsk->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0 ||
+        ring_map(xsk, &xsk->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != 0 ||
+        ring_map(xsk, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0 ||
+        ring_map(xsk, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) != 0)
+        return -1;
+
+    // Half the frames wait in the fill ring for received packets, the rest are for sending
+    uint64_t addrs[XSK_RING_SIZE];
+    for (unsigned int i = 0; i < XSK_RING_SIZE; i++)
+        addrs[i] = xsk->free_frames[--xsk->free_count];
+    fill_ring_refill(xsk, addrs, XSK_RING_SIZE);
+
+    return 0;
+}
+
+int ring_map(xsk_t *xsk, xsk_ring_t *ring, const struct xdp_ring_offset *off, size_t desc_size, off_t pgoff)
+{
+    ring->map_size = off->desc + XSK_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+    if (ring->map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        elog_e("mmap(XDP ring) failed");
+        return -1;
+    }
+
+    unsigned char *ptr = ring->map;
+    ring->producer = (uint32_t *)(ptr + off->producer);
+    ring->consumer = (uint32_t *)(ptr + off->consumer);
+    ring->flags = (uint32_t *)(ptr + off->flags);
+    ring->descs = ptr + off->desc;
+    ring->mask = XSK_RING_SIZE - 1;
+
+    // Rings this side produces into start at the producer index, the others at the consumer index
+    if (pgoff == XDP_UMEM_PGOFF_FILL_RING || pgoff == XDP_PGOFF_TX_RING)
+        ring->cached = *ring->producer;
+    else
+        ring->cached = *ring->consumer;
+
+    return 0;
+}
+
+int socket_bind(xsk_t *xsk)
+{
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = xsk->ifindex;
+    sxdp.sxdp_queue_id = xsk->queue;
+
+    // Zero-copy needs driver support, copy mode works on any interface
+    sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0)
+    {
+        log_i("AF_XDP socket bound to queue %u in zero-copy mode", xsk->queue);
+        return 0;
+    }
+    elog_d("AF_XDP zero-copy mode unavailable");
+
+    sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0)
+    {
+        log_i("AF_XDP socket bound to queue %u in copy mode", xsk->queue);
+        return 0;
+    }
+
+    elog_e("bind(AF_XDP) failed");
+    return -1;
+}
+
+void fill_ring_refill(xsk_t *xsk, const uint64_t *addrs, unsigned int count)
+{
+    uint64_t *ring = xsk->fill.descs;
+    for (unsigned int i = 0; i < count; i++)
+        ring[xsk->fill.cached++ & xsk->fill.mask] = addrs[i];
+
+    __atomic_store_n(xsk->fill.producer, xsk->fill.cached, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(xsk->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+void comp_ring_reap(xsk_t *xsk)
+{
+    uint32_t producer = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE);
+    uint64_t *ring = xsk->comp.descs;
+
+    while (xsk->comp.cached != producer)
+        xsk->free_frames[xsk->free_count++] = ring[xsk->comp.cached++ & xsk->comp.mask];
+
+    __atomic_store_n(xsk->comp.consumer, xsk->comp.cached, __ATOMIC_RELEASE);
+}
+
+void rx_ring_drain(xsk_t *xsk)
+{
+    uint32_t producer = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+    struct xdp_desc *descs = xsk->rx.descs;
+
+    uint64_t addrs[XSK_RX_BUDGET];
+    unsigned int count = 0;
+    while (xsk->rx.cached != producer && count < XSK_RX_BUDGET)
+    {
+        struct xdp_desc *desc = &descs[xsk->rx.cached++ & xsk->rx.mask];
+
+        rx_frame(xsk, &xsk->umem[desc->addr], desc->len);
+        addrs[count++] = desc->addr;
+    }
+
+    if (count == 0)
+        return;
+
+    // Payloads have been copied out, the frames can take new packets right away
+    __atomic_store_n(xsk->rx.consumer, xsk->rx.cached, __ATOMIC_RELEASE);
+    fill_ring_refill(xsk, addrs, count);
+
+#ifdef EV_EDGE_TRIGGERED
+    if (xsk->rx.cached != producer)
+        ev_feed_event(xsk->loop, &xsk->io, EV_READ);
+#endif
+}
+
+void rx_frame(xsk_t *xsk, const unsigned char *frame, uint32_t len)
+{
+    // The XDP program only lets complete IPv4 UDP headers without options through
+    if (len < XSK_HDR_LEN)
+        return;
+
+    const unsigned char *ip = &frame[XSK_ETH_HDR_LEN];
+    const unsigned char *udp = &ip[XSK_IP_HDR_LEN];
+
+    uint16_t udp_len;
+    memcpy(&udp_len, &udp[4], 2);
+    udp_len = ntohs(udp_len);
+    if (udp_len < XSK_UDP_HDR_LEN || udp_len > len - XSK_ETH_HDR_LEN - XSK_IP_HDR_LEN)
+    {
+        log_d("Dropping AF_XDP frame with invalid UDP length");
+        return;
+    }
+
+    uint32_t src_addr, dst_addr;
+    memcpy(&src_addr, &ip[12], 4);
+    memcpy(&dst_addr, &ip[16], 4);
+
+    size_t data_len = udp_len - XSK_UDP_HDR_LEN;
+    packet_t *packet = packet_alloc(data_len);
+    if (!packet)
+    {
+        log_e("Failed to allocate packet");
+        return;
+    }
+    memcpy(packet->data, &udp[XSK_UDP_HDR_LEN], data_len);
+    packet->ecn = ip[1] & IPTOS_ECN_MASK;
+
+    // Kept with the packet until its payload proves who sent it, see xsk_learn()
+    packet->has_link = true;
+    packet->link.local_addr = dst_addr;
+    memcpy(packet->link.local_mac, &frame[0], 6);
+    memcpy(packet->link.peer_mac, &frame[6], 6);
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)&packet->addr;
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = src_addr;
+    memcpy(&sin->sin_port, &udp[0], 2);
+    packet->addr_len = sizeof(*sin);
+
+    xsk->recv_callback(xsk->ctx, packet);
+}
+
+void tx_kick(xsk_t *xsk)
+{
+    comp_ring_reap(xsk);
+
+    if (xsk->tx_pending == 0)
+        return;
+    xsk->tx_pending = 0;
+
+    if (!(__atomic_load_n(xsk->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP))
+        return;
+
+    if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+        elog_w("sendto(AF_XDP) failed");
+}
+
+uint16_t checksum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+uint32_t checksum_add(uint32_t sum, const unsigned char *data, size_t len)
+{
+    // Words are summed as they appear in memory, which keeps the result in network byte order
+    for (size_t i = 0; i + 1 < len; i += 2)
+    {
+        uint16_t word;
+        memcpy(&word, &data[i], 2);
+        sum += word;
+    }
+    if (len & 1)
+    {
+        uint16_t word = 0;
+        memcpy(&word, &data[len - 1], 1);
+        sum += word;
+    }
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return sum;
+}
+
+void io_callback(EV_P_ ev_io *io, int revents)
+{
+    rx_ring_drain(io->data);
+}
+
+void prepare_callback(EV_P_ ev_prepare *prepare, int revents)
+{
+    tx_kick(prepare->data);
+}
+
+void peer_callback(EV_P_ ev_timer *timer, int revents)
+{
+    xsk_t *xsk = timer->data;
+
+    // Updates don't reorder the table, so all of it is checked
+    ev_tstamp deadline = ev_now(EV_A) - XSK_PEER_TIMEOUT;
+    xsk_peer_t *current, *tmp;
+    HASH_ITER(hh, xsk->peers, current, tmp)
+    {
+        if (current->last_seen > deadline)
+            continue;
+
+        HASH_DEL(xsk->peers, current);
+        free(current);
+        xsk->peer_count--;
+    }
+}
+
+#else
+
+xsk_t *xsk_open(struct ev_loop *loop, const char *ifname, unsigned int queue,
+                const struct sockaddr_storage *local_address, void *ctx, xsk_recv_callback_t recv_callback)
+{
+    log_w("AF_XDP not supported on this platform");
+    return NULL;
+}
+
+void xsk_close(xsk_t *xsk)
+{
+}
+
+void xsk_learn(xsk_t *xsk, const packet_t *packet)
+{
+}
+
+int xsk_sendto(xsk_t *xsk, packet_t *packet, const struct sockaddr_storage *address, socklen_t addr_len)
+{
+    return -1;
+}
+
+#endif
\ No newline at end of file
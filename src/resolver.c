@@ -0,0 +1,235 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "resolver.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include <ev.h>
+
+#include "proto/udp.h"
+
+#include "log.h"
+
+struct rtptun_resolve_job
+{
+    pthread_mutex_t lock;
+    // Held by the resolver and the lookup thread, whoever lets go last frees the job
+    unsigned int refs;
+    // Set once the resolver is gone and mustn't be notified anymore
+    bool cancelled;
+
+    char *host;
+    char *port;
+
+    int result;
+    struct sockaddr_storage address;
+    socklen_t address_len;
+
+    struct ev_loop *loop;
+    ev_async *done_watcher;
+};
+
+static void *job_run(void *arg);
+static void job_release(rtptun_resolve_job_t *job);
+static void job_start(rtptun_resolver_t *resolver);
+
+static void refresh_callback(EV_P_ ev_timer *timer, int revents);
+static void done_callback(EV_P_ ev_async *async, int revents);
+
+rtptun_resolver_t *rtptun_resolver_new(struct ev_loop *loop, const char *host, const char *port, ev_tstamp refresh)
+{
+    rtptun_resolver_t *resolver = calloc(1, sizeof(*resolver));
+    if (!resolver)
+    {
+        elog_e("calloc(rtptun_resolver_t) failed");
+        goto error;
+    }
+
+    resolver->loop = loop;
+    resolver->host = strdup(host);
+    resolver->port = strdup(port);
+    if (!resolver->host || !resolver->port)
+    {
+        elog_e("strdup() failed");
+        goto error;
+    }
+
+    // Blocking is fine before the loop runs
+    resolver->address_len = sizeof(resolver->address);
+    if (udp_resolve(host, port, &resolver->address, &resolver->address_len) != 0)
+        goto error;
+
+    ev_async_init(&resolver->done_watcher, done_callback);
+    resolver->done_watcher.data = resolver;
+    ev_async_start(loop, &resolver->done_watcher);
+
+    struct in6_addr addr;
+    bool numeric = inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1;
+
+    ev_timer_init(&resolver->refresh_timer, refresh_callback, refresh, refresh);
+    resolver->refresh_timer.data = resolver;
+    if (!numeric && refresh > 0)
+        ev_timer_start(loop, &resolver->refresh_timer);
+
+    return resolver;
+error:
+    if (resolver)
+    {
+        free(resolver->host);
+        free(resolver->port);
+        free(resolver);
+    }
+
+    return NULL;
+}
+
+void rtptun_resolver_free(rtptun_resolver_t *resolver)
+{
+    ev_timer_stop(resolver->loop, &resolver->refresh_timer);
+
+    // A lookup still in progress finishes on its own, without telling anyone
+    if (resolver->job)
+    {
+        pthread_mutex_lock(&resolver->job->lock);
+        resolver->job->cancelled = true;
+        pthread_mutex_unlock(&resolver->job->lock);
+
+        job_release(resolver->job);
+    }
+
+    ev_async_stop(resolver->loop, &resolver->done_watcher);
+
+    free(resolver->host);
+    free(resolver->port);
+    free(resolver);
+}
+
+void *job_run(void *arg)
+{
+    rtptun_resolve_job_t *job = arg;
+
+    job->address_len = sizeof(job->address);
+    int result = udp_resolve(job->host, job->port, &job->address, &job->address_len);
+
+    pthread_mutex_lock(&job->lock);
+    job->result = result;
+    if (!job->cancelled)
+        ev_async_send(job->loop, job->done_watcher);
+    pthread_mutex_unlock(&job->lock);
+
+    job_release(job);
+    return NULL;
+}
+
+void job_release(rtptun_resolve_job_t *job)
+{
+    pthread_mutex_lock(&job->lock);
+    bool last = --job->refs == 0;
+    pthread_mutex_unlock(&job->lock);
+
+    if (!last)
+        return;
+
+    pthread_mutex_destroy(&job->lock);
+    free(job->host);
+    free(job->port);
+    free(job);
+}
+
+void job_start(rtptun_resolver_t *resolver)
+{
+    rtptun_resolve_job_t *job = calloc(1, sizeof(*job));
+    if (!job)
+    {
+        elog_w("calloc(rtptun_resolve_job_t) failed");
+        return;
+    }
+
+    pthread_mutex_init(&job->lock, NULL);
+    job->refs = 2;
+    job->host = strdup(resolver->host);
+    job->port = strdup(resolver->port);
+    job->loop = resolver->loop;
+    job->done_watcher = &resolver->done_watcher;
+    if (!job->host || !job->port)
+    {
+        elog_w("strdup() failed");
+        goto error;
+    }
+
+    // Signals are left to the loop threads
+    sigset_t mask, old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, &attr, job_run, job);
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (ret != 0)
+    {
+        errno = ret;
+        elog_w("pthread_create() failed");
+        goto error;
+    }
+
+    resolver->job = job;
+    return;
+error:
+    pthread_mutex_destroy(&job->lock);
+    free(job->host);
+    free(job->port);
+    free(job);
+}
+
+void refresh_callback(EV_P_ ev_timer *timer, int revents)
+{
+    rtptun_resolver_t *resolver = timer->data;
+
+    // A slow resolver may still be working on the previous refresh
+    if (resolver->job)
+        return;
+
+    job_start(resolver);
+}
+
+void done_callback(EV_P_ ev_async *async, int revents)
+{
+    rtptun_resolver_t *resolver = async->data;
+    rtptun_resolve_job_t *job = resolver->job;
+    if (!job)
+        return;
+
+    resolver->job = NULL;
+
+    // Failed lookups keep the last known address
+    pthread_mutex_lock(&job->lock);
+    if (job->result == 0 && (job->address_len != resolver->address_len ||
+                             memcmp(&job->address, &resolver->address, job->address_len) != 0))
+    {
+        memcpy(&resolver->address, &job->address, job->address_len);
+        resolver->address_len = job->address_len;
+
+        char host[INET6_ADDRSTRLEN];
+        if (getnameinfo((struct sockaddr *)&resolver->address, resolver->address_len, host, sizeof(host),
+                        NULL, 0, NI_NUMERICHOST) == 0)
+            log_i("%s now resolves to %s", resolver->host, host);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    job_release(job);
+}
\ No newline at end of file
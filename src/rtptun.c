@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include <unistd.h>
 #include <getopt.h>
@@ -12,8 +13,11 @@
 #include "log.h"
 #include "config.h"
 #include "crypto/chacha.h"
+#include "proto/udp.h"
 #include "server.h"
 #include "client.h"
+#include "worker.h"
+#include "loop.h"
 
 #ifndef BUILD_VERSION
 #define BUILD_VERSION "undefined version"
@@ -39,16 +43,33 @@ static void print_version();
 static void argerror(const char *format, ...);
 static action_t parse_action(const char *action);
 
+static void load_udp_options(config_t *cfg, const char *section, udp_options_t *options);
+static void load_loop_options(config_t *cfg, const char *section, rtptun_loop_options_t *loop_options,
+                              udp_options_t *options);
+static void load_server_options(config_t *cfg, rtptun_server_options_t *server_options);
+static void load_uint(config_t *cfg, const char *section, const char *key, unsigned int *value);
+static void load_bool(config_t *cfg, const char *section, const char *key, bool *value);
+
 static void signal_callback(EV_P_ ev_signal *w, int revents);
+static void client_stats_callback(EV_P_ ev_signal *w, int revents);
+static void server_stats_callback(EV_P_ ev_signal *w, int revents);
+static void workers_stats_callback(EV_P_ ev_signal *w, int revents);
 static void watch_signals(EV_P);
 
 static int start_server(const char *listen_addr, const char *listen_port,
-                        const char *dest_addr, const char *dest_port, const char *key);
+                        const char *dest_addr, const char *dest_port, const char *key,
+                        const udp_options_t *options, const rtptun_server_options_t *server_options,
+                        const rtptun_loop_options_t *loop_options, unsigned int threads);
+static int start_workers(const char *listen_addr, const char *listen_port,
+                         const char *dest_addr, const char *dest_port, const char *key,
+                         const udp_options_t *options, const rtptun_server_options_t *server_options,
+                         const rtptun_loop_options_t *loop_options, unsigned int threads);
 static int start_client(const char *listen_addr, const char *listen_port,
-                        const char *dest_addr, const char *dest_port, const char *key);
+                        const char *dest_addr, const char *dest_port, const char *key,
+                        const udp_options_t *options, const rtptun_loop_options_t *loop_options);
 static int gen_key();
 
-ev_signal sigint_watcher, sigterm_watcher;
+ev_signal sigint_watcher, sigterm_watcher, sigusr1_watcher;
 
 int main(int argc, char *argv[])
 {
@@ -62,6 +83,10 @@ int main(int argc, char *argv[])
     const char *dest_addr = NULL;
     const char *dest_port = NULL;
     log_level_t log_level = DEFAULT_LOG_LEVEL;
+    udp_options_t udp_options = UDP_OPTIONS_DEFAULT;
+    rtptun_server_options_t server_options = RTPTUN_SERVER_OPTIONS_DEFAULT;
+    rtptun_loop_options_t loop_options = RTPTUN_LOOP_OPTIONS_DEFAULT;
+    unsigned int threads = 1;
 
     char *action_arg = argv[1];
     if (action_arg && action_arg[0] != '-')
@@ -136,8 +161,10 @@ int main(int argc, char *argv[])
             config_get_str(&cfg, "client", "server-addr", &dest_addr);
             config_get_str(&cfg, "client", "server-port", &dest_port);
             config_get_str(&cfg, "client", "key", &key);
+            load_udp_options(&cfg, "client", &udp_options);
+            load_loop_options(&cfg, "client", &loop_options, &udp_options);
 
-            ret = start_client(listen_addr, listen_port, dest_addr, dest_port, key);
+            ret = start_client(listen_addr, listen_port, dest_addr, dest_port, key, &udp_options, &loop_options);
         }
         else if (config_has_section(&cfg, "server"))
         {
@@ -146,8 +173,22 @@ int main(int argc, char *argv[])
             config_get_str(&cfg, "server", "dest-addr", &dest_addr);
             config_get_str(&cfg, "server", "dest-port", &dest_port);
             config_get_str(&cfg, "server", "key", &key);
-
-            ret = start_server(listen_addr, listen_port, dest_addr, dest_port, key);
+            load_udp_options(&cfg, "server", &udp_options);
+            load_loop_options(&cfg, "server", &loop_options, &udp_options);
+            load_server_options(&cfg, &server_options);
+            load_uint(&cfg, "server", "threads", &threads);
+            config_get_str(&cfg, "server", "xdp-interface", &udp_options.xdp_interface);
+            load_uint(&cfg, "server", "xdp-queue", &udp_options.xdp_queue);
+
+            // One AF_XDP socket per queue, workers sharing the port would fight over it
+            if (udp_options.xdp_interface && threads > 1)
+            {
+                log_w("AF_XDP requires a single thread, disabling it");
+                udp_options.xdp_interface = NULL;
+            }
+
+            ret = start_server(listen_addr, listen_port, dest_addr, dest_port, key, &udp_options, &server_options,
+                               &loop_options, threads);
         }
         else
         {
@@ -170,11 +211,12 @@ int main(int argc, char *argv[])
 
             break;
         case ACT_CLIENT:
-            ret = start_client(listen_addr, listen_port, dest_addr, dest_port, key);
+            ret = start_client(listen_addr, listen_port, dest_addr, dest_port, key, &udp_options, &loop_options);
 
             break;
         case ACT_SERVER:
-            ret = start_server(listen_addr, listen_port, dest_addr, dest_port, key);
+            ret = start_server(listen_addr, listen_port, dest_addr, dest_port, key, &udp_options, &server_options,
+                               &loop_options, threads);
 
             break;
         default:
@@ -186,7 +228,8 @@ int main(int argc, char *argv[])
 }
 
 int start_client(const char *listen_addr, const char *listen_port,
-                 const char *dest_addr, const char *dest_port, const char *key)
+                 const char *dest_addr, const char *dest_port, const char *key,
+                 const udp_options_t *options, const rtptun_loop_options_t *loop_options)
 {
     if (!key)
         argerror("encryption key not specified");
@@ -199,24 +242,34 @@ int start_client(const char *listen_addr, const char *listen_port,
     if (!dest_port)
         dest_port = RTPTUN_DEFAULT_SERVER_PORT;
 
+    rtptun_loop_setup(loop_options);
+
     struct ev_loop *loop = EV_DEFAULT;
     watch_signals(loop);
 
     rtptun_client_t *client = rtptun_client_new(loop, listen_addr, listen_port,
-                                                dest_addr, dest_port, key);
+                                                dest_addr, dest_port, key, options);
     if (!client)
         return 1;
 
+    ev_signal_init(&sigusr1_watcher, client_stats_callback, SIGUSR1);
+    sigusr1_watcher.data = client;
+    ev_signal_start(loop, &sigusr1_watcher);
+
     log_i("Tunneling [%s]:%s to [%s]:%s", listen_addr, listen_port, dest_addr, dest_port);
 
-    ev_run(loop, 0);
+    rtptun_loop_run(loop, loop_options);
 
+    rtptun_client_log_stats(client);
     rtptun_client_free(client);
+    udp_thread_cleanup(loop);
     return 0;
 }
 
 int start_server(const char *listen_addr, const char *listen_port,
-                 const char *dest_addr, const char *dest_port, const char *key)
+                 const char *dest_addr, const char *dest_port, const char *key,
+                 const udp_options_t *options, const rtptun_server_options_t *server_options,
+                 const rtptun_loop_options_t *loop_options, unsigned int threads)
 {
     if (!key)
         argerror("encryption key not specified");
@@ -229,19 +282,58 @@ int start_server(const char *listen_addr, const char *listen_port,
     if (!dest_port)
         argerror("destination port not specified");
 
+    rtptun_loop_setup(loop_options);
+
+    if (threads > 1)
+        return start_workers(listen_addr, listen_port, dest_addr, dest_port, key, options, server_options,
+                             loop_options, threads);
+
     struct ev_loop *loop = EV_DEFAULT;
     watch_signals(loop);
 
     rtptun_server_t *server = rtptun_server_new(loop, listen_addr, listen_port,
-                                                dest_addr, dest_port, key);
+                                                dest_addr, dest_port, key, options, server_options);
     if (!server)
         return 1;
 
+    ev_signal_init(&sigusr1_watcher, server_stats_callback, SIGUSR1);
+    sigusr1_watcher.data = server;
+    ev_signal_start(loop, &sigusr1_watcher);
+
     log_i("Tunneling [%s]:%s to [%s]:%s", listen_addr, listen_port, dest_addr, dest_port);
 
-    ev_run(loop, 0);
+    rtptun_loop_run(loop, loop_options);
 
+    rtptun_server_log_stats(server);
     rtptun_server_free(server);
+    udp_thread_cleanup(loop);
+    return 0;
+}
+
+int start_workers(const char *listen_addr, const char *listen_port,
+                  const char *dest_addr, const char *dest_port, const char *key,
+                  const udp_options_t *options, const rtptun_server_options_t *server_options,
+                  const rtptun_loop_options_t *loop_options, unsigned int threads)
+{
+    // The default loop only handles signals, traffic is served by the workers' loops
+    struct ev_loop *loop = EV_DEFAULT;
+    watch_signals(loop);
+
+    rtptun_workers_t *workers = rtptun_workers_new(threads, listen_addr, listen_port,
+                                                   dest_addr, dest_port, key, options, server_options,
+                                                   loop_options);
+    if (!workers)
+        return 1;
+
+    ev_signal_init(&sigusr1_watcher, workers_stats_callback, SIGUSR1);
+    sigusr1_watcher.data = workers;
+    ev_signal_start(loop, &sigusr1_watcher);
+
+    log_i("Tunneling [%s]:%s to [%s]:%s using %u threads", listen_addr, listen_port, dest_addr, dest_port, threads);
+
+    ev_run(loop, 0);
+
+    rtptun_workers_free(workers);
     return 0;
 }
 
@@ -259,6 +351,112 @@ int gen_key()
     return 0;
 }
 
+void load_udp_options(config_t *cfg, const char *section, udp_options_t *options)
+{
+    load_uint(cfg, section, "recv-batch", &options->recv_batch);
+    load_uint(cfg, section, "recv-budget", &options->recv_budget);
+    load_uint(cfg, section, "send-batch", &options->send_batch);
+    load_uint(cfg, section, "send-delay", &options->send_delay);
+    load_bool(cfg, section, "gso", &options->gso);
+    load_bool(cfg, section, "gro", &options->gro);
+    load_bool(cfg, section, "jumbo-buffers", &options->jumbo);
+    load_uint(cfg, section, "send-queue", &options->send_queue);
+    load_uint(cfg, section, "recv-buffer", &options->recv_buffer);
+    load_uint(cfg, section, "send-buffer", &options->send_buffer);
+    load_bool(cfg, section, "buffer-autotune", &options->buffer_autotune);
+    load_uint(cfg, section, "zerocopy-threshold", &options->zerocopy);
+    load_bool(cfg, section, "dwell-stats", &options->timestamps);
+    load_bool(cfg, section, "ecn", &options->ecn);
+    load_bool(cfg, section, "path-mtu", &options->path_mtu);
+    load_bool(cfg, section, "icmp-too-big", &options->icmp_too_big);
+    load_uint(cfg, section, "aggregate-window", &options->aggregate);
+    load_uint(cfg, section, "fragment-size", &options->fragment_size);
+    load_uint(cfg, section, "reassembly-limit", &options->reassembly_limit);
+
+    const char *drop_policy;
+    if (config_get_str(cfg, section, "send-queue-drop", &drop_policy) == CONFIG_SUCCESS)
+    {
+        if (strcmp(drop_policy, "tail") == 0)
+            options->send_queue_drop = UDP_DROP_TAIL;
+        else if (strcmp(drop_policy, "head") == 0)
+            options->send_queue_drop = UDP_DROP_HEAD;
+        else
+            log_f("Invalid value for 'send-queue-drop'");
+    }
+
+    const char *backend;
+    if (config_get_str(cfg, section, "io-backend", &backend) == CONFIG_SUCCESS)
+    {
+        if (strcmp(backend, "libev") == 0)
+            options->backend = UDP_BACKEND_EV;
+        else if (strcmp(backend, "io_uring") == 0)
+            options->backend = UDP_BACKEND_URING;
+        else
+            log_f("Invalid value for 'io-backend'");
+    }
+
+    const char *pacing;
+    if (config_get_str(cfg, section, "pacing", &pacing) == CONFIG_SUCCESS)
+    {
+        if (strcmp(pacing, "off") == 0)
+            options->pacing = UDP_PACING_OFF;
+        else if (strcmp(pacing, "txtime") == 0)
+            options->pacing = UDP_PACING_TXTIME;
+        else if (strcmp(pacing, "timer") == 0)
+            options->pacing = UDP_PACING_TIMER;
+        else
+            log_f("Invalid value for 'pacing'");
+    }
+    load_uint(cfg, section, "pacing-rate", &options->pacing_rate);
+}
+
+void load_loop_options(config_t *cfg, const char *section, rtptun_loop_options_t *loop_options,
+                       udp_options_t *options)
+{
+    load_bool(cfg, section, "low-latency", &loop_options->low_latency);
+    load_uint(cfg, section, "spin-time", &loop_options->spin_time);
+    load_bool(cfg, section, "mlock", &loop_options->mlock);
+    load_uint(cfg, section, "realtime-priority", &loop_options->realtime_priority);
+
+    if (loop_options->low_latency)
+        options->busy_poll = RTPTUN_DEFAULT_BUSY_POLL;
+    load_uint(cfg, section, "busy-poll", &options->busy_poll);
+}
+
+void load_server_options(config_t *cfg, rtptun_server_options_t *server_options)
+{
+    const char *inner_protocol;
+    if (config_get_str(cfg, "server", "inner-protocol", &inner_protocol) == CONFIG_SUCCESS &&
+        strcmp(inner_protocol, "none") != 0)
+    {
+        server_options->inner_proto = inner_proto_find(inner_protocol);
+        if (!server_options->inner_proto)
+            log_f("Invalid value for 'inner-protocol'");
+    }
+    load_uint(cfg, "server", "shared-sockets", &server_options->shared_sockets);
+    load_bool(cfg, "server", "ssrc-steering", &server_options->ssrc_steering);
+    load_bool(cfg, "server", "cpu-affinity", &server_options->cpu_affinity);
+}
+
+void load_uint(config_t *cfg, const char *section, const char *key, unsigned int *value)
+{
+    int num;
+    int ret = config_get_int(cfg, section, key, &num);
+    if (ret == CONFIG_NO_PROPERTY_ERROR)
+        return;
+    if (ret != CONFIG_SUCCESS || num < 0)
+        log_f("Invalid value for '%s'", key);
+
+    *value = num;
+}
+
+void load_bool(config_t *cfg, const char *section, const char *key, bool *value)
+{
+    int ret = config_get_bool(cfg, section, key, value);
+    if (ret != CONFIG_SUCCESS && ret != CONFIG_NO_PROPERTY_ERROR)
+        log_f("Invalid value for '%s'", key);
+}
+
 void print_usage(FILE *out)
 {
     static const char MESSAGE[] = "Usage: %1$s <action> <options>\n"
@@ -344,7 +542,22 @@ action_t parse_action(const char *action)
 void signal_callback(EV_P_ ev_signal *w, int revents)
 {
     log_i("Bye bye!");
-    ev_break(EV_A_ EVBREAK_ALL);
+    rtptun_loop_break(EV_A);
+}
+
+void client_stats_callback(EV_P_ ev_signal *w, int revents)
+{
+    rtptun_client_log_stats(w->data);
+}
+
+void server_stats_callback(EV_P_ ev_signal *w, int revents)
+{
+    rtptun_server_log_stats(w->data);
+}
+
+void workers_stats_callback(EV_P_ ev_signal *w, int revents)
+{
+    rtptun_workers_log_stats(w->data);
 }
 
 void watch_signals(EV_P)
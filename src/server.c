@@ -13,21 +13,34 @@
 
 #include "proto/rtp.h"
 #include "proto/udp.h"
+#include "proto/dwell.h"
 
+#include "resolver.h"
 #include "rtptun.h"
 #include "log.h"
 
-static void rtp_recv_cb(rtp_socket_t *socket, unsigned char *data, ssize_t data_len, ssrc_t ssrc);
-static void udp_recv_cb(udp_socket_t *socket, unsigned char *data, ssize_t data_len,
-                        struct sockaddr_storage *address, socklen_t addrlen);
+static void rtp_recv_cb(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc);
+static void udp_recv_cb(udp_socket_t *socket, packet_t *packet);
+static void shared_recv_cb(udp_socket_t *socket, packet_t *packet);
 static void timeout_cb(EV_P_ ev_timer *timer, int revents);
+static void pool_cb(EV_P_ ev_idle *idle, int revents);
+
+static udp_socket_t *pool_take(rtptun_server_t *server);
+static bool pool_fill(rtptun_server_t *server);
+static void pool_free(rtptun_server_t *server);
+
+static udp_socket_t *shared_socket(rtptun_server_t *server, ssrc_t ssrc);
+static void shared_free(rtptun_server_t *server);
+static void session_learn(rtptun_server_t *server, const packet_t *packet, ssrc_t ssrc);
+static void session_map_expire(rtptun_server_t *server, bool all);
 
 static rtptun_rtp_info_t *info_map_set(rtptun_rtp_info_t **hash, ssrc_t ssrc, rtp_socket_t *rtp, udp_socket_t *sock);
 static rtptun_rtp_info_t *info_map_find(rtptun_rtp_info_t **hash, ssrc_t ssrc);
-static void info_map_free(rtptun_rtp_info_t **hash);
+static void info_map_free(rtptun_rtp_info_t **hash, udp_stats_t *closed_stats);
 
 rtptun_server_t *rtptun_server_new(struct ev_loop *loop, const char *listen_addr, const char *listen_port,
-                                   const char *dest_addr, const char *dest_port, const char *key)
+                                   const char *dest_addr, const char *dest_port, const char *key,
+                                   const udp_options_t *options, const rtptun_server_options_t *server_options)
 {
     rtptun_server_t *server = calloc(1, sizeof(*server));
     if (!server)
@@ -41,7 +54,44 @@ rtptun_server_t *rtptun_server_new(struct ev_loop *loop, const char *listen_addr
     server->dest_port = strdup(dest_port);
     server->info_map = NULL;
 
-    server->local_rtp = rtp_listen(loop, listen_addr, listen_port, key, rtp_recv_cb, NULL, server);
+    if (options)
+        server->options = *options;
+    else
+        server->options = (udp_options_t)UDP_OPTIONS_DEFAULT;
+
+    // Upstream sockets of new flows are created in the loop, so they can't wait for name lookups
+    server->dest = rtptun_resolver_new(loop, dest_addr, dest_port, RTPTUN_DEST_REFRESH);
+    if (!server->dest)
+    {
+        log_e("Failed to resolve destination [%s]:%s", dest_addr, dest_port);
+        goto error;
+    }
+
+    if (server_options && server_options->inner_proto)
+    {
+        if (server_options->shared_sockets == 0 || server_options->shared_sockets > RTPTUN_MAX_SHARED_SOCKETS)
+        {
+            log_e("Number of shared upstream sockets must be between 1 and %d", RTPTUN_MAX_SHARED_SOCKETS);
+            goto error;
+        }
+
+        server->shared = calloc(server_options->shared_sockets, sizeof(*server->shared));
+        if (!server->shared)
+        {
+            elog_e("calloc(udp_socket_t *) failed");
+            goto error;
+        }
+        server->shared_count = server_options->shared_sockets;
+        server->inner_proto = server_options->inner_proto;
+
+        for (unsigned int i = 0; i < server->shared_count; i++)
+        {
+            if (!shared_socket(server, i))
+                goto error;
+        }
+    }
+
+    server->local_rtp = rtp_listen(loop, listen_addr, listen_port, key, options, rtp_recv_cb, NULL, server);
     if (!server->local_rtp)
     {
         log_e("Failed to create RTP socket");
@@ -52,13 +102,25 @@ rtptun_server_t *rtptun_server_new(struct ev_loop *loop, const char *listen_addr
     server->to_timer.data = server;
     ev_timer_start(loop, &server->to_timer);
 
+    // Fill the pool right away, clients reconnecting after a restart all arrive at once
+    ev_idle_init(&server->pool_watcher, pool_cb);
+    server->pool_watcher.data = server;
+    while (!server->inner_proto && server->pool_len < RTPTUN_UPSTREAM_POOL && pool_fill(server))
+        ;
+
     return server;
 error:
     if (server)
     {
         if (server->local_rtp)
             rtp_destroy(server->local_rtp);
+        if (server->dest)
+            rtptun_resolver_free(server->dest);
+        pool_free(server);
+        shared_free(server);
 
+        free(server->dest_addr);
+        free(server->dest_port);
         free(server);
     }
 
@@ -69,16 +131,58 @@ void rtptun_server_free(rtptun_server_t *server)
 {
     rtp_destroy(server->local_rtp);
 
+    rtptun_resolver_free(server->dest);
     free(server->dest_addr);
     free(server->dest_port);
 
-    info_map_free(&server->info_map);
+    info_map_free(&server->info_map, &server->closed_stats);
+    pool_free(server);
+    shared_free(server);
+    session_map_expire(server, true);
 
     ev_timer_stop(server->loop, &server->to_timer);
+    ev_idle_stop(server->loop, &server->pool_watcher);
 
     free(server);
 }
 
+void rtptun_server_log_stats(rtptun_server_t *server)
+{
+    udp_stats_t upstream = server->closed_stats;
+
+    rtptun_rtp_info_t *current, *tmp;
+    HASH_ITER(hh, server->info_map, current, tmp)
+    {
+        if (current->remote_udp)
+            udp_stats_add(&upstream, &current->remote_udp->stats);
+    }
+    for (unsigned int i = 0; i < server->shared_count; i++)
+    {
+        if (server->shared[i])
+            udp_stats_add(&upstream, &server->shared[i]->stats);
+    }
+
+    udp_stats_log("RTP socket", &server->local_rtp->udp_sock->stats);
+    udp_stats_log("Upstream sockets", &upstream);
+    if (server->unroutable > 0)
+        log_i("Upstream sockets: %llu packets dropped without a matching %s session",
+              server->unroutable, server->inner_proto->name);
+    if (server->local_rtp->too_big > 0)
+        log_i("Upstream sockets: %llu datagrams dropped for exceeding the path MTU", server->local_rtp->too_big);
+    if (server->local_rtp->fragmented > 0)
+        log_i("RTP socket: %llu datagrams split into %llu fragments", server->local_rtp->fragmented, server->local_rtp->fragments);
+    if (server->local_rtp->reassembled > 0 || server->local_rtp->reassembly_timeouts > 0 || server->local_rtp->reassembly_evictions > 0)
+        log_i("RTP socket: %llu datagrams reassembled, %llu timed out, %llu evicted (peak memory %zu KiB)",
+              server->local_rtp->reassembled, server->local_rtp->reassembly_timeouts, server->local_rtp->reassembly_evictions,
+              server->local_rtp->reassembly_peak / 1024);
+    if (server->local_rtp->aggregates > 0)
+        log_i("RTP socket: %llu datagrams sent in %llu aggregate packets", server->local_rtp->aggregated,
+              server->local_rtp->aggregates);
+    dwell_log_stats("RTP socket", "Upstream sockets");
+    udp_backend_log_stats(server->loop);
+    packet_pool_log_stats();
+}
+
 rtptun_rtp_info_t *info_map_set(rtptun_rtp_info_t **hash, ssrc_t ssrc, rtp_socket_t *rtp, udp_socket_t *sock)
 {
     rtptun_rtp_info_t *info = malloc(sizeof(*info));
@@ -105,57 +209,121 @@ rtptun_rtp_info_t *info_map_find(rtptun_rtp_info_t **hash, ssrc_t ssrc)
     return result;
 }
 
-void info_map_free(rtptun_rtp_info_t **hash)
+void info_map_free(rtptun_rtp_info_t **hash, udp_stats_t *closed_stats)
 {
     rtptun_rtp_info_t *current, *tmp;
     HASH_ITER(hh, *hash, current, tmp)
     {
-        udp_destroy(current->remote_udp);
+        if (current->remote_udp)
+        {
+            udp_stats_add(closed_stats, &current->remote_udp->stats);
+            udp_destroy(current->remote_udp);
+        }
 
         HASH_DEL(*hash, current);
         free(current);
     }
 }
 
-void rtp_recv_cb(rtp_socket_t *socket, unsigned char *data, ssize_t data_len, ssrc_t ssrc)
+void rtp_recv_cb(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc)
 {
     rtptun_server_t *server = socket->user_data;
 
     rtptun_rtp_info_t *info = info_map_find(&server->info_map, ssrc);
     if (!info)
     {
-        udp_socket_t *udp_out = udp_connect(server->loop, server->dest_addr, server->dest_port,
-                                            udp_recv_cb, NULL, NULL);
-        if (!udp_out)
+        udp_socket_t *udp_out = NULL;
+        if (!server->inner_proto)
         {
-            log_e("Failed to connect to [%s]:%s", server->dest_addr, server->dest_port);
-            return;
+            udp_out = pool_take(server);
+            if (!udp_out)
+            {
+                log_e("Failed to connect to [%s]:%s", server->dest_addr, server->dest_port);
+                packet_free(packet);
+                return;
+            }
         }
 
         info = info_map_set(&server->info_map, ssrc, server->local_rtp, udp_out);
         if (!info)
         {
             log_e("Failed to map UDP socket");
+            if (udp_out)
+                udp_destroy(udp_out);
+            packet_free(packet);
             return;
         }
 
-        udp_out->user_data = info;
+        if (udp_out)
+            udp_out->user_data = info;
     }
 
     info->active = true;
 
-    if (udp_send(info->remote_udp, data, data_len) != 0)
+    udp_socket_t *udp_out = info->remote_udp;
+    if (server->inner_proto)
+    {
+        session_learn(server, packet, ssrc);
+
+        udp_out = shared_socket(server, ssrc);
+        if (!udp_out)
+        {
+            log_e("Failed to connect to [%s]:%s", server->dest_addr, server->dest_port);
+            packet_free(packet);
+            return;
+        }
+    }
+
+    if (udp_send_packet(udp_out, packet) != 0)
         log_e("Failed to send UDP packet");
 }
 
-void udp_recv_cb(udp_socket_t *socket, unsigned char *data, ssize_t data_len,
-                 struct sockaddr_storage *address, socklen_t addrlen)
+void udp_recv_cb(udp_socket_t *socket, packet_t *packet)
 {
     rtptun_rtp_info_t *info = socket->user_data;
 
+    // Pooled sockets don't belong to a flow yet
+    if (!info)
+    {
+        packet_free(packet);
+        return;
+    }
+
+    info->active = true;
+
+    if (rtp_drop_oversized(info->local_rtp, info->ssrc, socket, packet))
+        return;
+
+    if (rtp_send_packet(info->local_rtp, packet, info->ssrc) != 0)
+        log_e("Failed to send RTP packet");
+}
+
+void shared_recv_cb(udp_socket_t *socket, packet_t *packet)
+{
+    rtptun_server_t *server = socket->user_data;
+
+    // The socket says nothing about the client, the session in the inner header does
+    uint64_t id;
+    rtptun_session_t *session = NULL;
+    if (server->inner_proto->upstream_session(packet->data, packet->data_len, &id))
+        HASH_FIND(hh, server->session_map, &id, sizeof(id), session);
+
+    rtptun_rtp_info_t *info = (session) ? info_map_find(&server->info_map, session->ssrc) : NULL;
+    if (!info)
+    {
+        log_d("Dropping upstream packet without a known %s session", server->inner_proto->name);
+        server->unroutable++;
+        packet_free(packet);
+        return;
+    }
+
+    session->active = true;
     info->active = true;
 
-    if (rtp_send(info->local_rtp, data, data_len, info->ssrc) != 0)
+    if (rtp_drop_oversized(info->local_rtp, info->ssrc, socket, packet))
+        return;
+
+    if (rtp_send_packet(info->local_rtp, packet, info->ssrc) != 0)
         log_e("Failed to send RTP packet");
 }
 
@@ -173,10 +341,145 @@ void timeout_cb(EV_P_ ev_timer *timer, int revents)
         else
         {
             log_d("Client with SSRC #%d timed out", current->ssrc);
-            udp_destroy(current->remote_udp);
+            if (current->remote_udp)
+            {
+                udp_stats_add(&server->closed_stats, &current->remote_udp->stats);
+                udp_destroy(current->remote_udp);
+            }
 
             HASH_DEL(server->info_map, current);
             free(current);
         }
     }
+
+    session_map_expire(server, false);
+}
+
+udp_socket_t *pool_take(rtptun_server_t *server)
+{
+    const rtptun_resolver_t *dest = server->dest;
+
+    ev_idle_start(server->loop, &server->pool_watcher);
+
+    while (server->pool_len > 0)
+    {
+        udp_socket_t *sock = server->pool[--server->pool_len];
+
+        // Sockets created before the destination moved are of no use anymore
+        if (sock->remote_address_len == dest->address_len &&
+            memcmp(&sock->remote_address, &dest->address, dest->address_len) == 0)
+            return sock;
+
+        udp_destroy(sock);
+    }
+
+    return udp_connect_addr(server->loop, &dest->address, dest->address_len, &server->options,
+                            udp_recv_cb, NULL, NULL);
+}
+
+bool pool_fill(rtptun_server_t *server)
+{
+    udp_socket_t *sock = udp_connect_addr(server->loop, &server->dest->address, server->dest->address_len,
+                                          &server->options, udp_recv_cb, NULL, NULL);
+    if (!sock)
+        return false;
+
+    server->pool[server->pool_len++] = sock;
+    return true;
+}
+
+void pool_free(rtptun_server_t *server)
+{
+    while (server->pool_len > 0)
+        udp_destroy(server->pool[--server->pool_len]);
+}
+
+void pool_cb(EV_P_ ev_idle *idle, int revents)
+{
+    rtptun_server_t *server = idle->data;
+
+    // One socket per idle round, so a burst of new flows keeps being served in between
+    if (server->pool_len >= RTPTUN_UPSTREAM_POOL || !pool_fill(server))
+        ev_idle_stop(EV_A_ idle);
+}
+
+udp_socket_t *shared_socket(rtptun_server_t *server, ssrc_t ssrc)
+{
+    const rtptun_resolver_t *dest = server->dest;
+
+    // Each client sticks to one socket, so upstream keeps seeing it at the same address
+    udp_socket_t **slot = &server->shared[ssrc % server->shared_count];
+    if (*slot && (*slot)->remote_address_len == dest->address_len &&
+        memcmp(&(*slot)->remote_address, &dest->address, dest->address_len) == 0)
+        return *slot;
+
+    // Replace sockets created before the destination moved, sessions survive as they don't depend on them
+    if (*slot)
+    {
+        udp_stats_add(&server->closed_stats, &(*slot)->stats);
+        udp_destroy(*slot);
+    }
+
+    *slot = udp_connect_addr(server->loop, &dest->address, dest->address_len, &server->options,
+                             shared_recv_cb, NULL, server);
+    return *slot;
+}
+
+void shared_free(rtptun_server_t *server)
+{
+    for (unsigned int i = 0; i < server->shared_count; i++)
+    {
+        if (server->shared[i])
+        {
+            udp_stats_add(&server->closed_stats, &server->shared[i]->stats);
+            udp_destroy(server->shared[i]);
+        }
+    }
+
+    free(server->shared);
+    server->shared = NULL;
+    server->shared_count = 0;
+}
+
+void session_learn(rtptun_server_t *server, const packet_t *packet, ssrc_t ssrc)
+{
+    uint64_t id;
+    if (!server->inner_proto->client_session(packet->data, packet->data_len, &id))
+        return;
+
+    rtptun_session_t *session;
+    HASH_FIND(hh, server->session_map, &id, sizeof(id), session);
+    if (!session)
+    {
+        session = malloc(sizeof(*session));
+        if (!session)
+        {
+            elog_e("malloc(rtptun_session_t) failed");
+            return;
+        }
+
+        session->id = id;
+        HASH_ADD(hh, server->session_map, id, sizeof(session->id), session);
+    }
+
+    session->ssrc = ssrc;
+    session->active = true;
+}
+
+void session_map_expire(rtptun_server_t *server, bool all)
+{
+    // Same two round scheme as the flows, clients start new sessions on every handshake
+    rtptun_session_t *current, *tmp;
+    HASH_ITER(hh, server->session_map, current, tmp)
+    {
+        if (current->active && !all)
+        {
+            current->active = false;
+        }
+        else
+        {
+            HASH_DEL(server->session_map, current);
+            free(current);
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+
+#include "worker.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <ev.h>
+
+#include "server.h"
+#include "proto/udp.h"
+#include "proto/rtp.h"
+#include "proto/packet.h"
+#include "crypto/chacha.h"
+#include "loop.h"
+
+#include "log.h"
+
+static int worker_cpu(unsigned int id);
+static void *worker_run(void *arg);
+static void stop_callback(EV_P_ ev_async *async, int revents);
+static void stats_callback(EV_P_ ev_async *async, int revents);
+
+rtptun_workers_t *rtptun_workers_new(unsigned int count, const char *listen_addr, const char *listen_port,
+                                     const char *dest_addr, const char *dest_port, const char *key,
+                                     const udp_options_t *options, const rtptun_server_options_t *server_options,
+                                     const rtptun_loop_options_t *loop_options)
+{
+    rtptun_workers_t *workers = calloc(1, sizeof(*workers));
+    if (!workers)
+    {
+        elog_e("calloc(rtptun_workers_t) failed");
+        goto error;
+    }
+
+    if (count == 0 || count > RTPTUN_MAX_WORKERS)
+    {
+        log_e("Number of worker threads must be between 1 and %d", RTPTUN_MAX_WORKERS);
+        goto error;
+    }
+
+    workers->workers = calloc(count, sizeof(*workers->workers));
+    if (!workers->workers)
+    {
+        elog_e("calloc(rtptun_worker_t) failed");
+        goto error;
+    }
+    workers->count = count;
+
+    // A GRO buffer is steered by the SSRC of its first datagram only, while a client's datagrams for
+    // other SSRCs arriving back to back would get merged into it and end up on the wrong worker
+    bool steering = count > 1 && server_options && server_options->ssrc_steering;
+    if (steering && options->gro)
+        log_w("UDP GRO can't be combined with SSRC steering, disabling it on the listening sockets");
+
+    // Every worker binds its own listening socket to the same port
+    udp_options_t worker_options = *options;
+    worker_options.reuseport = true;
+
+    // Signals are handled by the default loop on the main thread only
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        rtptun_worker_t *worker = &workers->workers[i];
+        worker->id = i;
+        worker->loop_options = loop_options;
+        worker->cpu = (server_options && server_options->cpu_affinity) ? worker_cpu(i) : -1;
+
+        worker->loop = ev_loop_new(EVFLAG_AUTO);
+        if (!worker->loop)
+        {
+            log_e("Failed to create event loop for worker #%u", i);
+            goto thread_error;
+        }
+
+        worker->server = rtptun_server_new(worker->loop, listen_addr, listen_port,
+                                           dest_addr, dest_port, key, &worker_options, server_options);
+        if (!worker->server)
+        {
+            log_e("Failed to create server for worker #%u", i);
+            goto thread_error;
+        }
+
+        // Keep nonces of workers sharing the same key apart
+        chacha_set_domain(&worker->server->local_rtp->cipher, i);
+
+        // Only matters where the kernel falls back to picking a socket itself
+        if (worker->cpu >= 0)
+            udp_set_incoming_cpu(worker->server->local_rtp->udp_sock, worker->cpu);
+        if (steering && udp_disable_gro(worker->server->local_rtp->udp_sock) != 0)
+        {
+            log_e("Failed to disable UDP GRO for worker #%u", i);
+            goto thread_error;
+        }
+
+        ev_async_init(&worker->stop_watcher, stop_callback);
+        ev_async_start(worker->loop, &worker->stop_watcher);
+        ev_async_init(&worker->stats_watcher, stats_callback);
+        worker->stats_watcher.data = worker;
+        ev_async_start(worker->loop, &worker->stats_watcher);
+
+        // Pinned before it starts, so everything the thread allocates is local to its CPU
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (worker->cpu >= 0)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(worker->cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+
+        int ret = pthread_create(&worker->thread, &attr, worker_run, worker);
+        pthread_attr_destroy(&attr);
+        if (ret != 0)
+        {
+            errno = ret;
+            elog_e("pthread_create() failed");
+            goto thread_error;
+        }
+        worker->running = true;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    // Members of the SO_REUSEPORT group are numbered in the order the workers bound them, so the SSRC
+    // modulo the number of workers names the worker that owns the flow whatever its source address
+    if (steering)
+    {
+        if (udp_steer_reuseport(workers->workers[0].server->local_rtp->udp_sock, offsetof(rtphdr_t, ssrc),
+                                count) == 0)
+            log_d("Steering datagrams to workers by SSRC");
+        else
+            log_w("Failed to steer datagrams by SSRC, clients changing address may lose their state");
+    }
+
+    return workers;
+thread_error:
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+error:
+    if (workers)
+        rtptun_workers_free(workers);
+
+    return NULL;
+}
+
+void rtptun_workers_free(rtptun_workers_t *workers)
+{
+    for (unsigned int i = 0; i < workers->count; i++)
+    {
+        rtptun_worker_t *worker = &workers->workers[i];
+
+        if (worker->running)
+        {
+            ev_async_send(worker->loop, &worker->stop_watcher);
+            pthread_join(worker->thread, NULL);
+        }
+
+        if (worker->server)
+            rtptun_server_free(worker->server);
+        if (worker->loop)
+        {
+            ev_async_stop(worker->loop, &worker->stop_watcher);
+            ev_async_stop(worker->loop, &worker->stats_watcher);
+            ev_loop_destroy(worker->loop);
+        }
+    }
+
+    free(workers->workers);
+    free(workers);
+}
+
+void rtptun_workers_log_stats(rtptun_workers_t *workers)
+{
+    // Counters belong to the worker threads, let each of them report its own
+    for (unsigned int i = 0; i < workers->count; i++)
+        ev_async_send(workers->workers[i].loop, &workers->workers[i].stats_watcher);
+}
+
+int worker_cpu(unsigned int id)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        elog_w("sched_getaffinity() failed");
+        return -1;
+    }
+
+    // Hand out the CPUs the process may use in order, wrapping around with more workers than CPUs
+    int count = CPU_COUNT(&allowed);
+    if (count == 0)
+        return -1;
+
+    int n = id % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+            return cpu;
+    }
+
+    return -1;
+}
+
+void *worker_run(void *arg)
+{
+    rtptun_worker_t *worker = arg;
+
+    if (worker->cpu >= 0)
+        log_d("Worker #%u started on CPU %d", worker->id, worker->cpu);
+    else
+        log_d("Worker #%u started", worker->id);
+
+    rtptun_loop_run(worker->loop, worker->loop_options);
+
+    log_i("Worker #%u statistics:", worker->id);
+    rtptun_server_log_stats(worker->server);
+
+    // Sockets are torn down on the thread whose loop they ran on, along with what it keeps for them
+    rtptun_server_free(worker->server);
+    worker->server = NULL;
+
+    // Receive slots, sockets still closing and cached buffers belong to this thread and would otherwise
+    // outlive it, packets go back to the pool first
+    udp_thread_cleanup(worker->loop);
+    packet_pool_destroy();
+
+    log_d("Worker #%u stopped", worker->id);
+
+    return NULL;
+}
+
+void stop_callback(EV_P_ ev_async *async, int revents)
+{
+    rtptun_loop_break(EV_A);
+}
+
+void stats_callback(EV_P_ ev_async *async, int revents)
+{
+    rtptun_worker_t *worker = async->data;
+
+    log_i("Worker #%u statistics:", worker->id);
+    rtptun_server_log_stats(worker->server);
+}
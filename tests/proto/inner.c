@@ -0,0 +1,124 @@
+#include "test.h"
+
+#include "proto/inner.c"
+
+static size_t wg_message(unsigned char *data, unsigned int type, size_t data_len, uint32_t first, uint32_t second);
+
+static void test_proto_find(void);
+static void test_wg_client_session(void);
+static void test_wg_upstream_session(void);
+static void test_wg_malformed(void);
+
+int main(int argc, char **argv)
+{
+    test_run(test_proto_find);
+    test_run(test_wg_client_session);
+    test_run(test_wg_upstream_session);
+    test_run(test_wg_malformed);
+
+    return test_result();
+}
+
+size_t wg_message(unsigned char *data, unsigned int type, size_t data_len, uint32_t first, uint32_t second)
+{
+    memset(data, 0xaa, data_len);
+    data[0] = type;
+    memset(&data[1], 0, 3);
+    memcpy(&data[4], &first, sizeof(first));
+    memcpy(&data[8], &second, sizeof(second));
+
+    return data_len;
+}
+
+void test_proto_find(void)
+{
+    const inner_proto_t *proto = inner_proto_find("wireguard");
+    check(proto != NULL);
+    check(proto && proto->client_session == wg_client_session);
+    check(proto && proto->upstream_session == wg_upstream_session);
+
+    check(inner_proto_find("") == NULL);
+    check(inner_proto_find("WireGuard") == NULL);
+}
+
+void test_wg_client_session(void)
+{
+    unsigned char data[256];
+    uint64_t session = 0;
+    size_t len;
+
+    // Handshakes from the client name its session by their sender index
+    len = wg_message(data, WG_HANDSHAKE_INITIATION, WG_HANDSHAKE_INITIATION_LEN, 0x11223344, 0);
+    check(wg_client_session(data, len, &session) && session == 0x11223344);
+
+    len = wg_message(data, WG_HANDSHAKE_RESPONSE, WG_HANDSHAKE_RESPONSE_LEN, 0x55667788, 0x11223344);
+    check(wg_client_session(data, len, &session) && session == 0x55667788);
+
+    // Everything else belongs to a session already known
+    len = wg_message(data, WG_TRANSPORT_DATA, 64, 0x11223344, 0);
+    check(!wg_client_session(data, len, &session));
+
+    len = wg_message(data, WG_COOKIE_REPLY, WG_COOKIE_REPLY_LEN, 0x11223344, 0);
+    check(!wg_client_session(data, len, &session));
+}
+
+void test_wg_upstream_session(void)
+{
+    unsigned char data[256];
+    uint64_t session = 0;
+    size_t len;
+
+    // Upstream addresses the client by its receiver index
+    len = wg_message(data, WG_HANDSHAKE_RESPONSE, WG_HANDSHAKE_RESPONSE_LEN, 0x55667788, 0x11223344);
+    check(wg_upstream_session(data, len, &session) && session == 0x11223344);
+
+    len = wg_message(data, WG_COOKIE_REPLY, WG_COOKIE_REPLY_LEN, 0x11223344, 0);
+    check(wg_upstream_session(data, len, &session) && session == 0x11223344);
+
+    len = wg_message(data, WG_TRANSPORT_DATA, WG_TRANSPORT_DATA_MIN_LEN, 0x11223344, 0);
+    check(wg_upstream_session(data, len, &session) && session == 0x11223344);
+
+    len = wg_message(data, WG_TRANSPORT_DATA, sizeof(data), 0x99aabbcc, 0);
+    check(wg_upstream_session(data, len, &session) && session == 0x99aabbcc);
+
+    // An initiation only carries upstream's own index
+    len = wg_message(data, WG_HANDSHAKE_INITIATION, WG_HANDSHAKE_INITIATION_LEN, 0x11223344, 0);
+    check(!wg_upstream_session(data, len, &session));
+}
+
+void test_wg_malformed(void)
+{
+    unsigned char data[256];
+    uint64_t session = 0;
+    size_t len;
+
+    len = wg_message(data, WG_HANDSHAKE_INITIATION, WG_HANDSHAKE_INITIATION_LEN, 0x11223344, 0);
+    check(!wg_client_session(data, len - 1, &session));
+    check(!wg_client_session(data, len + 1, &session));
+
+    len = wg_message(data, WG_HANDSHAKE_RESPONSE, WG_HANDSHAKE_RESPONSE_LEN, 0x55667788, 0x11223344);
+    check(!wg_upstream_session(data, len - 1, &session));
+    check(!wg_client_session(data, len + 1, &session));
+
+    len = wg_message(data, WG_COOKIE_REPLY, WG_COOKIE_REPLY_LEN, 0x11223344, 0);
+    check(!wg_upstream_session(data, len - 1, &session));
+
+    len = wg_message(data, WG_TRANSPORT_DATA, WG_TRANSPORT_DATA_MIN_LEN - 1, 0x11223344, 0);
+    check(!wg_upstream_session(data, len, &session));
+
+    // The reserved bytes behind the type are zero in every message
+    len = wg_message(data, WG_TRANSPORT_DATA, 64, 0x11223344, 0);
+    data[2] = 1;
+    check(!wg_upstream_session(data, len, &session));
+
+    len = wg_message(data, WG_HANDSHAKE_INITIATION, WG_HANDSHAKE_INITIATION_LEN, 0x11223344, 0);
+    data[3] = 1;
+    check(!wg_client_session(data, len, &session));
+
+    len = wg_message(data, 5, 64, 0x11223344, 0);
+    check(!wg_client_session(data, len, &session));
+    check(!wg_upstream_session(data, len, &session));
+
+    check(!wg_client_session(data, 0, &session));
+    check(!wg_upstream_session(data, 7, &session));
+}
@@ -0,0 +1,390 @@
+#include "test.h"
+
+#include "proto/rtp.c"
+
+#define TEST_SSRC 0x12345678
+#define TEST_MAX_DELIVERED 16
+
+static packet_t *delivered[TEST_MAX_DELIVERED];
+static unsigned int delivered_count = 0;
+
+static void recv_callback(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc);
+static void delivered_clear(void);
+static bool delivered_is(unsigned int index, const char *data);
+
+static void socket_init(rtp_socket_t *socket, udp_socket_t *udp_sock, unsigned int reassembly_limit);
+static void socket_cleanup(rtp_socket_t *socket);
+static void fragment(rtp_socket_t *socket, uint16_t seq, unsigned int index, bool last, const char *data);
+static packet_t *aggregate_packet(const unsigned char *data, size_t data_len);
+static bool reassembling(rtp_socket_t *socket, uint16_t seq);
+
+static void test_fragments_in_order(void);
+static void test_fragments_out_of_order(void);
+static void test_fragments_last_first(void);
+static void test_fragments_duplicate(void);
+static void test_fragments_inconsistent(void);
+static void test_fragments_wraparound(void);
+static void test_reassembly_eviction(void);
+static void test_reassembly_too_large(void);
+static void test_aggregate_valid(void);
+static void test_aggregate_recv(void);
+static void test_aggregate_malformed(void);
+
+int main(int argc, char **argv)
+{
+    log_init(LOG_FATAL);
+
+    test_run(test_fragments_in_order);
+    test_run(test_fragments_out_of_order);
+    test_run(test_fragments_last_first);
+    test_run(test_fragments_duplicate);
+    test_run(test_fragments_inconsistent);
+    test_run(test_fragments_wraparound);
+    test_run(test_reassembly_eviction);
+    test_run(test_reassembly_too_large);
+    test_run(test_aggregate_valid);
+    test_run(test_aggregate_recv);
+    test_run(test_aggregate_malformed);
+
+    ev_loop_destroy(EV_DEFAULT);
+    packet_pool_destroy();
+
+    return test_result();
+}
+
+void recv_callback(rtp_socket_t *socket, packet_t *packet, ssrc_t ssrc)
+{
+    check(ssrc == TEST_SSRC);
+
+    if (delivered_count < TEST_MAX_DELIVERED)
+        delivered[delivered_count++] = packet;
+    else
+        packet_free(packet);
+}
+
+void delivered_clear(void)
+{
+    for (unsigned int i = 0; i < delivered_count; i++)
+        packet_free(delivered[i]);
+    delivered_count = 0;
+}
+
+bool delivered_is(unsigned int index, const char *data)
+{
+    if (index >= delivered_count)
+        return false;
+
+    return delivered[index]->data_len == strlen(data) && memcmp(delivered[index]->data, data, strlen(data)) == 0;
+}
+
+void socket_init(rtp_socket_t *socket, udp_socket_t *udp_sock, unsigned int reassembly_limit)
+{
+    memset(udp_sock, 0, sizeof(*udp_sock));
+    udp_sock->options.reassembly_limit = reassembly_limit;
+
+    memset(socket, 0, sizeof(*socket));
+    socket->loop = EV_DEFAULT;
+    socket->udp_sock = udp_sock;
+    socket->recv_cb = recv_callback;
+    ev_timer_init(&socket->reassembly_timer, reassembly_callback, RTP_REASSEMBLY_INTERVAL, RTP_REASSEMBLY_INTERVAL);
+    socket->reassembly_timer.data = socket;
+}
+
+void socket_cleanup(rtp_socket_t *socket)
+{
+    reassembly_free(socket);
+    delivered_clear();
+}
+
+void fragment(rtp_socket_t *socket, uint16_t seq, unsigned int index, bool last, const char *data)
+{
+    size_t data_len = strlen(data);
+    packet_t *packet = packet_alloc(RTP_FRAGMENT_HEADER + data_len);
+    packet->data[0] = index;
+    memcpy(&packet->data[RTP_FRAGMENT_HEADER], data, data_len);
+    packet->data_len = RTP_FRAGMENT_HEADER + data_len;
+
+    fragment_recv(socket, packet, TEST_SSRC, seq, last);
+}
+
+packet_t *aggregate_packet(const unsigned char *data, size_t data_len)
+{
+    packet_t *packet = packet_alloc(data_len);
+    memcpy(packet->data, data, data_len);
+    packet->data_len = data_len;
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)&packet->addr;
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(1234);
+    packet->addr_len = sizeof(*sin);
+
+    return packet;
+}
+
+bool reassembling(rtp_socket_t *socket, uint16_t seq)
+{
+    rtp_reassembly_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.ssrc = TEST_SSRC;
+    key.seq = seq;
+
+    rtp_reassembly_t *entry;
+    HASH_FIND(hh, socket->reassembly_map, &key, sizeof(key), entry);
+    return entry != NULL;
+}
+
+void test_fragments_in_order(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, UDP_DEFAULT_REASSEMBLY_LIMIT);
+
+    fragment(&socket, 10, 0, false, "abc");
+    fragment(&socket, 11, 1, false, "def");
+    check(delivered_count == 0);
+    fragment(&socket, 12, 2, true, "gh");
+
+    check(delivered_count == 1);
+    check(delivered_is(0, "abcdefgh"));
+    check(socket.reassembled == 1);
+    check(socket.reassembly_map == NULL);
+    check(socket.reassembly_bytes == 0);
+    check(socket.reassembly_peak > 0);
+
+    socket_cleanup(&socket);
+}
+
+void test_fragments_out_of_order(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, UDP_DEFAULT_REASSEMBLY_LIMIT);
+
+    fragment(&socket, 11, 1, false, "def");
+    fragment(&socket, 10, 0, false, "abc");
+    fragment(&socket, 13, 3, true, "ij");
+    check(delivered_count == 0);
+    fragment(&socket, 12, 2, false, "gh");
+
+    check(delivered_count == 1);
+    check(delivered_is(0, "abcdefghij"));
+    check(socket.reassembly_map == NULL);
+
+    socket_cleanup(&socket);
+}
+
+void test_fragments_last_first(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, UDP_DEFAULT_REASSEMBLY_LIMIT);
+
+    fragment(&socket, 22, 2, true, "gh");
+    check(reassembling(&socket, 20));
+    fragment(&socket, 21, 1, false, "def");
+    check(delivered_count == 0);
+    fragment(&socket, 20, 0, false, "abc");
+
+    check(delivered_count == 1);
+    check(delivered_is(0, "abcdefgh"));
+    check(socket.reassembly_map == NULL);
+
+    socket_cleanup(&socket);
+}
+
+void test_fragments_duplicate(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, UDP_DEFAULT_REASSEMBLY_LIMIT);
+
+    // The copy that arrived first is kept
+    fragment(&socket, 30, 0, false, "abc");
+    fragment(&socket, 30, 0, false, "xyz");
+    fragment(&socket, 31, 1, false, "def");
+    fragment(&socket, 31, 1, false, "xyz");
+    fragment(&socket, 32, 2, true, "gh");
+
+    check(delivered_count == 1);
+    check(delivered_is(0, "abcdefgh"));
+    check(socket.reassembled == 1);
+
+    // A duplicate behind the completed datagram starts over and never completes
+    fragment(&socket, 32, 2, true, "gh");
+    check(delivered_count == 1);
+    check(reassembling(&socket, 30));
+
+    socket_cleanup(&socket);
+}
+
+void test_fragments_inconsistent(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, UDP_DEFAULT_REASSEMBLY_LIMIT);
+
+    // Nothing may follow the last fragment, and there is only one of it
+    fragment(&socket, 41, 1, true, "def");
+    fragment(&socket, 42, 2, false, "xyz");
+    fragment(&socket, 42, 2, true, "xyz");
+    fragment(&socket, 40, 0, false, "abc");
+
+    check(delivered_count == 1);
+    check(delivered_is(0, "abcdef"));
+
+    // The last fragment can't come before one already received
+    fragment(&socket, 50, 0, false, "abc");
+    fragment(&socket, 52, 2, false, "gh");
+    fragment(&socket, 51, 1, true, "def");
+
+    check(delivered_count == 1);
+    check(reassembling(&socket, 50));
+
+    socket_cleanup(&socket);
+}
+
+void test_fragments_wraparound(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, UDP_DEFAULT_REASSEMBLY_LIMIT);
+
+    fragment(&socket, 65534, 0, false, "abc");
+    fragment(&socket, 65535, 1, false, "def");
+    fragment(&socket, 0, 2, true, "gh");
+
+    check(delivered_count == 1);
+    check(delivered_is(0, "abcdefgh"));
+
+    // Out of order across the wrap, keyed by the first fragment's sequence number all the same
+    fragment(&socket, 1, 3, true, "ij");
+    check(reassembling(&socket, 65534));
+    fragment(&socket, 0, 2, false, "gh");
+    fragment(&socket, 65534, 0, false, "abc");
+    check(delivered_count == 1);
+    fragment(&socket, 65535, 1, false, "def");
+
+    check(delivered_count == 2);
+    check(delivered_is(1, "abcdefghij"));
+    check(socket.reassembly_map == NULL);
+
+    socket_cleanup(&socket);
+}
+
+void test_reassembly_eviction(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, 8);
+
+    // Every fragment holds an MTU sized buffer, only a few datagrams fit into 8 KiB
+    for (uint16_t seq = 100; seq <= 500; seq += 100)
+        fragment(&socket, seq, 0, false, "abc");
+
+    check(socket.reassembly_evictions > 0);
+    check(socket.reassembly_bytes <= 8 * 1024);
+    check(!reassembling(&socket, 100));
+    check(reassembling(&socket, 500));
+
+    // The rest of an evicted datagram is nothing to complete
+    fragment(&socket, 101, 1, true, "def");
+    check(delivered_count == 0);
+
+    fragment(&socket, 501, 1, true, "def");
+    check(delivered_count == 1);
+    check(delivered_is(0, "abcdef"));
+
+    socket_cleanup(&socket);
+    check(socket.reassembly_bytes == 0);
+}
+
+void test_reassembly_too_large(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, 1);
+
+    fragment(&socket, 600, 0, false, "abc");
+
+    check(socket.reassembly_evictions == 1);
+    check(socket.reassembly_map == NULL);
+    check(socket.reassembly_bytes == 0);
+    check(delivered_count == 0);
+
+    socket_cleanup(&socket);
+}
+
+void test_aggregate_valid(void)
+{
+    const unsigned char valid[] = {0, 3, 'a', 'b', 'c', 0, 0, 0, 1, 'd'};
+    check(aggregate_valid(valid, sizeof(valid)));
+
+    const unsigned char empty[] = {0, 0};
+    check(aggregate_valid(empty, sizeof(empty)));
+    check(!aggregate_valid(empty, 0));
+
+    const unsigned char short_prefix[] = {0, 1, 'a', 0};
+    check(!aggregate_valid(short_prefix, sizeof(short_prefix)));
+
+    const unsigned char overrun[] = {0, 4, 'a', 'b', 'c'};
+    check(!aggregate_valid(overrun, sizeof(overrun)));
+
+    const unsigned char trailing[] = {0, 1, 'a', 0, 1};
+    check(!aggregate_valid(trailing, sizeof(trailing)));
+
+    unsigned char small[RTP_AGGREGATE_PREFIX + RTP_AGGREGATE_SMALL + 1];
+    memset(small, 'x', sizeof(small));
+    small[0] = RTP_AGGREGATE_SMALL >> 8;
+    small[1] = RTP_AGGREGATE_SMALL & 0xff;
+    check(aggregate_valid(small, RTP_AGGREGATE_PREFIX + RTP_AGGREGATE_SMALL));
+
+    small[0] = (RTP_AGGREGATE_SMALL + 1) >> 8;
+    small[1] = (RTP_AGGREGATE_SMALL + 1) & 0xff;
+    check(!aggregate_valid(small, sizeof(small)));
+}
+
+void test_aggregate_recv(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, UDP_DEFAULT_REASSEMBLY_LIMIT);
+
+    const unsigned char data[] = {0, 3, 'a', 'b', 'c', 0, 0, 0, 2, 'd', 'e'};
+    packet_t *packet = aggregate_packet(data, sizeof(data));
+    packet->ecn = IPTOS_ECN_ECT0;
+    packet->rx_time = 42;
+    aggregate_recv(&socket, packet, TEST_SSRC);
+
+    check(delivered_count == 3);
+    check(delivered_is(0, "abc"));
+    check(delivered_is(1, ""));
+    check(delivered_is(2, "de"));
+    for (unsigned int i = 0; i < delivered_count; i++)
+    {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)&delivered[i]->addr;
+        check(delivered[i]->addr_len == sizeof(*sin));
+        check(sin->sin_family == AF_INET && sin->sin_port == htons(1234));
+        check(delivered[i]->ecn == IPTOS_ECN_ECT0);
+        check(delivered[i]->rx_time == 42);
+    }
+
+    socket_cleanup(&socket);
+}
+
+void test_aggregate_malformed(void)
+{
+    rtp_socket_t socket;
+    udp_socket_t udp_sock;
+    socket_init(&socket, &udp_sock, UDP_DEFAULT_REASSEMBLY_LIMIT);
+
+    // The well-formed first datagram isn't delivered either
+    const unsigned char data[] = {0, 1, 'a', 0, 5, 'b'};
+    aggregate_recv(&socket, aggregate_packet(data, sizeof(data)), TEST_SSRC);
+    check(delivered_count == 0);
+
+    aggregate_recv(&socket, aggregate_packet(data, 0), TEST_SSRC);
+    check(delivered_count == 0);
+
+    socket_cleanup(&socket);
+}
@@ -0,0 +1,29 @@
+#ifndef RTPTUN_TESTS_TEST_H
+#define RTPTUN_TESTS_TEST_H
+
+#include <stdio.h>
+
+// Failed checks are counted rather than aborting, so one run reports all of them
+static unsigned int test_failures = 0;
+
+#define check(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                         \
+        }                                                                            \
+    } while (0)
+
+#define test_run(test)                                                                     \
+    do                                                                                     \
+    {                                                                                      \
+        unsigned int failures = test_failures;                                             \
+        test();                                                                            \
+        fprintf(stderr, "%s %s\n", (test_failures == failures) ? "PASS" : "FAIL", #test); \
+    } while (0)
+
+#define test_result() ((test_failures == 0) ? 0 : 1)
+
+#endif